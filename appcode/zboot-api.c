@@ -7,12 +7,14 @@
  */
 
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "zboot-api.h"
 #include "esprtc.h"
 #include "esprom.h"
 #include "zboot_util.h"
+#include "zboot_log.h"
 #include "zboot.h"
 
 #if defined(ZBOOT_API_DEBUG)
@@ -36,8 +38,63 @@ void *pvPortMalloc(size_t xSize);
 
 #endif
 
+#if defined(ZBOOT_API_PTHREAD)
+
+#include <pthread.h>
+static pthread_mutex_t g_zboot_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ZBOOT_LOCK()   pthread_mutex_lock(&g_zboot_mutex)
+#define ZBOOT_UNLOCK() pthread_mutex_unlock(&g_zboot_mutex)
+typedef pthread_t zboot_owner;
+#define ZBOOT_OWNER()          pthread_self()
+#define ZBOOT_IS_OWNER(owner)  pthread_equal((owner), pthread_self())
+
+#elif defined(ZBOOT_API_FREERTOS)
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+static SemaphoreHandle_t g_zboot_mutex = NULL;  // Created by zboot_api_init()
+#define ZBOOT_LOCK()   do { if(NULL != g_zboot_mutex) xSemaphoreTake(g_zboot_mutex, portMAX_DELAY); } while(0)
+#define ZBOOT_UNLOCK() do { if(NULL != g_zboot_mutex) xSemaphoreGive(g_zboot_mutex); } while(0)
+typedef TaskHandle_t zboot_owner;
+#define ZBOOT_OWNER()          xTaskGetCurrentTaskHandle()
+#define ZBOOT_IS_OWNER(owner)  ((owner) == xTaskGetCurrentTaskHandle())
+
+#else
+
+#define ZBOOT_LOCK()
+#define ZBOOT_UNLOCK()
+typedef uint8_t zboot_owner;
+#define ZBOOT_OWNER()          0
+#define ZBOOT_IS_OWNER(owner)  true
+
+#endif
+
+#define ZBOOT_BARRIER() __sync_synchronize()
+
+#define ZBOOT_INVALID_INDEX 0xff
+
+static volatile uint32_t g_zboot_sequence = 0;
 static zboot_rtc_data g_zboot_rtc;
-static bool g_zboot_rtc_set = false;
+static volatile bool g_zboot_rtc_set = false;
+static zboot_config g_zboot_config;
+static volatile bool g_zboot_config_set = false;
+static zboot_log g_zboot_log;
+static bool g_zboot_log_set = false;
+static zboot_config g_zboot_pending_config;
+static bool g_zboot_pending = false;
+static zboot_owner g_zboot_pending_owner;  // Task that began the config update
+static zboot_catalog g_zboot_catalog;
+static volatile bool g_zboot_catalog_set = false;
+static zboot_partition_table g_zboot_partitions;
+static uint8_t g_zboot_partition_first[ZBOOT_PARTITION_TYPES + 1];  // Index of each type's first entry
+static volatile bool g_zboot_partitions_set = false;
+static uint8_t *g_zboot_scratch = NULL;  // Set by zboot_api_init_buffer()
+static uint32_t g_zboot_scratch_size = 0;
+static bool g_zboot_scratch_busy = false;
+static uint8_t *g_zboot_work = NULL;     // Rest of the same buffer
+static uint32_t g_zboot_work_size = 0;
+static bool g_zboot_work_busy = false;
 
 extern void ets_printf(const char*, ...);
 extern void Cache_Read_Enable_original(uint8_t, uint8_t, uint8_t);
@@ -56,7 +113,32 @@ SpiFlashOpResult spi_flash_erase_sector(uint16_t sec);
 SpiFlashOpResult spi_flash_write(uint32_t des_addr, uint32_t *src_addr, uint32_t size);
 SpiFlashOpResult spi_flash_read(uint32_t src_addr, uint32_t *des_addr, uint32_t size);
 
+// Flash is erased one sector at a time with the SDK function, unless ZBOOT_API_BLOCK_ERASE is
+//  defined to erase 64kB blocks where possible. The SDK only provides a sector erase, so
+//  blocks are erased with the ROM function, with interrupts off and the flash cache disabled
+//  for the whole erase: typically 150ms to 500ms, and up to 2s on some parts, during which
+//  the watchdog isn't fed and no interrupt is serviced. The ROM has no 32kB block erase.
+#if !defined(__esp32__) && defined(ZBOOT_API_BLOCK_ERASE)
+#define ZBOOT_BLOCK_ERASE 1
+extern uint32_t SPIEraseBlock(uint32_t block);
+extern void Cache_Read_Disable(void);
+extern void Cache_Read_Enable(uint8_t, uint8_t, uint8_t);
+extern void ets_intr_lock(void);
+extern void ets_intr_unlock(void);
+#else
+#define ZBOOT_BLOCK_ERASE 0
+#endif
+
+#define ZBOOT_BLOCK_SIZE    0x10000
+#define ZBOOT_BLOCK_SECTORS (ZBOOT_BLOCK_SIZE / SECTOR_SIZE)
+#define ZBOOT_BLOCK_ERASE_US 500000  // Assumed time for a block erase, until one's been timed
+
 #if defined(__esp32__)
+static uint32_t system_get_time(void)
+{
+   return 0;
+}
+
 bool system_rtc_mem_write(uint8_t des_addr, const void *src_addr, uint16_t save_size)
 {
    return false;
@@ -67,629 +149,3125 @@ bool system_rtc_mem_read(uint8_t des_addr, const void *src_addr, uint16_t save_s
    return false;
 }
 #else
+extern uint32_t system_get_time(void);
 extern bool system_rtc_mem_write(uint8_t des_addr, const void *src_addr, uint16_t save_size);
 extern bool system_rtc_mem_read(uint8_t des_addr, const void *src_addr, uint16_t save_size);
 #endif
 
+#if ZBOOT_BLOCK_ERASE
+// Runs from IRAM, since flash-mapped code can't execute while the cache is disabled
+static SpiFlashOpResult __attribute__((section(".entry.text"))) zboot_rom_erase_block(uint32_t block)
+{
+   uint32_t result;
+
+   ets_intr_lock();
+   Cache_Read_Disable();
+   result = SPIEraseBlock(block);
+   Cache_Read_Enable(0, 0, 1);  // Restores the image's flash window; see Cache_Read_Enable_New()
+   ets_intr_unlock();
+   return (0 == result) ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
+#else
+static SpiFlashOpResult zboot_rom_erase_block(uint32_t block)
+{
+   return SPI_FLASH_RESULT_ERR;
+}
+#endif
+
 /* ----------------------------------------------------------------------------------------
- * Private Helper Functions
+ * Flash access. With ZBOOT_API_STATS defined, each operation is counted and timed by the
+ *  kind of data it accesses; otherwise the SDK functions are called directly. Header reads
+ *  made by the get operations don't take the API lock, so their counts are approximate
+ *  when several tasks use the API.
  */
 
-static bool zboot_get_config(zboot_config *config)
+#if defined(ZBOOT_API_STATS)
+
+static zboot_stats g_zboot_stats;
+
+static inline uint32_t zboot_ccount(void)
 {
-   uint8_t checksum;
+#if defined(__XTENSA__)
+   uint32_t ccount;
+   __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+   return ccount;
+#else
+   return 0;
+#endif
+}
+
+static void zboot_stats_record(uint8_t category, uint8_t op, uint32_t bytes, uint32_t start)
+{
+   zboot_op_stats *stats = &g_zboot_stats.op[category][op];
+   uint32_t cycles = zboot_ccount() - start;
+   uint8_t bucket = 0;
+
+   while(bucket < ZBOOT_STATS_BUCKETS - 1 && cycles >= ZBOOT_STATS_BUCKET_LIMIT(bucket))
+      ++bucket;
+   ++stats->count;
+   stats->bytes += bytes;
+   stats->cycles += cycles;
+   if(cycles > stats->max_cycles)
+      stats->max_cycles = cycles;
+   ++stats->histogram[bucket];
+}
+
+static SpiFlashOpResult zboot_spi_read(uint8_t category, uint32_t addr, void *buffer,
+   uint32_t length)
+{
+   uint32_t start = zboot_ccount();
+   SpiFlashOpResult result = spi_flash_read(addr, (uint32_t *) buffer, length);
+   zboot_stats_record(category, ZBOOT_STATS_READ, length, start);
+   return result;
+}
+
+static SpiFlashOpResult zboot_spi_write(uint8_t category, uint32_t addr, const void *buffer,
+   uint32_t length)
+{
+   uint32_t start = zboot_ccount();
+   SpiFlashOpResult result = spi_flash_write(addr, (uint32_t *) buffer, length);
+   zboot_stats_record(category, ZBOOT_STATS_WRITE, length, start);
+   return result;
+}
+
+static SpiFlashOpResult zboot_spi_erase(uint8_t category, uint32_t sector)
+{
+   uint32_t start = zboot_ccount();
+   SpiFlashOpResult result = spi_flash_erase_sector(sector);
+   zboot_stats_record(category, ZBOOT_STATS_ERASE, SECTOR_SIZE, start);
+   return result;
+}
+
+static SpiFlashOpResult zboot_spi_erase_block(uint8_t category, uint32_t block)
+{
+   uint32_t start = zboot_ccount();
+   SpiFlashOpResult result = zboot_rom_erase_block(block);
+   zboot_stats_record(category, ZBOOT_STATS_ERASE, ZBOOT_BLOCK_SIZE, start);
+   return result;
+}
+
+#else
+
+#define zboot_spi_read(category, addr, buffer, length) \
+   spi_flash_read(addr, (uint32_t *) (buffer), length)
+#define zboot_spi_write(category, addr, buffer, length) \
+   spi_flash_write(addr, (uint32_t *) (buffer), length)
+#define zboot_spi_erase(category, sector) \
+   spi_flash_erase_sector(sector)
+#define zboot_spi_erase_block(category, block) \
+   zboot_rom_erase_block(block)
+
+#endif
+
+/* ----------------------------------------------------------------------------------------
+ * Wear tracking. With BOOT_WEAR_ENABLED, every sector erase made by the API is counted in
+ *  the wear sector (see zboot_wear_sector). The counters are cached after they're first
+ *  read. Caller must hold the API lock.
+ */
+
+#if defined(BOOT_WEAR_ENABLED)
+
+#define ZBOOT_WEAR_TALLY_ADDR(region) \
+   (BOOT_WEAR_SECTOR * SECTOR_SIZE + offsetof(zboot_wear_sector, tally) \
+    + (region) * ZBOOT_WEAR_TALLY_WORDS * sizeof(uint32_t))
+
+static zboot_wear_header g_zboot_wear;
+static uint16_t g_zboot_wear_tally[ZBOOT_WEAR_REGIONS];  // Bits cleared in each region's tally
+static bool g_zboot_wear_set = false;
+
+// Move the tallies into the base counts and rewrite the wear sector
+static bool zboot_wear_fold(void)
+{
+   uint8_t region;
 
-   // Read the structure from flash
-   if(spi_flash_read(BOOT_CONFIG_SECTOR * SECTOR_SIZE,
-      (uint32_t*)config, sizeof(*config)) != SPI_FLASH_RESULT_OK)
+   g_zboot_wear_set = false;
+   g_zboot_wear.magic = ZBOOT_WEAR_MAGIC;
+   g_zboot_wear.regions = ZBOOT_WEAR_REGIONS;
+   for(region = 0; region < ZBOOT_WEAR_REGIONS; ++region)
    {
-      DEBUG("zboot: Failed to read zboot config from flash\n");
-      return false;
+      g_zboot_wear.base[region] += g_zboot_wear_tally[region];
+      g_zboot_wear_tally[region] = 0;
    }
 
-   if(config->magic != ZBOOT_CONFIG_MAGIC)
-      return false;
-
-   // Validate checksum
-   checksum = zboot_config_checksum(config);
-   if(checksum != config->chksum)
+   if(zboot_spi_erase(ZBOOT_STATS_CONFIG, BOOT_WEAR_SECTOR) != SPI_FLASH_RESULT_OK
+   || zboot_spi_write(ZBOOT_STATS_CONFIG, BOOT_WEAR_SECTOR * SECTOR_SIZE, &g_zboot_wear,
+         sizeof(g_zboot_wear)) != SPI_FLASH_RESULT_OK)
    {
-      DEBUG("zboot: Checksum mismatch on zboot config (calculated %08x, expected %08x)\n",
-         checksum, config->chksum);
+      DEBUG("zboot: Failed to write wear sector\n");
       return false;
    }
-
+   g_zboot_wear_set = true;
    return true;
 }
 
-// Note: This preserves the contents of the sector unused by zboot config 
-static bool zboot_set_config(zboot_config *config)
+static bool zboot_wear_load(void)
 {
-   uint8_t *buffer;
-   bool success = true;
+   uint32_t tally[ZBOOT_WEAR_TALLY_WORDS];
+   uint8_t region, word;
 
-   buffer = (uint8_t*)os_malloc(SECTOR_SIZE);
-   if (NULL == buffer)
-   {
-      DEBUG("zboot: Failed to allocate memory while writing zboot config\n"); 
+   if(g_zboot_wear_set)
+      return true;
+
+   if(zboot_spi_read(ZBOOT_STATS_CONFIG, BOOT_WEAR_SECTOR * SECTOR_SIZE, &g_zboot_wear,
+      sizeof(g_zboot_wear)) != SPI_FLASH_RESULT_OK)
       return false;
-   }
-	
-   if(spi_flash_read(BOOT_CONFIG_SECTOR * SECTOR_SIZE,
-      (uint32_t*)((void*)buffer), SECTOR_SIZE) != SPI_FLASH_RESULT_OK)
-   {
-      DEBUG("zboot: Failed to read zboot config sector\n");
-      success = false;
-   }
-   else if(spi_flash_erase_sector(BOOT_CONFIG_SECTOR) != SPI_FLASH_RESULT_OK)
+   if(g_zboot_wear.magic != ZBOOT_WEAR_MAGIC || g_zboot_wear.regions != ZBOOT_WEAR_REGIONS)
    {
-      DEBUG("zboot: Failed to erase zboot config sector\n");
-      success = false;
+      DEBUG("zboot: Initializing wear sector\n");
+      memset(&g_zboot_wear, 0, sizeof(g_zboot_wear));
+      memset(g_zboot_wear_tally, 0, sizeof(g_zboot_wear_tally));
+      return zboot_wear_fold();
    }
-   else
-   {
-      if(NULL != config)
-      {
-         config->chksum = zboot_config_checksum(config);
-         memcpy(buffer, config, sizeof(*config));  // Always at the start of the sector
-      }
-      else
-         memset(buffer, 0, sizeof(*config));  // Erase configuration
 
-      if(spi_flash_write(BOOT_CONFIG_SECTOR * SECTOR_SIZE,
-         (uint32_t*)((void*)buffer), SECTOR_SIZE) != SPI_FLASH_RESULT_OK)
-      {
-         DEBUG("zboot: Failed to write zboot config sector\n");
-         success = false;
-      }
+   for(region = 0; region < ZBOOT_WEAR_REGIONS; ++region)
+   {
+      if(zboot_spi_read(ZBOOT_STATS_CONFIG, ZBOOT_WEAR_TALLY_ADDR(region), tally, sizeof(tally))
+         != SPI_FLASH_RESULT_OK)
+         return false;
+      g_zboot_wear_tally[region] = 0;
+      for(word = 0; word < ZBOOT_WEAR_TALLY_WORDS; ++word)
+         g_zboot_wear_tally[region] += 32 - __builtin_popcount(tally[word]);
    }
-	
-   os_free(buffer);
-   return success;
+   g_zboot_wear_set = true;
+   return true;
 }
 
-static bool zboot_get_rtc_data(zboot_rtc_data *rtc)
+// Count 'count' erases of sectors within one region, starting at 'sector'
+static void zboot_wear_record(uint32_t sector, uint16_t count)
 {
-   uint8_t checksum;
+   uint32_t region = (sector * SECTOR_SIZE) / ZBOOT_WEAR_REGION_SIZE;
+   uint32_t bit, bits, value;
 
-   if(g_zboot_rtc_set)
-   {
-      memcpy(rtc, &g_zboot_rtc, sizeof(*rtc));
-      return true;
-   }
+   if(region >= ZBOOT_WEAR_REGIONS || sector == BOOT_WEAR_SECTOR || !zboot_wear_load())
+      return;
+   if(g_zboot_wear_tally[region] + count > ZBOOT_WEAR_TALLY_BITS && !zboot_wear_fold())
+      return;
 
-   if(!system_rtc_mem_read(ZBOOT_RTC_ADDR/sizeof(uint32_t), rtc, sizeof(*rtc)))
-   {
-      DEBUG("%s: Failed to read RTC memory\n", __func__);
-      return false;
-   }
-   checksum = zboot_rtc_checksum(rtc);
-   if(rtc->chksum != checksum)
+   // Clear the next bits of the tally, one word at a time
+   while(count > 0)
    {
-      DEBUG("%s: checksum mismatch calculated=%02x, expected=%02x\n",
-         __func__, checksum, rtc->chksum);
-      return false;
+      bit = g_zboot_wear_tally[region] % 32;
+      bits = (bit + count > 32) ? 32 - bit : count;
+      value = (bit + bits == 32) ? 0 : (0xffffffff << (bit + bits));
+      if(zboot_spi_write(ZBOOT_STATS_CONFIG, ZBOOT_WEAR_TALLY_ADDR(region)
+         + (g_zboot_wear_tally[region] / 32) * sizeof(uint32_t), &value, sizeof(value))
+         != SPI_FLASH_RESULT_OK)
+         return;
+      g_zboot_wear_tally[region] += bits;
+      count -= bits;
    }
+}
 
-   memcpy(&g_zboot_rtc, rtc, sizeof(*rtc));
-   g_zboot_rtc_set = true;
+// Erases counted in the region containing an address
+static bool zboot_read_wear(uint32_t address, uint32_t *erases)
+{
+   uint32_t region = address / ZBOOT_WEAR_REGION_SIZE;
+
+   if(region >= ZBOOT_WEAR_REGIONS || !zboot_wear_load())
+      return false;
+   *erases = g_zboot_wear.base[region] + g_zboot_wear_tally[region];
    return true;
 }
 
-static bool zboot_set_rtc_data(zboot_rtc_data *rtc)
+#endif
+
+static SpiFlashOpResult zboot_erase_sector(uint8_t category, uint32_t sector)
 {
-   rtc->chksum = esp_checksum8((uint8_t*)rtc, (sizeof(*rtc)-sizeof(uint8_t)));
-   return system_rtc_mem_write(ZBOOT_RTC_ADDR/sizeof(uint32_t), rtc, sizeof(*rtc));
+   SpiFlashOpResult result = zboot_spi_erase(category, sector);
+#if defined(BOOT_WEAR_ENABLED)
+   if(result == SPI_FLASH_RESULT_OK)
+      zboot_wear_record(sector, 1);
+#endif
+   return result;
 }
 
-static bool zboot_get_image_header(uint32_t offset, zimage_header *header)
+static SpiFlashOpResult zboot_erase_block(uint8_t category, uint32_t block)
 {
-   if(spi_flash_read(offset, (uint32_t*)header, sizeof(*header)) != SPI_FLASH_RESULT_OK)
-      return false;
-   else
-      return true;
+   SpiFlashOpResult result = zboot_spi_erase_block(category, block);
+#if defined(BOOT_WEAR_ENABLED)
+   if(result == SPI_FLASH_RESULT_OK)
+      zboot_wear_record(block * ZBOOT_BLOCK_SECTORS, ZBOOT_BLOCK_SECTORS);
+#endif
+   return result;
 }
 
-// ----------------------------------------------------------------------------------
-// Set Operations
+/* ----------------------------------------------------------------------------------------
+ * Working memory. The buffer given to zboot_api_init_buffer() is split in two: scratch
+ *  memory, used within a single step of another operation (compacting the config log, or
+ *  keeping the unchanged start of a sector that a write must erase), and the work buffer,
+ *  which stages unaligned data and queues asynchronous writes, and so is held while the
+ *  scratch memory is in use. Once a buffer has been given, memory is never allocated; an
+ *  operation fails if the part it needs is too small or in use. Without one, memory is
+ *  allocated as it's needed. Caller must hold the API lock.
+ */
 
-bool zboot_set_coldboot_index(uint8_t index)
+// Returns a buffer of at least 'minimum' bytes, and its size in 'size'. If memory has to be
+//  allocated, the size requested in 'size' is used.
+static uint8_t *zboot_buffer_alloc(uint8_t *region, uint32_t regionSize, bool *busy,
+   uint32_t *size, uint32_t minimum)
 {
-   zboot_config config;
-   DEBUG("%s: index\n", __func__, index);
-   if(!zboot_get_config(&config))
-      return false;
-   if (index >= config.count)
-      return false;
-   config.current_rom = index;
-   return zboot_set_config(&config);
+   uint8_t *buffer;
+
+   if(NULL != g_zboot_scratch)
+   {
+      if(*busy || regionSize < minimum)
+      {
+         DEBUG("zboot: No %u byte buffer available\n", minimum);
+         return NULL;
+      }
+      *busy = true;
+      *size = regionSize;
+      return region;
+   }
+
+   buffer = (uint8_t *)os_malloc(*size);
+   if(NULL == buffer)
+      DEBUG("zboot: Failed to allocate %u bytes\n", *size);
+   return buffer;
 }
 
-bool zboot_set_gpio_number(uint8_t index)
+static uint8_t *zboot_work_alloc(uint32_t *size, uint32_t minimum)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   config.gpio_num = index;
-   return zboot_set_config(&config);
+   return zboot_buffer_alloc(g_zboot_work, g_zboot_work_size, &g_zboot_work_busy, size, minimum);
 }
 
-bool zboot_invalidate_index(uint8_t index)
+static uint8_t *zboot_scratch_alloc(uint32_t *size, uint32_t minimum)
 {
-   zboot_config config;
-   int32_t sector;
-   DEBUG("%s: index\n", __func__, index);
-   if(!zboot_get_config(&config))
-      return false;
-   if(index >= config.count)
-      return false;
-   sector = config.roms[index] / SECTOR_SIZE;
-   return (spi_flash_erase_sector(sector) == SPI_FLASH_RESULT_OK);
+   return zboot_buffer_alloc(g_zboot_scratch, g_zboot_scratch_size, &g_zboot_scratch_busy,
+      size, minimum);
 }
 
-bool zboot_set_boot_mode(uint8_t mode)
+static void zboot_work_free(uint8_t *buffer)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   config.mode = mode;
-   return zboot_set_config(&config);
+   if(NULL != g_zboot_scratch)
+   {
+      if(buffer == g_zboot_work)
+         g_zboot_work_busy = false;
+      else if(buffer == g_zboot_scratch)
+         g_zboot_scratch_busy = false;
+   }
+   else if(NULL != buffer)
+      os_free(buffer);
 }
 
-bool zboot_set_option(uint8_t option, bool enable)
+/* ----------------------------------------------------------------------------------------
+ * Private Helper Functions
+ */
+
+static uint32_t zboot_flash_read(uint32_t addr, void *buffer, uint32_t length)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   if(enable)
-      config.options |= option;
-   else
-      config.options &= ~option;
-   return zboot_set_config(&config);
+   return (zboot_spi_read(ZBOOT_STATS_CONFIG, addr, buffer, length) == SPI_FLASH_RESULT_OK) ? 0 : 1;
 }
 
-bool zboot_set_failsafe_index(uint8_t index)
+static uint32_t zboot_flash_write(uint32_t addr, const void *buffer, uint32_t length)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   if(index >= config.count)
-      return false;
-   config.failsafe_rom = index;
-   return zboot_set_config(&config);
+   return (zboot_spi_write(ZBOOT_STATS_CONFIG, addr, buffer, length) == SPI_FLASH_RESULT_OK) ? 0 : 1;
 }
 
-bool zboot_set_temp_index(uint8_t index)
+static uint32_t zboot_flash_erase(uint32_t sector)
 {
-   zboot_rtc_data rtc;
-   zboot_config config;
+   return (zboot_erase_sector(ZBOOT_STATS_CONFIG, sector) == SPI_FLASH_RESULT_OK) ? 0 : 1;
+}
 
-   if(!zboot_get_config(&config))
-      return false;
-   if(index >= config.count)
-      return false;
+// Read flash at any alignment, a word-aligned chunk at a time
+static bool zboot_read_bytes(uint32_t addr, uint8_t *buffer, uint32_t length)
+{
+   uint32_t chunk[16];
+   uint32_t pos = 0, skip, piece;
 
-   if(!zboot_get_rtc_data(&rtc))
+   if(0 == (addr % sizeof(uint32_t)) && 0 == ((uintptr_t) buffer % sizeof(uint32_t))
+   && length >= sizeof(uint32_t))
    {
-      DEBUG("zboot: Invalid RTC data; reinitializing\n");
-      rtc.magic = ZBOOT_RTC_MAGIC;
-      rtc.last_mode = ZBOOT_MODE_STANDARD;
-      rtc.last_rom = 0;
+      pos = length - (length % sizeof(uint32_t));
+      if(zboot_spi_read(ZBOOT_STATS_OTA, addr, buffer, pos) != SPI_FLASH_RESULT_OK)
+         return false;
    }
-   rtc.next_mode = ZBOOT_MODE_TEMP_ROM;
-   rtc.next_rom = index;
-   return zboot_set_rtc_data(&rtc);
+   for(; pos < length; pos += piece)
+   {
+      skip = (addr + pos) % sizeof(uint32_t);
+      piece = sizeof(chunk) - skip;
+      if(piece > length - pos)
+         piece = length - pos;
+      if(zboot_spi_read(ZBOOT_STATS_OTA, addr + pos - skip, chunk,
+         (skip + piece + sizeof(uint32_t) - 1) & ~3) != SPI_FLASH_RESULT_OK)
+         return false;
+      memcpy(buffer + pos, (uint8_t *) chunk + skip, piece);
+   }
+   return true;
 }
 
-bool zboot_erase_config(void)
+static const zboot_flash_ops g_zboot_flash_ops = {
+   zboot_flash_read,
+   zboot_flash_write,
+   zboot_flash_erase
+};
+
+static zboot_log *zboot_get_log(void)
 {
-   return zboot_set_config(NULL);
+   if(!g_zboot_log_set)
+   {
+      zboot_log_scan(&g_zboot_flash_ops, &g_zboot_log);
+      g_zboot_log_set = true;
+   }
+   return &g_zboot_log;
 }
 
-// ----------------------------------------------------------------------------------
-// Get Operations
+/* ----------------------------------------------------------------------------------------
+ * Cached state is published under a sequence lock: the sequence number is odd while an
+ *  update is in progress, and readers retry if it changed while they were copying. Readers
+ *  never take the API lock unless the state hasn't been cached yet or they keep losing
+ *  the race with a writer. All updates are made with the API lock held.
+ */
 
-bool zboot_get_coldboot_index(uint8_t *index)
+#define ZBOOT_SNAPSHOT_RETRIES 4
+
+static bool zboot_snapshot(const void *cached, const volatile bool *valid, void *copy,
+   uint32_t size)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   if(NULL != index)
-      *index = config.current_rom;
-   return true;
+   uint32_t sequence;
+   uint8_t tries;
+   bool result;
+
+   for(tries = 0; tries < ZBOOT_SNAPSHOT_RETRIES; ++tries)
+   {
+      sequence = g_zboot_sequence;
+      ZBOOT_BARRIER();
+      if(sequence & 1)
+         continue;  // Update in progress
+      result = *valid;
+      if(result)
+         memcpy(copy, cached, size);
+      ZBOOT_BARRIER();
+      if(sequence == g_zboot_sequence)
+         return result;
+   }
+   return false;
 }
 
-bool zboot_get_failsafe_index(uint8_t *index)
+// Caller must hold the API lock. A cached copy that's marked invalid can be modified
+//  without these, since readers don't use it.
+static void zboot_update_begin(void)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
+   ++g_zboot_sequence;
+   ZBOOT_BARRIER();
+}
+
+static void zboot_update_end(void)
+{
+   ZBOOT_BARRIER();
+   ++g_zboot_sequence;
+}
+
+// Caller must hold the API lock; a NULL value invalidates the cached copy
+static void zboot_publish(void *cached, volatile bool *valid, const void *value, uint32_t size)
+{
+   zboot_update_begin();
+   if(NULL != value)
+      memcpy(cached, value, size);
+   *valid = (NULL != value);
+   zboot_update_end();
+}
+
+// Committed config; caller must hold the API lock
+static bool zboot_read_config(zboot_config *config)
+{
+   zboot_log *log;
+
+   if(g_zboot_config_set)
+   {
+      memcpy(config, &g_zboot_config, sizeof(*config));
+      return true;
+   }
+
+   // Find the newest config record in flash
+   log = zboot_get_log();
+   if(!zboot_log_read(&g_zboot_flash_ops, log, ZBOOT_RECORD_CONFIG, config, sizeof(*config))
+   || log->length[ZBOOT_RECORD_CONFIG] != sizeof(*config))
+   {
+      DEBUG("zboot: Failed to read zboot config from flash\n");
       return false;
-   if(config.failsafe_rom >= config.count)
+   }
+
+   if(config->magic != ZBOOT_CONFIG_MAGIC)
       return false;
-   if(NULL != index)
-      *index = config.failsafe_rom;
+
+   zboot_publish(&g_zboot_config, &g_zboot_config_set, config, sizeof(*config));
    return true;
 }
 
-bool zboot_get_temp_index(uint8_t *index)
+// Committed config, for use by the get operations
+static bool zboot_get_config(zboot_config *config)
 {
-   zboot_rtc_data rtc;
-   if(!zboot_get_rtc_data(&rtc))
-      return false;
-   if(rtc.next_mode != ZBOOT_MODE_TEMP_ROM)
-      return false;
-   if(NULL != index)
-      *index = rtc.next_rom;
+   bool result;
+
+   if(zboot_snapshot(&g_zboot_config, &g_zboot_config_set, config, sizeof(*config)))
+      return true;
+
+   ZBOOT_LOCK();
+   result = zboot_read_config(config);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Config to be modified by a set operation, including any changes the calling task has
+//  made since zboot_begin_config_update(); caller must hold the API lock
+static bool zboot_get_config_for_update(zboot_config *config)
+{
+   if(g_zboot_pending && ZBOOT_IS_OWNER(g_zboot_pending_owner))
+   {
+      memcpy(config, &g_zboot_pending_config, sizeof(*config));
+      return true;
+   }
+   return zboot_read_config(config);
+}
+
+// Appends a record to the config log; the sector is only erased when the log is full.
+//  Caller must hold the API lock.
+static bool zboot_write_record(uint16_t type, const void *payload, uint16_t length)
+{
+   zboot_log *log = zboot_get_log();
+   uint8_t *scratch = NULL;
+   uint32_t scratchSize;
+   bool success;
+
+   // Compacting the log requires a copy of the other records
+   scratchSize = zboot_log_compact_size(log, type);
+   if(scratchSize > 0)
+   {
+      scratch = zboot_scratch_alloc(&scratchSize, scratchSize);
+      if (NULL == scratch)
+         return false;
+   }
+
+   success = zboot_log_append(&g_zboot_flash_ops, log, type, payload, length, scratch, scratchSize);
+   if(!success)
+      DEBUG("zboot: Failed to write zboot config record %u\n", type);
+
+   zboot_work_free(scratch);
+   return success;
+}
+
+// Fails while another task has a config update in progress. Caller must hold the API lock.
+static bool zboot_set_config(zboot_config *config)
+{
+   bool success = true;
+
+   if(g_zboot_pending && !ZBOOT_IS_OWNER(g_zboot_pending_owner))
+   {
+      DEBUG("zboot: Config update in progress in another task\n");
+      return false;
+   }
+   if(g_zboot_pending && NULL != config)
+   {
+      // Defer the write until the update is committed
+      memcpy(&g_zboot_pending_config, config, sizeof(*config));
+      return true;
+   }
+
+   // Flash contents may no longer match the cache
+   zboot_publish(&g_zboot_config, &g_zboot_config_set, NULL, sizeof(*config));
+
+   if(NULL == config)
+   {
+      // Erase configuration, but not a slot that the log stops short of
+      uint8_t sector, sectors = zboot_get_log()->sectors;
+      g_zboot_pending = false;
+      for(sector = 0; sector < sectors; ++sector)
+      {
+         if(zboot_erase_sector(ZBOOT_STATS_CONFIG, BOOT_CONFIG_SECTOR + sector) != SPI_FLASH_RESULT_OK)
+         {
+            DEBUG("zboot: Failed to erase zboot config sector\n");
+            success = false;
+         }
+      }
+      g_zboot_log_set = false;
+      zboot_publish(&g_zboot_catalog, &g_zboot_catalog_set, NULL, sizeof(g_zboot_catalog));
+      zboot_publish(&g_zboot_partitions, &g_zboot_partitions_set, NULL, 0);
+      return success;
+   }
+
+   config->chksum = zboot_config_checksum(config);
+   success = zboot_write_record(ZBOOT_RECORD_CONFIG, config, sizeof(*config));
+   if(success)
+      zboot_publish(&g_zboot_config, &g_zboot_config_set, config, sizeof(*config));
+   return success;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Partition table. Entries are sorted by type, so the cached copy is indexed by the first
+ *  entry of each type; a type of ZBOOT_PARTITION_ALL refers to the whole table.
+ */
+
+// Mark the cached table valid once its contents are in place; caller must hold the API lock
+static void zboot_activate_partitions(void)
+{
+   uint16_t idx = 0;
+   uint8_t type;
+
+   for(type = 0; type < ZBOOT_PARTITION_TYPES; ++type)
+   {
+      g_zboot_partition_first[type] = idx;
+      while(idx < g_zboot_partitions.count && g_zboot_partitions.entry[idx].type == type)
+         ++idx;
+   }
+   g_zboot_partition_first[ZBOOT_PARTITION_TYPES] = g_zboot_partitions.count;
+
+   zboot_update_begin();
+   g_zboot_partitions_set = true;
+   zboot_update_end();
+}
+
+// Caller must hold the API lock
+static bool zboot_read_partitions(void)
+{
+   zboot_log *log;
+
+   if(g_zboot_partitions_set)
+      return true;
+
+   log = zboot_get_log();
+   if(!zboot_log_read(&g_zboot_flash_ops, log, ZBOOT_RECORD_PARTITIONS, &g_zboot_partitions,
+      sizeof(g_zboot_partitions))
+   || !zboot_partition_table_valid(&g_zboot_partitions, log->length[ZBOOT_RECORD_PARTITIONS]))
+   {
+      DEBUG("zboot: Failed to read partition table from flash\n");
+      return false;
+   }
+
+   zboot_activate_partitions();
+   return true;
+}
+
+// Look up an entry in the cached table. Either output may be NULL; with a NULL partition,
+//  only the count is returned.
+static bool zboot_lookup_partition(uint8_t type, uint8_t index, zboot_partition *partition,
+   uint8_t *count)
+{
+   uint8_t first = 0;
+   uint8_t end = g_zboot_partition_first[ZBOOT_PARTITION_TYPES];
+
+   if(type < ZBOOT_PARTITION_TYPES)
+   {
+      first = g_zboot_partition_first[type];
+      end = g_zboot_partition_first[type + 1];
+   }
+   if(NULL != count)
+      *count = end - first;
+   if(NULL == partition)
+      return true;
+   if(index >= end - first)
+      return false;
+   memcpy(partition, &g_zboot_partitions.entry[first + index], sizeof(*partition));
+   return true;
+}
+
+// Caller must hold the API lock
+static bool zboot_read_partition(uint8_t type, uint8_t index, zboot_partition *partition,
+   uint8_t *count)
+{
+   return zboot_read_partitions() && zboot_lookup_partition(type, index, partition, count);
+}
+
+// Lock-free equivalent of zboot_read_partition(), copying only the requested entry
+static bool zboot_get_partition_entry(uint8_t type, uint8_t index, zboot_partition *partition,
+   uint8_t *count)
+{
+   uint32_t sequence;
+   uint8_t tries;
+   bool result;
+
+   for(tries = 0; tries < ZBOOT_SNAPSHOT_RETRIES; ++tries)
+   {
+      sequence = g_zboot_sequence;
+      ZBOOT_BARRIER();
+      if(sequence & 1)
+         continue;  // Update in progress
+      if(!g_zboot_partitions_set)
+         break;
+      result = zboot_lookup_partition(type, index, partition, count);
+      ZBOOT_BARRIER();
+      if(sequence == g_zboot_sequence)
+         return result;
+   }
+
+   ZBOOT_LOCK();
+   result = zboot_read_partition(type, index, partition, count);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Find the end of the partition containing an address. Returns false if the address isn't
+//  in any partition. Caller must hold the API lock.
+static bool zboot_find_partition_end(uint32_t address, uint32_t *end_addr)
+{
+   zboot_partition partition;
+   uint8_t idx;
+
+   for(idx = 0; zboot_read_partition(ZBOOT_PARTITION_ALL, idx, &partition, NULL); ++idx)
+   {
+      if(address >= partition.address && address - partition.address < partition.size)
+      {
+         *end_addr = partition.address + partition.size;
+         return true;
+      }
+   }
+   return false;
+}
+
+// Caller must hold the API lock
+static bool zboot_read_rtc_data(zboot_rtc_data *rtc)
+{
+   uint8_t checksum;
+
+   if(g_zboot_rtc_set)
+   {
+      memcpy(rtc, &g_zboot_rtc, sizeof(*rtc));
+      return true;
+   }
+
+   if(!system_rtc_mem_read(ZBOOT_RTC_ADDR/sizeof(uint32_t), rtc, sizeof(*rtc)))
+   {
+      DEBUG("%s: Failed to read RTC memory\n", __func__);
+      return false;
+   }
+   checksum = zboot_rtc_checksum(rtc);
+   if(rtc->chksum != checksum)
+   {
+      DEBUG("%s: checksum mismatch calculated=%02x, expected=%02x\n",
+         __func__, checksum, rtc->chksum);
+      return false;
+   }
+
+   zboot_publish(&g_zboot_rtc, &g_zboot_rtc_set, rtc, sizeof(*rtc));
+   return true;
+}
+
+static bool zboot_get_rtc_data(zboot_rtc_data *rtc)
+{
+   bool result;
+
+   if(zboot_snapshot(&g_zboot_rtc, &g_zboot_rtc_set, rtc, sizeof(*rtc)))
+      return true;
+
+   ZBOOT_LOCK();
+   result = zboot_read_rtc_data(rtc);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Caller must hold the API lock
+static bool zboot_set_rtc_data(zboot_rtc_data *rtc)
+{
+   rtc->chksum = esp_checksum8((uint8_t*)rtc, (sizeof(*rtc)-sizeof(uint8_t)));
+   if(!system_rtc_mem_write(ZBOOT_RTC_ADDR/sizeof(uint32_t), rtc, sizeof(*rtc)))
+      return false;
+   zboot_publish(&g_zboot_rtc, &g_zboot_rtc_set, rtc, sizeof(*rtc));
+   return true;
+}
+
+static bool zboot_get_image_header(uint32_t offset, zimage_header *header)
+{
+   if(zboot_spi_read(ZBOOT_STATS_HEADER, offset, header, sizeof(*header)) != SPI_FLASH_RESULT_OK)
+      return false;
+   else
+      return true;
+}
+
+static bool zboot_read_image_state(uint32_t address, uint32_t *state)
+{
+   uint32_t header[ZIMAGE_HEADER_OFFSET_STATE + 1];
+
+   if(zboot_spi_read(ZBOOT_STATS_HEADER, address, header, sizeof(header)) != SPI_FLASH_RESULT_OK
+   || header[ZIMAGE_HEADER_OFFSET_MAGIC] != ZIMAGE_MAGIC)
+      return false;
+   *state = header[ZIMAGE_HEADER_OFFSET_STATE];
+   return true;
+}
+
+// Change an image's state by clearing bits of its state word, without erasing.
+//  Caller must hold the API lock.
+static bool zboot_write_image_state(uint32_t address, uint32_t state)
+{
+   uint32_t current;
+
+   if(!zboot_read_image_state(address, &current) || !zimage_state_transition_valid(current, state))
+      return false;
+   if(current == state)
+      return true;
+   return (zboot_spi_write(ZBOOT_STATS_HEADER, address + ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t),
+      &state, sizeof(state)) == SPI_FLASH_RESULT_OK);
+}
+
+// Describe the image in a slot by reading its header
+static void zboot_catalog_fill(zboot_catalog_entry *entry, uint32_t address,
+   const zimage_header *header, uint32_t length, uint32_t chksum)
+{
+   memset(entry, 0, sizeof(*entry));
+   entry->address = address;
+   if(NULL == header || header->magic != ZIMAGE_MAGIC || header->state == ZIMAGE_STATE_INVALID)
+      return;
+   entry->flags = ZBOOT_CATALOG_IMAGE;
+   entry->version = header->version;
+   entry->date = header->date;
+   memcpy(entry->description, header->description, sizeof(entry->description));
+   if(length > 0)
+   {
+      entry->flags |= ZBOOT_CATALOG_WRITTEN;
+      entry->length = length;
+      entry->chksum = chksum;
+   }
+}
+
+static void zboot_catalog_scan(zboot_catalog_entry *entry, uint32_t address)
+{
+   zimage_header header;
+
+   if(zboot_get_image_header(address, &header))
+      zboot_catalog_fill(entry, address, &header, 0, 0);
+   else
+      zboot_catalog_fill(entry, address, NULL, 0, 0);
+}
+
+// Image catalog; entries that don't match the application partitions are rebuilt from the
+//  image headers, or all of them if 'rescan' is set. A rebuilt catalog is only written to
+//  flash if 'save' is set, so that the get operations never write. Caller must hold the
+//  API lock.
+static bool zboot_read_catalog(bool rescan, bool save)
+{
+   zboot_log *log = zboot_get_log();
+   zboot_partition partition;
+   bool rebuilt = rescan;
+   bool whole;
+   uint8_t count;
+   uint8_t idx;
+
+   if(g_zboot_catalog_set && !rescan)
+      return true;
+   zboot_publish(&g_zboot_catalog, &g_zboot_catalog_set, NULL, 0);
+
+   if(!zboot_read_partition(ZBOOT_PARTITION_APP, 0, NULL, &count))
+      return false;
+
+   // Catalogs written with fewer slots are extended
+   memset(&g_zboot_catalog, 0, sizeof(g_zboot_catalog));
+   whole = zboot_log_read(&g_zboot_flash_ops, log, ZBOOT_RECORD_CATALOG, &g_zboot_catalog,
+      sizeof(g_zboot_catalog)) && (log->length[ZBOOT_RECORD_CATALOG] % sizeof(zboot_catalog_entry)) == 0;
+   if(!whole)
+      memset(&g_zboot_catalog, 0, sizeof(g_zboot_catalog));
+
+   for(idx = 0; idx < MAX_ROMS; ++idx)
+   {
+      zboot_catalog_entry *entry = &g_zboot_catalog.entry[idx];
+      uint16_t type = ZBOOT_RECORD_SLOT + idx;
+
+      // A slot record written since the whole catalog was takes its place
+      if(log->length[type] == sizeof(*entry)
+      && (!whole || log->sequence[type] > log->sequence[ZBOOT_RECORD_CATALOG])
+      && !zboot_log_read(&g_zboot_flash_ops, log, type, entry, sizeof(*entry)))
+         memset(entry, 0, sizeof(*entry));
+
+      if(idx >= count)
+      {
+         if(0 != entry->address)
+         {
+            memset(entry, 0, sizeof(*entry));
+            rebuilt = true;
+         }
+      }
+      else if(zboot_lookup_partition(ZBOOT_PARTITION_APP, idx, &partition, NULL)
+         && (rescan || entry->address != partition.address))
+      {
+         zboot_catalog_scan(entry, partition.address);
+         rebuilt = true;
+      }
+   }
+
+   if(rebuilt && save
+   && !zboot_write_record(ZBOOT_RECORD_CATALOG, &g_zboot_catalog, sizeof(g_zboot_catalog)))
+      DEBUG("zboot: Failed to write image catalog\n");
+   zboot_update_begin();
+   g_zboot_catalog_set = true;
+   zboot_update_end();
+   return true;
+}
+
+static bool zboot_get_catalog_entry(uint8_t index, zboot_catalog_entry *entry)
+{
+   bool result;
+
+   if(index >= MAX_ROMS)
+      return false;
+   if(zboot_snapshot(&g_zboot_catalog.entry[index], &g_zboot_catalog_set, entry, sizeof(*entry)))
+      return true;
+
+   ZBOOT_LOCK();
+   result = zboot_read_catalog(false, false);
+   if(result)
+      memcpy(entry, &g_zboot_catalog.entry[index], sizeof(*entry));
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Caller must hold the API lock
+static bool zboot_set_catalog_entry(uint8_t index, const zboot_catalog_entry *entry)
+{
+   if(index >= MAX_ROMS || !zboot_read_catalog(false, false))
+      return false;
+   if(memcmp(&g_zboot_catalog.entry[index], entry, sizeof(*entry)) == 0)
+      return true;
+
+   zboot_update_begin();
+   memcpy(&g_zboot_catalog.entry[index], entry, sizeof(*entry));
+   zboot_update_end();
+   if(!zboot_write_record(ZBOOT_RECORD_SLOT + index, entry, sizeof(*entry)))
+   {
+      // Re-read from flash next time
+      zboot_publish(&g_zboot_catalog, &g_zboot_catalog_set, NULL, 0);
+      return false;
+   }
+   return true;
+}
+
+// Forget what the catalog says about every slot overlapping [address, end_addr), whose
+//  contents are about to change. Caller must hold the API lock.
+static void zboot_catalog_forget(uint32_t address, uint32_t end_addr)
+{
+   zboot_partition partition;
+   zboot_catalog_entry entry;
+   uint8_t idx;
+
+   for(idx = 0; zboot_read_partition(ZBOOT_PARTITION_APP, idx, &partition, NULL); ++idx)
+   {
+      if(address < partition.address + partition.size && partition.address < end_addr)
+      {
+         zboot_catalog_fill(&entry, partition.address, NULL, 0, 0);
+         zboot_set_catalog_entry(idx, &entry);
+      }
+   }
+}
+
+// ----------------------------------------------------------------------------------
+// Set Operations
+
+bool zboot_set_coldboot_index(uint8_t index)
+{
+   zboot_partition partition;
+   zboot_config config;
+   bool result = false;
+   DEBUG("%s: index\n", __func__, index);
+   ZBOOT_LOCK();
+   if(zboot_read_partition(ZBOOT_PARTITION_APP, index, &partition, NULL)
+   && zboot_get_config_for_update(&config))
+   {
+      config.current_rom = index;
+      result = zboot_set_config(&config);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_set_gpio_number(uint8_t index)
+{
+   zboot_config config;
+   bool result = false;
+   ZBOOT_LOCK();
+   if(zboot_get_config_for_update(&config))
+   {
+      config.gpio_num = index;
+      result = zboot_set_config(&config);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_invalidate_index(uint8_t index)
+{
+   zboot_partition partition;
+   int32_t sector;
+   bool result = false;
+   DEBUG("%s: index\n", __func__, index);
+   ZBOOT_LOCK();
+   if(zboot_read_partition(ZBOOT_PARTITION_APP, index, &partition, NULL))
+   {
+      zboot_catalog_entry entry;
+      result = zboot_write_image_state(partition.address, ZIMAGE_STATE_INVALID);
+      if(!result)
+      {
+         // Image without a state word
+         sector = partition.address / SECTOR_SIZE;
+         result = (zboot_erase_sector(ZBOOT_STATS_HEADER, sector) == SPI_FLASH_RESULT_OK);
+      }
+      zboot_catalog_fill(&entry, partition.address, NULL, 0, 0);
+      zboot_set_catalog_entry(index, &entry);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Image states only advance: written, verified, confirmed, invalid. Images built without
+//  state tracking can only be invalidated, using zboot_invalidate_index().
+bool zboot_set_image_state(uint8_t index, uint32_t state)
+{
+   zboot_partition partition;
+   bool result = false;
+   ZBOOT_LOCK();
+   if(zboot_read_partition(ZBOOT_PARTITION_APP, index, &partition, NULL))
+   {
+      result = zboot_write_image_state(partition.address, state);
+      if(result && state == ZIMAGE_STATE_INVALID)
+      {
+         zboot_catalog_entry entry;
+         zboot_catalog_fill(&entry, partition.address, NULL, 0, 0);
+         zboot_set_catalog_entry(index, &entry);
+      }
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_set_boot_mode(uint8_t mode)
+{
+   zboot_config config;
+   bool result = false;
+   ZBOOT_LOCK();
+   if(zboot_get_config_for_update(&config))
+   {
+      config.mode = mode;
+      result = zboot_set_config(&config);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_set_option(uint8_t option, bool enable)
+{
+   zboot_config config;
+   bool result = false;
+   ZBOOT_LOCK();
+   if(zboot_get_config_for_update(&config))
+   {
+      if(enable)
+         config.options |= option;
+      else
+         config.options &= ~option;
+      result = zboot_set_config(&config);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_set_failsafe_index(uint8_t index)
+{
+   zboot_partition partition;
+   zboot_config config;
+   bool result = false;
+   ZBOOT_LOCK();
+   if(zboot_read_partition(ZBOOT_PARTITION_APP, index, &partition, NULL)
+   && zboot_get_config_for_update(&config))
+   {
+      config.failsafe_rom = index;
+      result = zboot_set_config(&config);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_set_temp_index(uint8_t index)
+{
+   zboot_rtc_data rtc;
+   zboot_partition partition;
+   bool result = false;
+
+   ZBOOT_LOCK();
+   if(zboot_read_partition(ZBOOT_PARTITION_APP, index, &partition, NULL))
+   {
+      if(!zboot_read_rtc_data(&rtc))
+      {
+         DEBUG("zboot: Invalid RTC data; reinitializing\n");
+         rtc.magic = ZBOOT_RTC_MAGIC;
+         rtc.last_mode = ZBOOT_MODE_STANDARD;
+         rtc.last_rom = 0;
+      }
+      rtc.next_mode = ZBOOT_MODE_TEMP_ROM;
+      rtc.next_rom = index;
+      result = zboot_set_rtc_data(&rtc);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_erase_config(void)
+{
+   bool result;
+   ZBOOT_LOCK();
+   result = zboot_set_config(NULL);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Config updates made between zboot_begin_config_update() and zboot_commit_config_update()
+//  are written to flash as a single record, so either all or none of them take effect. The
+//  get operations continue to return the committed config until then. An update belongs to
+//  the task that began it: only that task can commit or abort it, and while it's open the
+//  set operations that change the config fail in every other task, as does beginning
+//  another update.
+bool zboot_begin_config_update(void)
+{
+   zboot_config config;
+   bool result = false;
+
+   ZBOOT_LOCK();
+   if(g_zboot_pending)
+   {
+      DEBUG("zboot: Config update already in progress\n");
+   }
+   else if(zboot_read_config(&config))
+   {
+      memcpy(&g_zboot_pending_config, &config, sizeof(config));
+      g_zboot_pending_owner = ZBOOT_OWNER();
+      g_zboot_pending = true;
+      result = true;
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_commit_config_update(void)
+{
+   zboot_config config;
+   bool result = false;
+
+   ZBOOT_LOCK();
+   if(!g_zboot_pending || !ZBOOT_IS_OWNER(g_zboot_pending_owner))
+   {
+      DEBUG("zboot: No config update in progress in this task\n");
+   }
+   else
+   {
+      memcpy(&config, &g_zboot_pending_config, sizeof(config));
+      g_zboot_pending = false;
+      if(g_zboot_config_set && memcmp(&config, &g_zboot_config, sizeof(config)) == 0)
+         result = true;  // Nothing changed
+      else
+         result = zboot_set_config(&config);
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+void zboot_abort_config_update(void)
+{
+   ZBOOT_LOCK();
+   if(g_zboot_pending && ZBOOT_IS_OWNER(g_zboot_pending_owner))
+      g_zboot_pending = false;
+   ZBOOT_UNLOCK();
+}
+
+// The configuration, partition table and image catalog are cached after they're first read and updated by
+//  the set and write operations. Call this if the config sectors may have been modified
+//  by other means.
+void zboot_invalidate_config_cache(void)
+{
+   ZBOOT_LOCK();
+   zboot_publish(&g_zboot_config, &g_zboot_config_set, NULL, sizeof(g_zboot_config));
+   zboot_publish(&g_zboot_catalog, &g_zboot_catalog_set, NULL, sizeof(g_zboot_catalog));
+   zboot_publish(&g_zboot_partitions, &g_zboot_partitions_set, NULL, sizeof(g_zboot_partitions));
+   g_zboot_log_set = false;
+   ZBOOT_UNLOCK();
+}
+
+// Rebuild the image catalog from the image headers, e.g. after images have been written
+//  to flash without using the zboot_write_* functions
+bool zboot_rebuild_catalog(void)
+{
+   bool result;
+
+   ZBOOT_LOCK();
+   result = zboot_read_catalog(true, true);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+static bool zboot_flash_busy(void);
+
+// True if the config, and any update in progress, only selects slots below 'apps'. Caller
+//  must hold the API lock.
+static bool zboot_config_fits(uint8_t apps)
+{
+   zboot_config config;
+
+   if(!zboot_read_config(&config) || config.current_rom >= apps || config.failsafe_rom >= apps)
+      return false;
+   return !g_zboot_pending
+      || (g_zboot_pending_config.current_rom < apps && g_zboot_pending_config.failsafe_rom < apps);
+}
+
+// Replace the partition table. Entries are sorted by type, keeping the order of entries of
+//  the same type, so application slot n is the n-th ZBOOT_PARTITION_APP entry given. Fails
+//  while an image write or background erase is in progress, or if the current or failsafe
+//  slot wouldn't exist in the new table; select another slot first. The image catalog is
+//  rebuilt for the new slots.
+bool zboot_set_partitions(const zboot_partition *partitions, uint8_t count)
+{
+   zboot_partition_table *table = &g_zboot_partitions;
+   uint32_t length = zboot_partition_table_length(count);
+   uint32_t reserved;
+   uint16_t idx, other;
+   uint8_t apps = 0;
+   bool result;
+
+   if(count > MAX_PARTITIONS)
+      return false;
+
+   for(idx = 0; idx < count; ++idx)
+      if(partitions[idx].type == ZBOOT_PARTITION_APP)
+         ++apps;
+
+   ZBOOT_LOCK();
+#ifdef BOOT_WEAR_ENABLED
+   reserved = BOOT_FIRST_FREE_SECTOR * SECTOR_SIZE;
+#else
+   reserved = (BOOT_CONFIG_SECTOR + zboot_get_log()->sectors) * SECTOR_SIZE;  // See zboot_log_scan()
+#endif
+   if(zboot_flash_busy() || !zboot_config_fits(apps))
+   {
+      DEBUG("zboot: Partition table can't be replaced now\n");
+      ZBOOT_UNLOCK();
+      return false;
+   }
+
+   // The new table is built in place of the cached one, which is re-read from flash if
+   //  the new table can't be written
+   zboot_publish(&g_zboot_partitions, &g_zboot_partitions_set, NULL, 0);
+   zboot_publish(&g_zboot_catalog, &g_zboot_catalog_set, NULL, 0);
+
+   // Insertion sort by type
+   table->version = ZBOOT_PARTITION_TABLE_VERSION;
+   table->count = count;
+   for(idx = 0; idx < count; ++idx)
+   {
+      for(other = idx; other > 0 && table->entry[other - 1].type > partitions[idx].type; --other)
+         memcpy(&table->entry[other], &table->entry[other - 1], sizeof(zboot_partition));
+      memcpy(&table->entry[other], &partitions[idx], sizeof(zboot_partition));
+   }
+
+   result = zboot_partition_table_valid(table, length);
+   for(idx = 0; result && idx < count; ++idx)
+   {
+      const zboot_partition *entry = &table->entry[idx];
+      if(entry->size == 0 || entry->address < reserved)
+         result = false;
+      for(other = idx + 1; result && other < count; ++other)
+      {
+         if(entry->address < table->entry[other].address + table->entry[other].size
+         && table->entry[other].address < entry->address + entry->size)
+            result = false;
+      }
+   }
+
+   if(!result)
+      DEBUG("zboot: Invalid partition table\n");
+   else
+      result = zboot_write_record(ZBOOT_RECORD_PARTITIONS, table, length);
+   if(result)
+   {
+      zboot_activate_partitions();
+      zboot_read_catalog(true, true);
+   }
+
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// ----------------------------------------------------------------------------------
+// Get Operations
+
+bool zboot_get_coldboot_index(uint8_t *index)
+{
+   zboot_config config;
+   if(!zboot_get_config(&config))
+      return false;
+   if(NULL != index)
+      *index = config.current_rom;
+   return true;
+}
+
+bool zboot_get_failsafe_index(uint8_t *index)
+{
+   zboot_config config;
+   zboot_partition partition;
+   if(!zboot_get_config(&config))
+      return false;
+   if(!zboot_get_partition_entry(ZBOOT_PARTITION_APP, config.failsafe_rom, &partition, NULL))
+      return false;
+   if(NULL != index)
+      *index = config.failsafe_rom;
+   return true;
+}
+
+bool zboot_get_temp_index(uint8_t *index)
+{
+   zboot_rtc_data rtc;
+   if(!zboot_get_rtc_data(&rtc))
+      return false;
+   if(rtc.next_mode != ZBOOT_MODE_TEMP_ROM)
+      return false;
+   if(NULL != index)
+      *index = rtc.next_rom;
+   return true;
+}
+
+bool zboot_get_boot_mode(uint8_t *mode)
+{
+   zboot_config config;
+   if(!zboot_get_config(&config))
+      return false;
+   if(NULL != mode)
+      *mode = config.mode;
+   return true;
+}
+
+bool zboot_get_options(uint8_t *options)
+{
+   zboot_config config;
+   if(!zboot_get_config(&config))
+      return false;
+   if(NULL != options)
+      *options = config.options;
+   return true;
+}
+
+bool zboot_get_image_address(uint8_t index, uint32_t *address)
+{
+   zboot_partition partition;
+   if(!zboot_get_partition_entry(ZBOOT_PARTITION_APP, index, &partition, NULL))
+      return false;
+   if(NULL != address)
+      *address = partition.address;
+   return true;
+}
+
+bool zboot_get_current_boot_index(uint8_t *index)
+{
+   zboot_rtc_data rtc;
+   if(!zboot_get_rtc_data(&rtc))
+   {
+      DEBUG("zboot: Failed to read RTC data\n");
+      return false;
+   }
+   if(NULL != index)
+      *index = rtc.last_rom;
+   return true;
+}
+
+bool zboot_get_current_boot_mode(uint8_t *mode)
+{
+   zboot_rtc_data rtc;
+   if (!zboot_get_rtc_data(&rtc))
+   {
+      DEBUG("zboot: Failed to read RTC data\n");
+      return false;
+   }
+
+   if(NULL != mode)
+      *mode = rtc.last_mode;
+   return true;
+}
+
+bool zboot_get_current_image_info(uint32_t *version, uint32_t *date,
+   uint32_t *address, uint8_t *index, char *description, uint8_t maxDescriptionLength)
+{
+   zimage_header header;
+   zboot_rtc_data rtc;
+   uint32_t imageAddress;
+
+   DEBUG("%s\n", __func__);
+
+   if(!zboot_get_rtc_data(&rtc))
+   {
+      DEBUG("zboot: Failed to get zboot data\n");
+      return false;
+   }
+
+   DEBUG("zboot: Current boot index %u, address %08x\n", rtc.last_rom, rtc.rom_addr);
+   if(zboot_get_image_info(rtc.last_rom, version, date, &imageAddress, description,
+      maxDescriptionLength) && imageAddress == rtc.rom_addr)
+   {
+      // Found in the catalog
+   }
+   else
+   {
+      if(!zboot_get_image_header(rtc.rom_addr, &header))
+      {
+         DEBUG("zboot: Failed to read image header\n");
+         return false;
+      }
+
+      if(header.magic != ZIMAGE_MAGIC)
+         return false;
+
+      if(NULL != version)
+         *version = header.version;
+      if(NULL != date)
+         *date = header.date;
+      if(NULL != description && maxDescriptionLength > 0)
+         strncpy(description, header.description, maxDescriptionLength);
+   }
+
+   if(NULL != address)
+      *address = rtc.rom_addr;
+   if(NULL != index)
+      *index = rtc.last_rom;
+
+   return true;
+}
+
+// Erases counted in the region containing an address, if wear tracking is enabled
+bool zboot_get_wear(uint32_t address, uint32_t *erases)
+{
+#if defined(BOOT_WEAR_ENABLED)
+   uint32_t value;
+   bool result;
+
+   ZBOOT_LOCK();
+   result = zboot_read_wear(address, &value);
+   ZBOOT_UNLOCK();
+   if(result && NULL != erases)
+      *erases = value;
+   return result;
+#else
+   return false;
+#endif
+}
+
+// Estimated erase cycles of the most-worn sector in an application slot
+bool zboot_get_image_wear(uint8_t index, uint32_t *cycles)
+{
+#if defined(BOOT_WEAR_ENABLED)
+   zboot_partition partition;
+   uint32_t address, erases, most = 0;
+   bool result;
+
+   if(!zboot_get_partition_entry(ZBOOT_PARTITION_APP, index, &partition, NULL))
+      return false;
+
+   ZBOOT_LOCK();
+   result = true;
+   for(address = partition.address - (partition.address % ZBOOT_WEAR_REGION_SIZE);
+       result && address < partition.address + partition.size; address += ZBOOT_WEAR_REGION_SIZE)
+   {
+      result = zboot_read_wear(address, &erases);
+      if(result && erases > most)
+         most = erases;
+   }
+   ZBOOT_UNLOCK();
+
+   if(result && NULL != cycles)
+      *cycles = (most + (ZBOOT_WEAR_REGION_SIZE / SECTOR_SIZE) - 1) / (ZBOOT_WEAR_REGION_SIZE / SECTOR_SIZE);
+   return result;
+#else
+   return false;
+#endif
+}
+
+// Prefers an empty slot, then (if overwriteOldest is set) the slot with the oldest image,
+//  then any slot other than the one currently executing. When wear tracking is enabled,
+//  an empty or oldest slot is passed over if it has been erased more than
+//  ZBOOT_WEAR_THRESHOLD cycles beyond the least-worn candidate, and ties go to the
+//  least-worn slot.
+bool zboot_find_best_write_index(uint8_t *index, bool overwriteOldest)
+{
+   return zboot_find_best_write_index_ex(index, overwriteOldest, 0);
+}
+
+// As zboot_find_best_write_index(), never choosing a slot whose bit is set in 'exclude', such
+//  as slots already chosen for other images
+bool zboot_find_best_write_index_ex(uint8_t *index, bool overwriteOldest, uint8_t exclude)
+{
+   uint8_t idx, offset, count;
+   uint8_t best_empty = ZBOOT_INVALID_INDEX, best_oldest = ZBOOT_INVALID_INDEX;
+   uint8_t best_any = ZBOOT_INVALID_INDEX;
+   uint32_t wear[MAX_ROMS];
+   uint32_t empty_wear = 0, oldest_wear = 0, any_wear = 0;
+   uint32_t best_date = 0xffffffff;
+   zboot_rtc_data rtc;
+
+   if(!zboot_get_rtc_data(&rtc))
+   {
+      DEBUG("zboot: Failed to get zboot data\n");
+      return false;
+   }
+
+   if(!zboot_get_image_count(&count) || 0 == count)
+   {
+      DEBUG("zboot: Failed to read partition table\n");
+      return false;
+   }
+
+   // The least-worn candidate is always eligible
+   for(idx = 0; idx < count; ++idx)
+   {
+      wear[idx] = 0;
+      if(idx == rtc.last_rom % count || (exclude & (1 << idx)))
+         continue;
+      zboot_get_image_wear(idx, &wear[idx]);
+      if(best_any == ZBOOT_INVALID_INDEX || wear[idx] < any_wear)
+      {
+         best_any = idx;
+         any_wear = wear[idx];
+      }
+   }
+
+   // Visit the slots following the current one first
+   for(offset = 1; offset < count; ++offset)
+   {
+      uint32_t date;
+
+      idx = (rtc.last_rom + offset) % count;
+      if((exclude & (1 << idx)) || wear[idx] - any_wear > ZBOOT_WEAR_THRESHOLD)
+         continue;
+
+      if(!zboot_get_image_info(idx, NULL, &date, NULL, NULL, 0))
+      {
+         if(best_empty == ZBOOT_INVALID_INDEX || wear[idx] < empty_wear
+         || (wear[idx] == empty_wear && idx < best_empty))
+         {
+            best_empty = idx;
+            empty_wear = wear[idx];
+         }
+      }
+      else if(overwriteOldest
+         && (date < best_date || (date == best_date && wear[idx] < oldest_wear)))
+      {
+         best_oldest = idx;
+         best_date = date;
+         oldest_wear = wear[idx];
+      }
+   }
+
+   if(best_empty != ZBOOT_INVALID_INDEX)
+      idx = best_empty;
+   else if(best_oldest != ZBOOT_INVALID_INDEX)
+      idx = best_oldest;
+   else
+      idx = best_any;
+
+   if(idx == ZBOOT_INVALID_INDEX)
+      return false;  // No slot other than the one executing, or they're all excluded
+   if(index != NULL)
+      *index = idx;
+   return true;
+}
+
+bool zboot_get_image_count(uint8_t *count)
+{
+   return zboot_get_partition_count(ZBOOT_PARTITION_APP, count);
+}
+
+bool zboot_get_image_info(uint8_t index, uint32_t *version, uint32_t *date,
+   uint32_t *address, char *description, uint8_t maxDescriptionLength)
+{
+   zboot_catalog_entry entry;
+   uint8_t count;
+
+   if(!zboot_get_image_count(&count) || index >= count)
+      return false;
+
+   if(!zboot_get_catalog_entry(index, &entry))
+   {
+      DEBUG("zboot: Failed to read image catalog\n");
+      return false;
+   }
+
+   if(!(entry.flags & ZBOOT_CATALOG_IMAGE))
+      return false;
+
+   if(NULL != address)
+      *address = entry.address;
+   if(NULL != version)
+      *version = entry.version;
+   if(NULL != date)
+      *date = entry.date;
+   if(NULL != description && maxDescriptionLength > 0)
+      strncpy(description, entry.description, maxDescriptionLength);
+
+   return true;
+}
+
+bool zboot_get_image_length(uint8_t index, uint32_t *length, uint32_t *chksum)
+{
+   zboot_catalog_entry entry;
+   uint8_t count;
+
+   if(!zboot_get_image_count(&count) || index >= count)
+      return false;
+   if(!zboot_get_catalog_entry(index, &entry))
+      return false;
+
+   if(!(entry.flags & ZBOOT_CATALOG_WRITTEN))
+      return false;  // Not written by the API
+   if(NULL != length)
+      *length = entry.length;
+   if(NULL != chksum)
+      *chksum = entry.chksum;
+   return true;
+}
+
+bool zboot_get_image_state(uint8_t index, uint32_t *state)
+{
+   zboot_partition partition;
+   uint32_t value;
+
+   if(!zboot_get_partition_entry(ZBOOT_PARTITION_APP, index, &partition, NULL)
+   || !zboot_read_image_state(partition.address, &value))
+      return false;
+   if(NULL != state)
+      *state = value;
+   return true;
+}
+
+// Check the image at 'address' as the bootloader's check_image() would, without relying on
+//  the catalog: its header, including the entry point, the state word and whether it can run
+//  at this address, then the section lengths and the checksum. The image must also lie within
+//  the partition containing 'address'. Reports its length, up to and including the checksum
+//  word, and its checksum.
+bool zboot_verify_image(uint32_t address, uint32_t *length, uint32_t *chksum)
+{
+   zimage_header header;
+   uint32_t chunk[32];
+   uint32_t words[2];  // Section address and length
+   uint32_t sum, offset, limit, remaining, readlen, idx;
+   bool result;
+
+   ZBOOT_LOCK();
+   limit = address;
+   result = zboot_find_partition_end(address, &limit);
+   limit -= address;  // Bytes from the image to the end of its partition
+   result = result && zboot_spi_read(ZBOOT_STATS_OTA, address, &header, sizeof(header)) == SPI_FLASH_RESULT_OK
+      && header.magic == ZIMAGE_MAGIC && header.count <= 256
+      && header.entry >= 0x40100000 && header.entry < 0x40300000
+      && header.state != ZIMAGE_STATE_INVALID && zimage_check_address(&header, address);
+   sum = zboot_checksum32(0, &header, sizeof(header)) - header.state;
+   offset = sizeof(header);
+   for(idx = 0; result && idx < header.count; ++idx)
+   {
+      result = offset + sizeof(words) <= limit
+         && zboot_spi_read(ZBOOT_STATS_OTA, address + offset, words, sizeof(words)) == SPI_FLASH_RESULT_OK
+         && (words[1] % sizeof(uint32_t)) == 0 && words[1] <= limit - offset - sizeof(words);
+      sum = zboot_checksum32(sum, words, sizeof(words));
+      offset += sizeof(words);
+      for(remaining = result ? words[1] : 0; result && remaining > 0; remaining -= readlen)
+      {
+         readlen = (remaining > sizeof(chunk)) ? sizeof(chunk) : remaining;
+         result = zboot_spi_read(ZBOOT_STATS_OTA, address + offset, chunk, readlen) == SPI_FLASH_RESULT_OK;
+         sum = zboot_checksum32(sum, chunk, readlen);
+         offset += readlen;
+      }
+   }
+   result = result && offset + sizeof(uint32_t) <= limit
+      && zboot_spi_read(ZBOOT_STATS_OTA, address + offset, words, sizeof(uint32_t)) == SPI_FLASH_RESULT_OK
+      && words[0] == sum;
+   ZBOOT_UNLOCK();
+
+   if(result && NULL != length)
+      *length = offset + sizeof(uint32_t);
+   if(result && NULL != chksum)
+      *chksum = sum;
+   return result;
+}
+
+// Fill 'hashes' with the CRC-32 of each 'unit' bytes of flash from 'address', a multiple of the
+//  sector size, for 'length' bytes; the last hash covers whatever is left. An image's state
+//  word is hashed as erased, as it's written, so that a slot's manifest can be compared with
+//  the image file it was written from. The range must lie within one partition. The API lock
+//  is taken for each unit rather than the whole range, so other tasks' operations, such as
+//  write polls, are held up for one unit's reads at most.
+bool zboot_get_manifest(uint32_t address, uint32_t length, uint32_t unit, uint32_t *hashes)
+{
+   const uint32_t stateOffset = ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t);
+   zboot_partition partition;
+   uint32_t chunk[64];
+   uint32_t start, end, pos, readlen, hash;
+   bool image = false;
+   bool found = false;
+   bool result = true;
+   uint8_t idx;
+
+   if(0 == unit || (unit % SECTOR_SIZE) != 0 || (address % sizeof(uint32_t)) != 0)
+      return false;
+
+   // The bounds come from the partition table's snapshot, so that the lock is only taken
+   //  to read each unit
+   for(idx = 0; !found && zboot_get_partition(idx, &partition); ++idx)
+   {
+      found = address >= partition.address && address - partition.address < partition.size
+         && length <= partition.address + partition.size - address;
+   }
+   if(!found)
+   {
+      DEBUG("zboot: Manifest range %08x+%x isn't within a partition\n", address, length);
+      return false;
+   }
+
+   for(start = 0; result && start < length; start += unit)
+   {
+      end = (length - start < unit) ? length : start + unit;
+      hash = 0;
+      ZBOOT_LOCK();
+      for(pos = start; result && pos < end; pos += readlen)
+      {
+         readlen = (end - pos < sizeof(chunk)) ? end - pos : sizeof(chunk);
+         result = (zboot_spi_read(ZBOOT_STATS_OTA, address + pos, chunk,
+            (readlen + sizeof(uint32_t) - 1) & ~3) == SPI_FLASH_RESULT_OK);
+
+         if(0 == pos)
+            image = (chunk[0] == ZIMAGE_MAGIC);
+         if(image && pos <= stateOffset && pos + readlen >= stateOffset + sizeof(uint32_t))
+            chunk[(stateOffset - pos) / sizeof(uint32_t)] = ZIMAGE_STATE_WRITTEN;
+         hash = zboot_crc32(hash, chunk, readlen);
+      }
+      ZBOOT_UNLOCK();
+      hashes[start / unit] = hash;
+   }
+   return result;
+}
+
+// Read flash at any address and alignment
+bool zboot_read_flash(uint32_t address, void *buffer, uint32_t length)
+{
+   bool result;
+
+   ZBOOT_LOCK();
+   result = zboot_read_bytes(address, (uint8_t *) buffer, length);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_check_image_address(uint8_t index, uint32_t address)
+{
+   zboot_partition partition;
+   zimage_header header;
+
+   if(!zboot_get_partition_entry(ZBOOT_PARTITION_APP, index, &partition, NULL))
+   {
+      DEBUG("zboot: Failed to read partition table\n");
+      return false;
+   }
+
+   if(!zboot_get_image_header(partition.address, &header))
+   {
+      DEBUG("zboot: Failed to read header for ROM index %u @ %08x\n", index, partition.address);
+      return false;
+   }
+
+   if(header.magic != ZIMAGE_MAGIC)
+      return false;
+
+   return zimage_check_address(&header, address);
+}
+
+bool zboot_get_partition_count(uint8_t type, uint8_t *count)
+{
+   return zboot_get_partition_entry(type, 0, NULL, count);
+}
+
+bool zboot_find_partition(uint8_t type, uint8_t index, zboot_partition *partition)
+{
+   zboot_partition entry;
+   if(!zboot_get_partition_entry(type, index, &entry, NULL))
+      return false;
+   if(NULL != partition)
+      memcpy(partition, &entry, sizeof(entry));
+   return true;
+}
+
+bool zboot_get_partition(uint8_t index, zboot_partition *partition)
+{
+   return zboot_find_partition(ZBOOT_PARTITION_ALL, index, partition);
+}
+
+// Find the partition of a type that's in use: the one flagged ZBOOT_PARTITION_FLAG_ACTIVE,
+//  or the first of its type if none is. 'index', if not NULL, is set to its index among the
+//  partitions of its type.
+bool zboot_find_active_partition(uint8_t type, uint8_t *index, zboot_partition *partition)
+{
+   zboot_partition entry;
+   uint8_t idx;
+
+   if(ZBOOT_PARTITION_ALL == type)
+      return false;
+   for(idx = 0; zboot_get_partition_entry(type, idx, &entry, NULL); ++idx)
+      if(entry.flags & ZBOOT_PARTITION_FLAG_ACTIVE)
+         break;
+   if(!zboot_get_partition_entry(type, idx, &entry, NULL))
+   {
+      idx = 0;
+      if(!zboot_get_partition_entry(type, idx, &entry, NULL))
+         return false;
+   }
+   if(NULL != index)
+      *index = idx;
+   if(NULL != partition)
+      memcpy(partition, &entry, sizeof(entry));
+   return true;
+}
+
+bool zboot_get_flash_size(uint8_t *size)
+{
+   zboot_rtc_data rtc;
+   DEBUG("%s\n", __func__);
+
+   if(!zboot_get_rtc_data(&rtc))
+   {
+      DEBUG("zboot: Failed to get rtc data\n");
+      return false;
+   }
+
+   if(NULL != size)
+      *size = rtc.spi_size;
+   return true;
+}
+
+bool zboot_get_flash_speed(uint8_t *speed)
+{
+   zboot_rtc_data rtc;
+   DEBUG("%s\n", __func__);
+
+   if(!zboot_get_rtc_data(&rtc))
+   {
+      DEBUG("zboot: Failed to get rtc data\n");
+      return false;
+   }
+
+   if(NULL != speed)
+      *speed = rtc.spi_speed;
+   return true;
+}
+
+bool zboot_get_flash_mode(uint8_t *mode)
+{
+   zboot_rtc_data rtc;
+   DEBUG("%s\n", __func__);
+
+   if(!zboot_get_rtc_data(&rtc))
+   {
+      DEBUG("zboot: Failed to get rtc data\n");
+      return false;
+   }
+
+   if(NULL != mode)
+      *mode = rtc.spi_mode;
+   return true;
+}
+
+// Copy the flash operation counters, optionally resetting them. Returns false if the API
+//  was built without ZBOOT_API_STATS.
+bool zboot_get_stats(zboot_stats *stats, bool reset)
+{
+#if defined(ZBOOT_API_STATS)
+   ZBOOT_LOCK();
+   if(NULL != stats)
+      memcpy(stats, &g_zboot_stats, sizeof(*stats));
+   if(reset)
+      memset(&g_zboot_stats, 0, sizeof(g_zboot_stats));
+   ZBOOT_UNLOCK();
+   return true;
+#else
+   return false;
+#endif
+}
+
+// ----------------------------------------------------------------------------------
+// Write application image
+
+typedef struct
+{ 
+   bool active;
+   uint32_t image_addr;
+   uint8_t image_index;    // Slot being written, or ZBOOT_INVALID_INDEX
+   uint32_t last_word;     // Last word written; the image checksum once the write completes
+   uint32_t start_addr;
+   uint32_t end_addr;      // Writes mustn't extend past this address
+   uint32_t erased_addr;   // Flash is erased up to this address
+   uint32_t image_size;    // Expected size, or 0 if unknown
+   uint32_t image_extent;  // Size the image is known to reach, from its section headers
+   uint32_t parse_next;    // Image offset of the next header word the parser needs
+   uint32_t sections_left;
+   uint8_t parse_field;    // ZBOOT_PARSE_*
+   uint8_t options;        // ZBOOT_WRITE_*
+   uint16_t sectors_erased;
+   uint16_t sectors_skipped;
+   uint32_t pages_skipped;
+   uint8_t *queue;         // Data waiting to be written, with ZBOOT_WRITE_ASYNC
+   uint32_t queue_size;
+   uint32_t queue_head;    // Offset of the oldest queued byte
+   uint32_t queued;
+   uint32_t step_us[2];    // Time taken by the last step of each kind, ZBOOT_STEP_*
+   bool failed;            // A queued write failed
+   bool resumable;         // Progress is saved, from zboot_write_resume()
+   bool save_pending;      // Progress is waiting to be saved by a step, with ZBOOT_WRITE_ASYNC
+   uint32_t image_id;
+   uint8_t verify;         // ZBOOT_VERIFY_*
+   uint32_t chksum;        // Checksum of the image so far
+   zimage_header header;   // Copy of the image header, once it's been written
+   uint32_t image_magic;   // First word of the image
+   uint8_t extra_count;
+   union
+   {
+      uint32_t word;
+      uint8_t bytes[4];
+   } extra;                // Partial word left over from the last chunk
+} zboot_write_status;
+static zboot_write_status g_zboot_write_status[ZBOOT_WRITE_CONTEXTS];
+static uint8_t g_zboot_write_next = 0;  // Context zboot_write_poll_all() turns to next
+
+typedef struct
+{
+   bool active;
+   uint32_t start_addr;
+   uint32_t end_addr;
+   uint32_t erased_addr;   // Flash is erased from start_addr up to this address
+   uint32_t step_us[2];    // Time taken by the last sector and block erase
+} zboot_erase_status;
+static zboot_erase_status g_zboot_erase_status = {false, 0, 0, 0, {0, ZBOOT_BLOCK_ERASE_US}};
+
+#define ZBOOT_PAGE_SIZE 256  // Flash program page
+
+#define ZBOOT_STEP_ERASE   0
+#define ZBOOT_STEP_PROGRAM 1
+
+#define ZBOOT_PARSE_COUNT    0  // Section count, in the image header
+#define ZBOOT_PARSE_LENGTH   1  // Length word of the next section header
+#define ZBOOT_PARSE_CHECKSUM 2  // Checksum word following the last section
+#define ZBOOT_PARSE_DONE     3  // Image verified or rejected
+
+static bool zboot_write_chunk(zboot_write_status *status, const uint8_t *data, const uint16_t len);
+static bool zboot_write_segments(zboot_write_status *status, const zboot_segment *segments,
+   uint16_t count);
+static bool zboot_write_span(zboot_write_status *status, const uint8_t *data, uint32_t length);
+static bool zboot_write_compare(zboot_write_status *status, const uint8_t *data, uint32_t length);
+static bool zboot_write_program(zboot_write_status *status, const uint8_t *data, uint32_t length);
+static bool zboot_write_erase_next(zboot_write_status *status, bool block);
+static bool zboot_write_enqueue(zboot_write_status *status, const zboot_segment *segments,
+   uint16_t count);
+static bool zboot_write_erase_changed(zboot_write_status *status);
+static bool zboot_write_matches(zboot_write_status *status, const uint8_t *data, uint32_t length);
+static bool zboot_write_has_work(zboot_write_status *status);
+static uint8_t zboot_write_next_step(zboot_write_status *status);
+static bool zboot_write_step(zboot_write_status *status, uint8_t step);
+
+// Caller must hold the API lock
+static uint8_t zboot_find_slot(uint32_t address)
+{
+   zboot_partition partition;
+   uint8_t idx;
+
+   for(idx = 0; zboot_read_partition(ZBOOT_PARTITION_APP, idx, &partition, NULL); ++idx)
+      if(partition.address == address)
+         return idx;
+   return ZBOOT_INVALID_INDEX;
+}
+
+static bool zboot_progress_valid(const zboot_write_progress *progress)
+{
+   return progress->magic == ZBOOT_PROGRESS_MAGIC
+      && ((progress->image_addr + progress->written) % SECTOR_SIZE) == 0
+      && progress->check == zboot_checksum32(0, progress, offsetof(zboot_write_progress, check));
+}
+
+// Find saved write progress, from RTC memory if it's there, which is lost when power is,
+//  otherwise from the config log, which may be a few sectors behind. Caller must hold the
+//  API lock.
+static bool zboot_progress_load(zboot_write_progress *progress)
+{
+   zboot_write_progress saved;
+   zboot_log *log = zboot_get_log();
+   bool found;
+
+   found = system_rtc_mem_read(ZBOOT_RTC_PROGRESS_ADDR/sizeof(uint32_t), progress, sizeof(*progress))
+      && zboot_progress_valid(progress);
+   if(log->length[ZBOOT_RECORD_PROGRESS] == sizeof(saved)
+   && zboot_log_read(&g_zboot_flash_ops, log, ZBOOT_RECORD_PROGRESS, &saved, sizeof(saved))
+   && zboot_progress_valid(&saved)
+   && (!found || (saved.image_addr == progress->image_addr && saved.image_id == progress->image_id
+      && saved.written > progress->written)))
+   {
+      memcpy(progress, &saved, sizeof(saved));
+      found = true;
+   }
+   return found;
+}
+
+// True if progress saved at the current write address also goes to the config log
+static bool zboot_progress_record_due(zboot_write_status *status)
+{
+   return (((status->start_addr - status->image_addr) / SECTOR_SIZE) % ZBOOT_WRITE_PROGRESS_SECTORS) == 0;
+}
+
+// Save the progress of a resumable write, which has just reached a sector boundary. Failing
+//  to save it isn't an error; the write can still complete. Caller must hold the API lock.
+static void zboot_progress_save(zboot_write_status *status)
+{
+   zboot_write_progress progress;
+
+   memset(&progress, 0, sizeof(progress));
+   progress.magic = ZBOOT_PROGRESS_MAGIC;
+   progress.image_id = status->image_id;
+   progress.image_addr = status->image_addr;
+   progress.image_size = status->image_size;
+   progress.written = status->start_addr - status->image_addr;
+   progress.chksum = status->chksum;
+   progress.image_extent = status->image_extent;
+   progress.parse_next = status->parse_next;
+   progress.sections_left = status->sections_left;
+   progress.parse_field = status->parse_field;
+   progress.verify = status->verify;
+   progress.options = status->options;
+   progress.check = zboot_checksum32(0, &progress, offsetof(zboot_write_progress, check));
+
+   if(!system_rtc_mem_write(ZBOOT_RTC_PROGRESS_ADDR/sizeof(uint32_t), &progress, sizeof(progress)))
+      DEBUG("zboot: Failed to save write progress to RTC memory\n");
+   if(zboot_progress_record_due(status))
+      zboot_write_record(ZBOOT_RECORD_PROGRESS, &progress, sizeof(progress));
+}
+
+// Caller must hold the API lock
+static void zboot_progress_clear(void)
+{
+   zboot_log *log = zboot_get_log();
+   uint32_t magic = 0;
+
+   system_rtc_mem_write(ZBOOT_RTC_PROGRESS_ADDR/sizeof(uint32_t), &magic, sizeof(magic));
+   if(log->length[ZBOOT_RECORD_PROGRESS] > 0)
+      zboot_write_record(ZBOOT_RECORD_PROGRESS, NULL, 0);
+}
+
+// True if any of [address, end_addr) is being written. Caller must hold the API lock.
+static bool zboot_write_overlaps(uint32_t address, uint32_t end_addr)
+{
+   uint8_t idx;
+
+   for(idx = 0; idx < ZBOOT_WRITE_CONTEXTS; ++idx)
+      if(g_zboot_write_status[idx].active && address < g_zboot_write_status[idx].end_addr
+      && g_zboot_write_status[idx].image_addr < end_addr)
+         return true;
+   return false;
+}
+
+// True if an image write or background erase is in progress. Caller must hold the API lock.
+static bool zboot_flash_busy(void)
+{
+   return zboot_write_overlaps(0, 0xffffffff)
+      || (g_zboot_erase_status.active && g_zboot_erase_status.erased_addr < g_zboot_erase_status.end_addr);
+}
+
+void *zboot_write_init(uint32_t start_addr)
+{
+   return zboot_write_init_ex(start_addr, 0, 0);
+}
+
+// Take a free context from the pool, for a write that doesn't overlap any other. Caller
+//  must hold the API lock.
+static zboot_write_status *zboot_write_begin(uint32_t start_addr, uint32_t size, uint8_t options)
+{
+   zboot_write_status *status = NULL;
+   uint32_t end_addr;
+   uint8_t idx;
+
+   if(!zboot_find_partition_end(start_addr, &end_addr))
+   {
+      DEBUG("zboot: Address %08x isn't in a partition\n", start_addr);
+      return NULL;
+   }
+   if(size > end_addr - start_addr)
+   {
+      DEBUG("zboot: Image size %u exceeds partition\n", size);
+      return NULL;
+   }
+   if(size > 0)
+      end_addr = start_addr + ((size + sizeof(uint32_t) - 1) & ~3);
+   if(zboot_write_overlaps(start_addr, end_addr))
+   {
+      DEBUG("zboot: Write operation already in progress at %08x\n", start_addr);
+      return NULL;
+   }
+   if((options & ZBOOT_WRITE_SKIP_UNCHANGED) && NULL != g_zboot_scratch
+   && g_zboot_scratch_size < SECTOR_SIZE)
+   {
+      DEBUG("zboot: ZBOOT_API_SCRATCH_SIZE is too small to skip unchanged data\n");
+      return NULL;
+   }
+   for(idx = 0; idx < ZBOOT_WRITE_CONTEXTS && NULL == status; ++idx)
+      if(!g_zboot_write_status[idx].active)
+         status = &g_zboot_write_status[idx];
+   if(NULL == status)
+   {
+      DEBUG("zboot: No free write context\n");
+      return NULL;
+   }
+
+   memset(status, 0, sizeof(*status));
+   status->active = true;
+   status->image_addr = start_addr;
+   status->image_size = size;
+   status->options = options;
+   status->end_addr = end_addr;
+   status->parse_field = ZBOOT_PARSE_DONE;
+   status->verify = ZBOOT_VERIFY_INCOMPLETE;
+   status->image_index = zboot_find_slot(start_addr);
+   zboot_catalog_forget(start_addr, end_addr);  // Unknown until the write completes
+   status->start_addr = start_addr;
+   status->erased_addr = start_addr - (start_addr % SECTOR_SIZE);
+   if(g_zboot_erase_status.start_addr < status->end_addr
+   && status->image_addr < g_zboot_erase_status.end_addr)
+   {
+      // The write takes over from a background erase of the same flash, skipping the part
+      //  that's already erased
+      if(g_zboot_erase_status.start_addr <= status->erased_addr
+      && status->erased_addr < g_zboot_erase_status.erased_addr)
+         status->erased_addr = g_zboot_erase_status.erased_addr;
+      memset(&g_zboot_erase_status, 0, offsetof(zboot_erase_status, step_us));
+   }
+   if(options & ZBOOT_WRITE_ASYNC)
+   {
+      status->queue_size = ZBOOT_WRITE_QUEUE_SIZE;
+      status->queue = zboot_work_alloc(&status->queue_size, ZBOOT_PAGE_SIZE);
+      if(NULL == status->queue)
+      {
+         status->active = false;
+         return NULL;
+      }
+   }
+   return status;
+}
+
+// Begin writing an image of 'size' bytes, or an unknown size if it's 0. 'start_addr' must be
+//  in a partition, and the image is bounded by the end of that partition. With
+//  ZBOOT_API_BLOCK_ERASE, flash is erased in blocks where the image is known to extend far
+//  enough; without a size, that's learned from the section headers as they're written. 'options' is a combination of ZBOOT_WRITE_* flags.
+// Note: up to ZBOOT_WRITE_CONTEXTS writes can be in progress at a time, to separate regions
+void *zboot_write_init_ex(uint32_t start_addr, uint32_t size, uint8_t options)
+{
+   zboot_write_status *status;
+   zboot_write_progress progress;
+
+   ZBOOT_LOCK();
+   status = zboot_write_begin(start_addr, size, options);
+   if(NULL != status && zboot_progress_load(&progress) && progress.image_addr == start_addr)
+      zboot_progress_clear();  // Whatever was being written there is overwritten
+   ZBOOT_UNLOCK();
+   return (void *) status; 
+}
+
+// Begin a write as zboot_write_init_ex() does, saving its progress at each sector so that
+//  it can be resumed after a reset or a lost connection. 'image_id' identifies the image
+//  being written, its version say. If a write of the same image to the same address was
+//  interrupted, it continues from the last sector boundary reached, and 'offset' is set to
+//  the number of bytes already written, which the caller skips; otherwise it's 0. Only
+//  one resumable write can be in progress at a time, since there's one progress record.
+void *zboot_write_resume(uint32_t start_addr, uint32_t size, uint8_t options, uint32_t image_id,
+   uint32_t *offset)
+{
+   zboot_write_status *status;
+   zboot_write_progress progress;
+   uint32_t written = 0, length;
+   uint8_t idx;
+   bool found, resume;
+
+   ZBOOT_LOCK();
+   for(idx = 0; idx < ZBOOT_WRITE_CONTEXTS; ++idx)
+   {
+      if(g_zboot_write_status[idx].active && g_zboot_write_status[idx].resumable)
+      {
+         DEBUG("zboot: Resumable write already in progress\n");
+         ZBOOT_UNLOCK();
+         return NULL;
+      }
+   }
+   found = zboot_progress_load(&progress) && progress.image_addr == start_addr;
+   resume = found && progress.image_id == image_id && progress.image_size == size
+      && progress.options == options;
+   status = zboot_write_begin(start_addr, size, options);
+   if(NULL == status)
+   {
+      ZBOOT_UNLOCK();
+      return NULL;
+   }
+   status->resumable = true;
+   status->image_id = image_id;
+
+   if(found && !resume)
+      zboot_progress_clear();  // Another image was being written there
+   else if(resume && progress.written <= status->end_addr - start_addr)
+   {
+      // Anything written after the progress was saved is written again, so the flash
+      //  following it is erased again
+      written = progress.written;
+      status->start_addr = start_addr + written;
+      status->erased_addr = status->start_addr;
+      status->chksum = progress.chksum;
+      status->image_extent = progress.image_extent;
+      status->parse_next = progress.parse_next;
+      status->sections_left = progress.sections_left;
+      status->parse_field = progress.parse_field;
+      status->verify = progress.verify;
+
+      // The rest of the state comes from the flash already written
+      length = (written < sizeof(zimage_header)) ? written : sizeof(zimage_header);
+      if(!zboot_read_bytes(start_addr, (uint8_t *) &status->header, length)
+      || !zboot_read_bytes(status->start_addr - sizeof(uint32_t), (uint8_t *) &status->last_word,
+         sizeof(uint32_t)))
+      {
+         zboot_work_free(status->queue);
+         status->active = false;
+         ZBOOT_UNLOCK();
+         return NULL;
+      }
+      status->image_magic = status->header.magic;
+      DEBUG("zboot: Resuming write at offset %u\n", written);
+   }
+   ZBOOT_UNLOCK();
+   if(NULL != offset)
+      *offset = written;
+   return (void *) status;
+}
+
+bool zboot_write_end(void *context)
+{
+   return zboot_write_end_verify(context, NULL);
+}
+
+// Complete the write, and report in 'result' (if it's not NULL) whether the image written
+//  would pass the bootloader's checks, as a ZBOOT_VERIFY_* value. Returns false if the write
+//  failed, and also if the image is invalid when 'result' is given.
+bool zboot_write_end_verify(void *context, uint8_t *result_code)
+{
+   zboot_write_status *status = (zboot_write_status *) context;
+   bool result = false;
+
+   ZBOOT_LOCK();
+   if(!status->active)
+   {
+      DEBUG("zboot: No write operation in progress\n");
+      ZBOOT_UNLOCK();
+      if(NULL != result_code)
+         *result_code = ZBOOT_VERIFY_WRITE_FAILED;
+      return false;
+   }
+ 
+   // Complete any queued work; less than a word may be left over
+   result = !status->failed;
+   if(NULL != status->queue)
+   {
+      while(result && zboot_write_has_work(status))
+         result = zboot_write_step(status, zboot_write_next_step(status));
+      if(result)
+      {
+         status->extra_count = status->queued;
+         memcpy(status->extra.bytes, status->queue + status->queue_head, status->queued);
+      }
+      zboot_work_free(status->queue);
+      status->queue = NULL;
+   }
+
+   // Ensure any remaning bytes get written (needed for files not a multiple of 4 bytes)
+   if(result && status->extra_count != 0)
+   {
+      memset(status->extra.bytes + status->extra_count, 0xff, 4 - status->extra_count);
+      status->extra_count = 0;
+      result = zboot_write_span(status, status->extra.bytes, 4);
+   }
+
+   if(result && status->image_index != ZBOOT_INVALID_INDEX)
+   {
+      zboot_catalog_entry entry;
+
+      // The header was copied as it was written; its state word was left erased
+      if(status->start_addr - status->image_addr < sizeof(zimage_header))
+         status->header.magic = 0;
+      status->header.state = ZIMAGE_STATE_WRITTEN;
+      if(status->verify == ZBOOT_VERIFY_OK)
+      {
+         zboot_catalog_fill(&entry, status->image_addr, &status->header, status->image_extent,
+            status->chksum);
+         entry.flags |= ZBOOT_CATALOG_VERIFIED;
+      }
+      else
+         zboot_catalog_fill(&entry, status->image_addr, &status->header,
+            status->start_addr - status->image_addr, status->last_word);
+      zboot_set_catalog_entry(status->image_index, &entry);
+   }
+
+   // An incomplete write can still be resumed
+   if(status->resumable && status->verify != ZBOOT_VERIFY_INCOMPLETE
+   && (0 == status->image_size || status->start_addr >= status->end_addr))
+      zboot_progress_clear();
+
+   if(NULL != result_code)
+   {
+      *result_code = result ? status->verify : ZBOOT_VERIFY_WRITE_FAILED;
+      result = result && status->verify == ZBOOT_VERIFY_OK;
+   }
+   status->active = false;
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Background erase. A slot can be erased before a download starts, a step at a time from
+ *  zboot_erase_poll(), so that writing the image isn't held up by erasing; zboot_write_init()
+ *  on the same address skips the part that's already been erased.
+ */
+
+// Start erasing 'length' bytes at a sector-aligned address in a partition, or to the end of
+//  the partition if 'length' is 0. Replaces any background erase already in progress.
+bool zboot_erase_start(uint32_t address, uint32_t length)
+{
+   zboot_erase_status *erase = &g_zboot_erase_status;
+   uint32_t end_addr;
+   bool result = false;
+
+   ZBOOT_LOCK();
+   if(!zboot_find_partition_end(address, &end_addr))
+      end_addr = address;  // Not in a partition, so nothing may be erased
+   if(0 == length)
+      length = end_addr - address;
+   if((address % SECTOR_SIZE) != 0 || 0 == length || length > end_addr - address
+   || zboot_write_overlaps(address, address + length))
+   {
+      DEBUG("zboot: Invalid erase range %08x, length %u\n", address, length);
+   }
+   else
+   {
+      zboot_catalog_forget(address, address + length);
+      erase->active = true;
+      erase->start_addr = address;
+      erase->end_addr = address + length;
+      erase->erased_addr = address;
+      result = true;
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Erase for up to about 'budget_us' microseconds, at least one sector, using block erases
+//  (with ZBOOT_API_BLOCK_ERASE) when one is expected to fit in the budget. 'remaining', if not NULL, is set to the number
+//  of bytes left to erase. Returns false if there's no background erase or it has failed.
+bool zboot_erase_poll(uint32_t budget_us, uint32_t *remaining)
+{
+   zboot_erase_status *erase = &g_zboot_erase_status;
+   uint32_t start, elapsed, step;
+   bool result;
+   bool first = true;
+
+   ZBOOT_LOCK();
+   result = erase->active;
+   start = system_get_time();
+   while(result && erase->erased_addr < erase->end_addr)
+   {
+      SpiFlashOpResult flash;
+      uint32_t size = SECTOR_SIZE;
+
+      elapsed = system_get_time() - start;
+      step = (ZBOOT_BLOCK_ERASE && 0 == (erase->erased_addr % ZBOOT_BLOCK_SIZE)
+         && erase->end_addr - erase->erased_addr >= ZBOOT_BLOCK_SIZE
+         && erase->step_us[1] <= budget_us) ? 1 : 0;
+      if(!first && elapsed + erase->step_us[step] > budget_us)
+         break;
+
+      if(step > 0)
+      {
+         size = ZBOOT_BLOCK_SIZE;
+         flash = zboot_erase_block(ZBOOT_STATS_OTA, erase->erased_addr / ZBOOT_BLOCK_SIZE);
+      }
+      else
+         flash = zboot_erase_sector(ZBOOT_STATS_OTA, erase->erased_addr / SECTOR_SIZE);
+      erase->step_us[step] = system_get_time() - start - elapsed;
+      if(flash != SPI_FLASH_RESULT_OK)
+      {
+         DEBUG("zboot: Flash erase failed\n");
+         erase->active = false;
+         result = false;
+      }
+      else
+         erase->erased_addr += size;
+      first = false;
+   }
+   if(NULL != remaining)
+      *remaining = erase->end_addr - erase->erased_addr;
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+bool zboot_write_get_info(void *context, zboot_write_info *info)
+{
+   zboot_write_status *status = (zboot_write_status *) context;
+   bool result = false;
+
+   ZBOOT_LOCK();
+   if(status->active)
+   {
+      info->length = status->start_addr - status->image_addr + status->extra_count;
+      info->sectors_erased = status->sectors_erased;
+      info->sectors_skipped = status->sectors_skipped;
+      info->pages_skipped = status->pages_skipped;
+      info->queued = status->queued;
+      result = true;
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Read back 'length' bytes of the image being written, from 'offset' bytes into it, including
+//  data still queued or waiting to make up a word. The state word reads as it was written,
+//  rather than erased.
+bool zboot_write_read(void *context, uint32_t offset, uint8_t *buffer, uint32_t length)
+{
+   const uint32_t stateOffset = ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t);
+   zboot_write_status *status = (zboot_write_status *) context;
+   uint32_t written, pos, skip;
+   bool result;
+
+   ZBOOT_LOCK();
+   written = status->start_addr - status->image_addr;
+   result = status->active
+      && length <= written + status->queued + status->extra_count
+      && offset <= written + status->queued + status->extra_count - length;
+
+   pos = 0;
+   if(result && offset < written)
+   {
+      pos = (length < written - offset) ? length : written - offset;
+      result = zboot_read_bytes(status->image_addr + offset, buffer, pos);
+   }
+   for(; result && pos < length; ++pos)
+   {
+      skip = offset + pos - written;
+      if(skip < status->queued)
+         buffer[pos] = status->queue[(status->queue_head + skip) % status->queue_size];
+      else
+         buffer[pos] = status->extra.bytes[skip - status->queued];
+   }
+
+   if(result && status->image_magic == ZIMAGE_MAGIC)
+      for(pos = stateOffset; pos < stateOffset + sizeof(uint32_t) && pos < written; ++pos)
+         if(pos >= offset && pos - offset < length)
+            buffer[pos - offset] = ((const uint8_t *) &status->header.state)[pos - stateOffset];
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// function to do the actual writing to flash
+// call repeatedly with more data (max len per write is the flash sector size (4k))
+bool zboot_write_flash(void *context, const uint8_t *data, const uint16_t len)
+{
+   bool result;
+
+   ZBOOT_LOCK();
+   result = zboot_write_chunk((zboot_write_status *) context, data, len);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Write a chain of buffers, such as network packets, as if they were a single chunk
+bool zboot_write_flashv(void *context, const zboot_segment *segments, uint16_t count)
+{
+   zboot_write_status *status = (zboot_write_status *) context;
+   bool result;
+
+   ZBOOT_LOCK();
+   if(status->failed)
+      result = false;
+   else if(NULL != status->queue)
+      result = zboot_write_enqueue(status, segments, count);
+   else
+      result = zboot_write_segments(status, segments, count);
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Write 'length' bytes copied from flash at 'source_addr', such as sectors of the running
+//  image that haven't changed, as if they'd been passed to zboot_write_flash(). The source
+//  mustn't overlap the flash being written.
+bool zboot_write_copy(void *context, uint32_t source_addr, uint32_t length)
+{
+   zboot_write_status *status = (zboot_write_status *) context;
+   uint32_t chunk[64];
+   zboot_segment segment;
+   bool result;
+
+   ZBOOT_LOCK();
+   result = status->active && !status->failed
+      && ((source_addr < status->image_addr && length <= status->image_addr - source_addr)
+         || source_addr >= status->end_addr);
+   segment.data = (const uint8_t *) chunk;
+   while(result && length > 0)
+   {
+      segment.length = (length > sizeof(chunk)) ? sizeof(chunk) : length;
+      result = zboot_read_bytes(source_addr, (uint8_t *) chunk, segment.length);
+      if(result && NULL != status->queue)
+         result = zboot_write_enqueue(status, &segment, 1);
+      else if(result)
+         result = zboot_write_segments(status, &segment, 1);
+      source_addr += segment.length;
+      length -= segment.length;
+   }
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Do queued work, with ZBOOT_WRITE_ASYNC, for up to about 'budget_us' microseconds. Each
+//  step is a sector erase, the programming of a flash page or saving a resumable write's
+//  progress, and at least one step is done if there's any work queued. A step that erases
+//  is only started if an erase fits in what's left of the budget: that includes a progress
+//  save that compacts the config log and, with ZBOOT_WRITE_SKIP_UNCHANGED, data that
+//  differs from flash that hasn't been erased yet. Returns false if a write has failed.
+bool zboot_write_poll(void *context, uint32_t budget_us)
+{
+   zboot_write_status *status = (zboot_write_status *) context;
+   uint32_t start, elapsed;
+   uint8_t step;
+   bool result = true;
+   bool first = true;
+
+   ZBOOT_LOCK();
+   start = system_get_time();
+   while(result && !status->failed && zboot_write_has_work(status))
+   {
+      elapsed = system_get_time() - start;
+      step = zboot_write_next_step(status);
+      if(!first && elapsed + status->step_us[step] > budget_us)
+         break;
+      result = zboot_write_step(status, step);
+      first = false;
+   }
+   result = result && !status->failed;
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Do queued work for all the ZBOOT_WRITE_ASYNC contexts within 'budget_us', a step from each
+//  in turn, so that a large download doesn't hold up the others. At least one step is done
+//  if there's any work. Returns false if any of the writes has failed.
+bool zboot_write_poll_all(uint32_t budget_us)
+{
+   zboot_write_status *status;
+   uint32_t start, elapsed;
+   uint8_t idx, idle, step;
+   bool result = true;
+   bool first = true;
+
+   ZBOOT_LOCK();
+   start = system_get_time();
+   for(idle = 0; idle < ZBOOT_WRITE_CONTEXTS; )
+   {
+      status = &g_zboot_write_status[g_zboot_write_next];
+      if(!status->active || status->failed || !zboot_write_has_work(status))
+         ++idle;
+      else
+      {
+         // A context whose step won't fit keeps its turn for the next poll
+         elapsed = system_get_time() - start;
+         step = zboot_write_next_step(status);
+         if(!first && elapsed + status->step_us[step] > budget_us)
+            break;
+         zboot_write_step(status, step);
+         first = false;
+         idle = 0;
+      }
+      g_zboot_write_next = (g_zboot_write_next + 1) % ZBOOT_WRITE_CONTEXTS;
+   }
+   for(idx = 0; idx < ZBOOT_WRITE_CONTEXTS; ++idx)
+      if(g_zboot_write_status[idx].active && g_zboot_write_status[idx].failed)
+         result = false;
+   ZBOOT_UNLOCK();
+   return result;
+}
+
+// Caller must hold the API lock
+static bool zboot_write_chunk(zboot_write_status *status, const uint8_t *data, const uint16_t len)
+{
+   zboot_segment segment;
+
+   if (data == NULL || len == 0)
+      return true;  // Assume we're done
+
+   segment.data = data;
+   segment.length = len;
+   if(status->failed)
+      return false;
+   if(NULL != status->queue)
+      return zboot_write_enqueue(status, &segment, 1);
+   return zboot_write_segments(status, &segment, 1);
+}
+
+// Copy data into the queue. If it's full, queued work is done until there's room, so this
+//  only blocks when the data arrives faster than zboot_write_poll() writes it.
+static bool zboot_write_enqueue(zboot_write_status *status, const zboot_segment *segments,
+   uint16_t count)
+{
+   uint16_t idx;
+
+   for(idx = 0; idx < count; ++idx)
+   {
+      const uint8_t *data = segments[idx].data;
+      uint32_t remaining = (NULL == data) ? 0 : segments[idx].length;
+
+      while(remaining > 0)
+      {
+         uint32_t tail = (status->queue_head + status->queued) % status->queue_size;
+         uint32_t length = status->queue_size - status->queued;
+
+         if(0 == length)
+         {
+            if(!zboot_write_step(status, zboot_write_next_step(status)))
+               return false;
+            continue;
+         }
+         if(length > status->queue_size - tail)
+            length = status->queue_size - tail;
+         if(length > remaining)
+            length = remaining;
+         memcpy(status->queue + tail, data, length);
+         status->queued += length;
+         data += length;
+         remaining -= length;
+      }
+   }
    return true;
 }
 
-bool zboot_get_boot_mode(uint8_t *mode)
+// Length of the queued data the next step will write: whole words, contiguous in the queue,
+//  and within one flash page
+static uint32_t zboot_write_step_length(zboot_write_status *status)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   if(NULL != mode)
-      *mode = config.mode;
-   return true;
-}
+   uint32_t length = status->queued;
 
-bool zboot_get_options(uint8_t *options)
-{
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   if(NULL != options)
-      *options = config.options;
-   return true;
+   if(length > status->queue_size - status->queue_head)
+      length = status->queue_size - status->queue_head;
+   if(length > ZBOOT_PAGE_SIZE - (status->start_addr % ZBOOT_PAGE_SIZE))
+      length = ZBOOT_PAGE_SIZE - (status->start_addr % ZBOOT_PAGE_SIZE);
+   return length - (length % sizeof(uint32_t));
 }
 
-bool zboot_get_image_address(uint8_t index, uint32_t *address)
+// True if there's queued data, or progress waiting to be saved
+static bool zboot_write_has_work(zboot_write_status *status)
 {
-   zboot_config config;
-   if(!zboot_get_config(&config))
-      return false;
-   if(index >= config.count)
-      return false;
-   if(NULL != address)
-      *address = config.roms[index];
-   return true;
+   return NULL != status->queue && (status->queued >= sizeof(uint32_t) || status->save_pending);
 }
 
-bool zboot_get_current_boot_index(uint8_t *index)
+// The kind of the next step, ZBOOT_STEP_*, which is ZBOOT_STEP_ERASE for any step that erases
+//  flash, so that it's budgeted as one
+static uint8_t zboot_write_next_step(zboot_write_status *status)
 {
-   zboot_rtc_data rtc;
-   if(!zboot_get_rtc_data(&rtc))
+   uint32_t length;
+
+   if(status->save_pending)
+      return (zboot_progress_record_due(status)
+         && zboot_log_needs_compact(zboot_get_log(), sizeof(zboot_write_progress)))
+         ? ZBOOT_STEP_ERASE : ZBOOT_STEP_PROGRAM;
+
+   length = zboot_write_step_length(status);
+   if(status->options & ZBOOT_WRITE_SKIP_UNCHANGED)
    {
-      DEBUG("zboot: Failed to read RTC data\n");
-      return false;
+      // A step never crosses a sector boundary, so its sector either is already erased, or
+      //  must be erased if the data differs from it
+      if(status->erased_addr > status->start_addr)
+         return ZBOOT_STEP_PROGRAM;
+      if(status->start_addr == status->image_addr)
+         memcpy(&status->image_magic, status->queue + status->queue_head, sizeof(uint32_t));
+      return zboot_write_matches(status, status->queue + status->queue_head, length)
+         ? ZBOOT_STEP_PROGRAM : ZBOOT_STEP_ERASE;
    }
-   if(NULL != index)
-      *index = rtc.last_rom;
-   return true;
+   return (status->erased_addr < status->start_addr + length) ? ZBOOT_STEP_ERASE : ZBOOT_STEP_PROGRAM;
 }
 
-bool zboot_get_current_boot_mode(uint8_t *mode)
+// Save progress, erase a sector, or write up to a page of queued data, as 'step' from
+//  zboot_write_next_step() says, and record how long it took. A sector erase can't be split,
+//  so it's the longest step. Caller must hold the API lock.
+static bool zboot_write_step(zboot_write_status *status, uint8_t step)
 {
-   zboot_rtc_data rtc;
-   if (!zboot_get_rtc_data(&rtc))
+   uint32_t start = system_get_time();
+   uint32_t length = zboot_write_step_length(status);
+   bool result = true;
+
+   if(status->save_pending)
    {
-      DEBUG("zboot: Failed to read RTC data\n");
-      return false;
+      status->save_pending = false;
+      zboot_progress_save(status);
    }
-
-   if(NULL != mode)
-      *mode = rtc.last_mode;
-   return true;
+   else if(step == ZBOOT_STEP_ERASE && (status->options & ZBOOT_WRITE_SKIP_UNCHANGED))
+      result = zboot_write_erase_changed(status);
+   else if(step == ZBOOT_STEP_ERASE)
+      result = zboot_write_erase_next(status, false);
+   else
+   {
+      result = zboot_write_span(status, status->queue + status->queue_head, length);
+      status->queue_head = (status->queue_head + length) % status->queue_size;
+      status->queued -= length;
+   }
+   status->step_us[step] = system_get_time() - start;
+   if(!result)
+      status->failed = true;
+   return result;
 }
 
-bool zboot_get_current_image_info(uint32_t *version, uint32_t *date,
-   uint32_t *address, uint8_t *index, char *description, uint8_t maxDescriptionLength)
+// Word-aligned data is written straight from the segments. Anything else is gathered in a
+//  staging buffer, along with the partial word left over from the last call, and written
+//  when the buffer fills up or the segments run out. Writes break at page boundaries
+//  while more data follows, so that a page isn't programmed a piece per segment: the end
+//  of a straight write is staged with the data after it, and staged data is written once
+//  it fills a page and aligned data follows. The work buffer is used for staging, or a
+//  smaller one on the stack if it's in use. Caller must hold the API lock.
+static bool zboot_write_segments(zboot_write_status *status, const zboot_segment *segments,
+   uint16_t count)
 {
-   zimage_header header;
-   zboot_rtc_data rtc;
-
-   DEBUG("%s\n", __func__);
+   uint32_t stage[32];
+   uint8_t *buffer = NULL;
+   uint32_t size = status->extra_count + 2 * sizeof(uint32_t) - 1;
+   uint32_t used = 0;
+   uint32_t after = 0;  // Bytes in the segments after the current one
+   uint32_t length, tail;
+   uint16_t idx;
+   bool success = true;
 
-   if(!zboot_get_rtc_data(&rtc))
+   for(idx = 0; idx < count; ++idx)
    {
-      DEBUG("zboot: Failed to get zboot data\n");
-      return false;
+      size += segments[idx].length;
+      if(NULL != segments[idx].data)
+         after += segments[idx].length;
    }
+   size -= size % sizeof(uint32_t);
 
-   DEBUG("zboot: Current boot index %u, address %08x\n", rtc.last_rom, rtc.rom_addr);
-   if(!zboot_get_image_header(rtc.rom_addr, &header))
+   for(idx = 0; success && idx < count; ++idx)
    {
-      DEBUG("zboot: Failed to read image header\n");
-      return false;
-   }
+      const uint8_t *data = segments[idx].data;
+      uint32_t remaining = (NULL == data) ? 0 : segments[idx].length;
 
-   if(header.magic != ZIMAGE_MAGIC)
-      return false;
+      after -= remaining;
+      while(success && remaining > 0)
+      {
+         if(0 == used && 0 == status->extra_count && remaining >= sizeof(uint32_t)
+         && 0 == ((uintptr_t) data % sizeof(uint32_t)))
+         {
+            length = remaining - (remaining % sizeof(uint32_t));
+            tail = (status->start_addr + length) % ZBOOT_PAGE_SIZE;
+            if(remaining + after > length && tail > 0)
+               length = (length > tail) ? length - tail : 0;
+            if(length > 0)
+            {
+               success = zboot_write_span(status, data, length);
+               data += length;
+               remaining -= length;
+               continue;
+            }
+         }
 
-   if(NULL != version)
-      *version = header.version;
-   if(NULL != date)
-      *date = header.date;
-   if(NULL != address)
-      *address = rtc.rom_addr;
-   if(NULL != index)
-      *index = rtc.last_rom;
-   if(NULL != description && maxDescriptionLength > 0)
-      strncpy(description, header.description, maxDescriptionLength);
+         if(NULL == buffer)
+         {
+            buffer = zboot_work_alloc(&size, 2 * sizeof(uint32_t));
+            if(NULL == buffer)
+            {
+               buffer = (uint8_t *) stage;
+               if(size > sizeof(stage))
+                  size = sizeof(stage);
+            }
+         }
+         if(0 == used)
+         {
+            memcpy(buffer, status->extra.bytes, status->extra_count);
+            used = status->extra_count;
+            status->extra_count = 0;
+         }
 
-   return true;
+         length = (remaining < size - used) ? remaining : size - used;
+         tail = ZBOOT_PAGE_SIZE - ((status->start_addr + used) % ZBOOT_PAGE_SIZE);
+         if(length > tail)
+            length = tail;
+         memcpy(buffer + used, data, length);
+         used += length;
+         data += length;
+         remaining -= length;
+         if(used == size || (length == tail && remaining + after > 0
+         && 0 == ((uintptr_t) (remaining > 0 ? data : segments[idx + 1].data) % sizeof(uint32_t))))
+         {
+            success = zboot_write_span(status, buffer, used);
+            used = 0;
+         }
+      }
+   }
+
+   // Write the staged data; save any remaining bytes for the next call, since the write
+   //  length must be a multiple of 4
+   if(success && used > 0)
+   {
+      length = used - (used % sizeof(uint32_t));
+      if(length > 0)
+         success = zboot_write_span(status, buffer, length);
+      status->extra_count = used - length;
+      memcpy(status->extra.bytes, buffer + length, status->extra_count);
+   }
+   if(buffer != (uint8_t *) stage)
+      zboot_work_free(buffer);
+   return success;
 }
 
-bool zboot_find_best_write_index(uint8_t *index, bool overwriteOldest)
+static void zboot_write_reject(zboot_write_status *status, uint8_t reason)
 {
-   uint8_t idx, best_index = 0;
-   uint32_t best_date = 0xffffffff;
-   bool found = false;
-   zboot_config config;
-   zboot_rtc_data rtc;
+   DEBUG("zboot: Image rejected (%u)\n", reason);
+   status->verify = reason;
+   status->parse_field = ZBOOT_PARSE_DONE;
+}
 
-   if(!zboot_get_rtc_data(&rtc))
-   {
-      DEBUG("zboot: Failed to get zboot data\n");
-      return false;
-   }
+// Follow the image as it's written: learn how far it extends from its section headers, and
+//  make the checks check_image() does in the bootloader, so the image is verified without
+//  reading it back. Each section header is an address word followed by a length word. Fails
+//  if the image won't fit in the space available.
+static bool zboot_write_parse(zboot_write_status *status, uint32_t offset, const uint8_t *data,
+   uint32_t length)
+{
+   const uint32_t stateOffset = ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t);
+   uint32_t word, end, pos;
 
-   if(!zboot_get_config(&config))
+   if(offset < sizeof(zimage_header))
    {
-      DEBUG("zboot: Failed to read zboot config\n");
-      return false;
+      end = (length < sizeof(zimage_header) - offset) ? offset + length : sizeof(zimage_header);
+      memcpy((uint8_t *) &status->header + offset, data, end - offset);
+      if(end == sizeof(zimage_header) && status->parse_field != ZBOOT_PARSE_DONE)
+      {
+         if(status->header.entry < 0x40100000 || status->header.entry >= 0x40300000)
+            zboot_write_reject(status, ZBOOT_VERIFY_BAD_HEADER);
+         else if(!zimage_check_address(&status->header, status->image_addr))
+            zboot_write_reject(status, ZBOOT_VERIFY_BAD_ADDRESS);
+      }
    }
 
-   for(idx = 0; idx < config.count; ++idx)
+   while((status->parse_field == ZBOOT_PARSE_COUNT || status->parse_field == ZBOOT_PARSE_LENGTH)
+   && status->parse_next >= offset && status->parse_next - offset < length)
    {
-      uint32_t date;
-      if(idx == rtc.last_rom)
+      memcpy(&word, data + (status->parse_next - offset), sizeof(word));
+      if(status->parse_field == ZBOOT_PARSE_COUNT)
       {
-         // not possible to overwrite currently-executing image
-      }
-      else if(zboot_get_image_info(idx, NULL, &date, NULL, NULL, 0))
-      {
-         if(overwriteOldest && (date < best_date))
+         if(word > 256)
+         {
+            zboot_write_reject(status, ZBOOT_VERIFY_BAD_HEADER);
+            break;
+         }
+         status->sections_left = word;
+         status->image_extent = sizeof(zimage_header) + sizeof(uint32_t);
+         status->parse_next = sizeof(zimage_header);
+         status->parse_field = ZBOOT_PARSE_CHECKSUM;
+         if(word > 0)
          {
-            best_index = idx;
-            best_date = date;
-            found = true;
+            status->parse_next += sizeof(uint32_t);
+            status->parse_field = ZBOOT_PARSE_LENGTH;
          }
+         continue;
+      }
+
+      end = status->parse_next + sizeof(uint32_t) + word;  // End of the section's data
+      if((word % sizeof(uint32_t)) != 0 || end < status->parse_next)
+      {
+         zboot_write_reject(status, ZBOOT_VERIFY_BAD_SECTION);
+         break;
+      }
+      if(--status->sections_left > 0)
+      {
+         status->image_extent = end + 2 * sizeof(uint32_t);
+         status->parse_next = end + sizeof(uint32_t);
       }
       else
       {
-         found = true;
-         best_index = idx;
-         break;  // Stop search
+         status->image_extent = end + sizeof(uint32_t);
+         status->parse_next = end;
+         status->parse_field = ZBOOT_PARSE_CHECKSUM;
       }
    }
 
-   if(!found)
+   // Every word before the checksum is included in it, other than the state word
+   if(status->parse_field != ZBOOT_PARSE_DONE)
    {
-      best_index = (rtc.last_rom + 1) % config.count;
-      found = (best_index != rtc.last_rom);
+      end = length;
+      if(status->parse_field == ZBOOT_PARSE_CHECKSUM && status->parse_next - offset < length)
+         end = status->parse_next - offset;
+      for(pos = 0; pos < end; pos += sizeof(uint32_t))
+         if(offset + pos != stateOffset)
+            status->chksum += *((const uint32_t *) (data + pos));
+
+      if(end < length)
+      {
+         memcpy(&word, data + end, sizeof(word));
+         status->parse_field = ZBOOT_PARSE_DONE;
+         if(word == status->chksum)
+            status->verify = ZBOOT_VERIFY_OK;
+         else
+            zboot_write_reject(status, ZBOOT_VERIFY_BAD_CHECKSUM);
+      }
    }
 
-   if(found && index != NULL)
-      *index = best_index;
-   return found;
-}
-
-bool zboot_get_image_count(uint8_t *count)
-{
-   zboot_config config;
-   if(!zboot_get_config(&config))
+   if(status->image_extent > status->end_addr - status->image_addr)
+   {
+      DEBUG("zboot: Image size %u exceeds partition\n", status->image_extent);
       return false;
-   if(NULL != count)
-      *count = config.count;
+   }
    return true;
 }
 
-bool zboot_get_image_info(uint8_t index, uint32_t *version, uint32_t *date,
-   uint32_t *address, char *description, uint8_t maxDescriptionLength)
+// Erase ahead as needed and write 'length' bytes, a multiple of 4, from a word-aligned
+//  buffer. Caller must hold the API lock.
+static bool zboot_write_piece(zboot_write_status *status, const uint8_t *data, uint32_t length)
 {
-   zboot_config config;
-   zimage_header header;
+   uint32_t offset = status->start_addr - status->image_addr;
 
-   if(!zboot_get_config(&config))
+   // Ensure new chunk will fit 
+   if (length > status->end_addr - status->start_addr)
    {
-      DEBUG("zboot: Failed to read zboot config\n");
+      DEBUG("zboot: Flash overrun\n");
       return false;
    }
 
-   if(index > config.count)
-      return false;
-
-   if(!zboot_get_image_header(config.roms[index], &header))
+   if(0 == offset)
    {
-      DEBUG("zboot: Failed to read header for ROM index %u @ %08x\n", index, config.roms[index]);
-      return false;
+      memcpy(&status->image_magic, data, sizeof(uint32_t));
+      if(status->image_magic == ZIMAGE_MAGIC)
+      {
+         status->parse_field = ZBOOT_PARSE_COUNT;
+         status->parse_next = ZIMAGE_HEADER_OFFSET_COUNT * sizeof(uint32_t);
+      }
+      else
+         status->verify = ZBOOT_VERIFY_BAD_MAGIC;
    }
-
-   if(header.magic != ZIMAGE_MAGIC)
+   if(!zboot_write_parse(status, offset, data, length))
       return false;
 
-   if(NULL != address)
-      *address = config.roms[index];
-   if(NULL != version)
-      *version = header.version;
-   if(NULL != date)
-      *date = header.date;
-   if(NULL != description && maxDescriptionLength > 0)
-      strncpy(description, header.description, maxDescriptionLength);
+   if(status->options & ZBOOT_WRITE_SKIP_UNCHANGED)
+      return zboot_write_compare(status, data, length);
+   return zboot_write_program(status, data, length);
+}
+
+// As zboot_write_piece(). A resumable write is split at sector boundaries, where its progress
+//  is saved.
+static bool zboot_write_span(zboot_write_status *status, const uint8_t *data, uint32_t length)
+{
+   uint32_t piece;
 
+   if(!status->resumable)
+      return zboot_write_piece(status, data, length);
+
+   for(; length > 0; data += piece, length -= piece)
+   {
+      piece = SECTOR_SIZE - (status->start_addr % SECTOR_SIZE);
+      if(piece > length)
+         piece = length;
+      if(!zboot_write_piece(status, data, piece))
+         return false;
+      if(0 != status->start_addr % SECTOR_SIZE)
+         continue;
+      if(NULL != status->queue)
+         status->save_pending = true;  // Saved by the next step, so it's within a poll's budget
+      else
+         zboot_progress_save(status);
+   }
    return true;
 }
 
-bool zboot_get_flash_size(uint8_t *size)
+// Write to flash that's already erased. Flash is programmed a page at a time, and parts of
+//  pages whose data is all 0xff are left as they are, since erased flash already holds that;
+//  the rest is written in as few operations as possible.
+static bool zboot_write_pages(zboot_write_status *status, uint32_t addr, const uint8_t *data,
+   uint32_t length)
 {
-   zboot_rtc_data rtc;
-   DEBUG("%s\n", __func__);
+   uint32_t run = 0;  // Length of the data waiting to be written, ending at 'pos'
+   uint32_t pos, piece, word;
 
-   if(!zboot_get_rtc_data(&rtc))
+   for(pos = 0; pos < length; pos += piece)
    {
-      DEBUG("zboot: Failed to get rtc data\n");
-      return false;
-   }
+      piece = ZBOOT_PAGE_SIZE - ((addr + pos) % ZBOOT_PAGE_SIZE);
+      if(piece > length - pos)
+         piece = length - pos;
+
+      for(word = 0; word < piece; word += sizeof(uint32_t))
+         if(*((const uint32_t *) (data + pos + word)) != 0xffffffff)
+            break;
+      if(word < piece)
+      {
+         run += piece;
+         continue;
+      }
 
-   if(NULL != size)
-      *size = rtc.spi_size;
-   return true;
+      if(run > 0 && zboot_spi_write(ZBOOT_STATS_OTA, addr + pos - run, data + pos - run, run)
+         != SPI_FLASH_RESULT_OK)
+         return false;
+      run = 0;
+      ++status->pages_skipped;
+   }
+   return 0 == run
+      || zboot_spi_write(ZBOOT_STATS_OTA, addr + length - run, data + length - run, run)
+         == SPI_FLASH_RESULT_OK;
 }
 
-bool zboot_get_flash_speed(uint8_t *speed)
+// Write to flash that's already erased, leaving the state word erased so the image's state
+//  can be changed without erasing it
+static bool zboot_write_raw(zboot_write_status *status, uint32_t addr, const uint8_t *data,
+   uint32_t length)
 {
-   zboot_rtc_data rtc;
-   DEBUG("%s\n", __func__);
+   const uint32_t stateOffset = ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t);
+   uint32_t offset = addr - status->image_addr;
+   uint32_t skip = length;
 
-   if(!zboot_get_rtc_data(&rtc))
+   if(status->image_magic == ZIMAGE_MAGIC && offset <= stateOffset && offset + length > stateOffset)
+      skip = stateOffset - offset;
+
+   if ((skip > 0 && !zboot_write_pages(status, addr, data, skip))
+   || (skip + sizeof(uint32_t) < length
+      && !zboot_write_pages(status, addr + skip + sizeof(uint32_t), data + skip + sizeof(uint32_t),
+         length - skip - sizeof(uint32_t))))
    {
-      DEBUG("zboot: Failed to get rtc data\n");
+      DEBUG("zboot: Flash write failed\n");
       return false;
    }
-
-   if(NULL != speed)
-      *speed = rtc.spi_speed;
    return true;
 }
 
-bool zboot_get_flash_mode(uint8_t *mode)
+// Erase the next sector, or the next block if 'block' is set and the whole block belongs to
+//  the image
+static bool zboot_write_erase_next(zboot_write_status *status, bool block)
 {
-   zboot_rtc_data rtc;
-   DEBUG("%s\n", __func__);
+   uint32_t limit;
+   uint32_t size = SECTOR_SIZE;
+   SpiFlashOpResult result;
 
-   if(!zboot_get_rtc_data(&rtc))
+   limit = status->image_addr + ((status->image_size > 0) ? status->image_size : status->image_extent);
+   if(ZBOOT_BLOCK_ERASE && block && 0 == (status->erased_addr % ZBOOT_BLOCK_SIZE)
+   && limit >= ZBOOT_BLOCK_SIZE && status->erased_addr <= limit - ZBOOT_BLOCK_SIZE)
    {
-      DEBUG("zboot: Failed to get rtc data\n");
+      size = ZBOOT_BLOCK_SIZE;
+      result = zboot_erase_block(ZBOOT_STATS_OTA, status->erased_addr / ZBOOT_BLOCK_SIZE);
+   }
+   else
+      result = zboot_erase_sector(ZBOOT_STATS_OTA, status->erased_addr / SECTOR_SIZE);
+   if(result != SPI_FLASH_RESULT_OK)
+   {
+      DEBUG("zboot: Flash erase failed\n");
       return false;
    }
-
-   if(NULL != mode)
-      *mode = rtc.spi_mode;
+   status->erased_addr += size;
+   status->sectors_erased += size / SECTOR_SIZE;
    return true;
 }
 
-// ----------------------------------------------------------------------------------
-// Write application image
+// Erase ahead as needed and write the data
+static bool zboot_write_program(zboot_write_status *status, const uint8_t *data, uint32_t length)
+{
+   while(status->erased_addr < status->start_addr + length)
+      if(!zboot_write_erase_next(status, true))
+         return false;
 
-typedef struct
-{ 
-   bool active;
-   uint32_t start_addr;
-   uint32_t start_sector;
-   int32_t last_sector;
-   int32_t last_sector_erased;
-   uint8_t extra_count;
-   uint8_t extra_bytes[4];
-} zboot_write_status;
-static zboot_write_status g_zboot_write_status = {0};
+   if(!zboot_write_raw(status, status->start_addr, data, length))
+      return false;
+   status->start_addr += length;
+   memcpy(&status->last_word, data + length - sizeof(uint32_t), sizeof(uint32_t));
+   return true;
+}
 
-// Note: there can be only one write operation in progress at a time
-void *zboot_write_init(uint32_t start_addr)
+// Returns true if flash at the write address already holds 'length' bytes of data. The state
+//  word only matches if it's erased, as it would be after writing.
+static bool zboot_write_matches(zboot_write_status *status, const uint8_t *data, uint32_t length)
 {
-   zboot_write_status *status = &g_zboot_write_status;
+   const uint32_t stateOffset = ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t);
+   uint32_t chunk[16];
+   uint32_t addr = status->start_addr;
+   uint32_t pos, readlen;
 
-   if(status->active)
+   for(pos = 0; pos < length; pos += readlen)
    {
-      DEBUG("zboot: Write operation already in progress\n");
-      return NULL;
+      readlen = (length - pos > sizeof(chunk)) ? sizeof(chunk) : length - pos;
+      if(zboot_spi_read(ZBOOT_STATS_OTA, addr + pos, chunk, readlen) != SPI_FLASH_RESULT_OK)
+         return false;
+      if(status->image_magic == ZIMAGE_MAGIC && addr + pos - status->image_addr <= stateOffset
+      && addr + pos + readlen - status->image_addr > stateOffset)
+      {
+         uint32_t *state = &chunk[(stateOffset - (addr + pos - status->image_addr)) / sizeof(uint32_t)];
+         if(*state != ZIMAGE_STATE_WRITTEN)
+            return false;
+         memcpy(state, data + pos + ((uint8_t *) state - (uint8_t *) chunk), sizeof(uint32_t));
+      }
+      if(memcmp(chunk, data + pos, readlen) != 0)
+         return false;
    }
-
-   memset(status, 0, sizeof(*status));
-   status->active = true;
-   status->start_addr = start_addr;
-   status->start_sector = start_addr / SECTOR_SIZE;
-   status->last_sector = -1;  // TODO: calculate last sector
-   status->last_sector_erased = status->start_sector - 1;
-   return (void *) status; 
+   return true;
 }
 
-bool zboot_write_end(void *context)
+// Erase the sector at the write address, whose data has changed, keeping the part of it
+//  that's already been written
+static bool zboot_write_erase_changed(zboot_write_status *status)
 {
-   zboot_write_status *status = (zboot_write_status *) context;
-   bool result = false;
+   uint32_t sector = status->start_addr - (status->start_addr % SECTOR_SIZE);
+   uint32_t prefix = status->start_addr - sector;
+   uint32_t size = prefix;
+   uint8_t *buffer = NULL;
+   bool success;
 
-   if(!status->active)
+   if(prefix > 0)
    {
-      DEBUG("zboot: No write operation in progress\n");
-      return false;
+      buffer = zboot_scratch_alloc(&size, prefix);
+      if(NULL == buffer)
+         return false;
+      if(zboot_spi_read(ZBOOT_STATS_OTA, sector, buffer, prefix) != SPI_FLASH_RESULT_OK)
+      {
+         zboot_work_free(buffer);
+         return false;
+      }
    }
- 
-   // Ensure any remaning bytes get written (needed for files not a multiple of 4 bytes)
-   if(status->extra_count != 0)
+   success = (zboot_erase_sector(ZBOOT_STATS_OTA, sector / SECTOR_SIZE) == SPI_FLASH_RESULT_OK);
+   if(success)
    {
-      for (uint8_t i = status->extra_count; i < 4; ++i)
-         status->extra_bytes[i] = 0xff;
-      result = zboot_write_flash(status, status->extra_bytes, 4);
+      status->erased_addr = sector + SECTOR_SIZE;
+      ++status->sectors_erased;
+      if(prefix > 0)
+         success = zboot_write_raw(status, sector, buffer, prefix);
    }
    else
-      result = true;
-
-   status->active = false;
-   return result;
+      DEBUG("zboot: Flash erase failed\n");
+   zboot_work_free(buffer);
+   return success;
 }
 
-// function to do the actual writing to flash
-// call repeatedly with more data (max len per write is the flash sector size (4k))
-bool zboot_write_flash(void *context, const uint8_t *data, const uint16_t len)
+// Leave sectors whose content is unchanged as they are: data is compared with flash until it
+//  differs, and only then is the sector erased, and the part that matched written back
+static bool zboot_write_compare(zboot_write_status *status, const uint8_t *data, uint32_t length)
 {
-   zboot_write_status *status = (zboot_write_status *) context;
-   bool success = true;
-   uint8_t *buffer;
-   int32_t lastsect;
-   uint16_t length = len;
-	
-   if (data == NULL || len == 0)
-      return true;  // Assume we're done
-	
-   // get a buffer
-   buffer = (uint8_t *)os_malloc(len + status->extra_count);
-   if (NULL == buffer)
+   while(length > 0)
    {
-      DEBUG("zboot: Failed to allocate RAM for flash write\n");
-      return false;
-   }
-
-   // Copy any remaining bytes from last chunk, then copy new data
-   if (status->extra_count > 0)
-      memcpy(buffer, status->extra_bytes, status->extra_count);
-   memcpy(buffer + status->extra_count, data, len);
+      uint32_t piece = SECTOR_SIZE - (status->start_addr % SECTOR_SIZE);
 
-   // Write length must be multiple of 4; save any remaining bytes for next chunk 
-   length += status->extra_count;
-   status->extra_count = length % 4;
-   length -= status->extra_count;
-   memcpy(status->extra_bytes, buffer + length, status->extra_count);
+      if(piece > length)
+         piece = length;
 
-   // Ensure new chunk will fit 
-   if ((status->last_sector >= 0) && 
-       (status->start_addr + length) > (status->last_sector * SECTOR_SIZE))
-   {
-      DEBUG("zboot: Flash overrun\n");
-      success = false;
-   }
-   else
-   {
-      // erase any additional sectors needed by this chunk
-      lastsect = ((status->start_addr + length) - 1) / SECTOR_SIZE;
-      while (lastsect > status->last_sector_erased)
+      // Flash beyond erased_addr hasn't been erased by this write, so it may still match
+      if(status->erased_addr <= status->start_addr)
       {
-         ++(status->last_sector_erased);
-         spi_flash_erase_sector(status->last_sector_erased);
-      }
+         if(zboot_write_matches(status, data, piece))
+         {
+            status->start_addr += piece;
+            memcpy(&status->last_word, data + piece - sizeof(uint32_t), sizeof(uint32_t));
+            if(0 == (status->start_addr % SECTOR_SIZE))
+               ++status->sectors_skipped;
+            data += piece;
+            length -= piece;
+            continue;
+         }
 
-      // write current chunk
-      if (spi_flash_write(status->start_addr, (uint32_t *)((void*)buffer), length) != SPI_FLASH_RESULT_OK)
-      {
-         DEBUG("zboot: Flash write failed\n");
-         success = false;
+         if(!zboot_write_erase_changed(status))
+            return false;
       }
-      else
-         status->start_addr += length;
-   }
 
-   os_free(buffer);
-   return success;
+      if(!zboot_write_program(status, data, piece))
+         return false;
+      data += piece;
+      length -= piece;
+   }
+   return true;
 }
 
 // ----------------------------------------------------------------------------------
@@ -698,13 +3276,40 @@ void zboot_api_init(void)
 {
    zboot_rtc_data rtc;
 
+#if defined(ZBOOT_API_FREERTOS)
+   if(NULL == g_zboot_mutex)
+      g_zboot_mutex = xSemaphoreCreateMutex();
+#endif
    zboot_get_rtc_data(&rtc);
 }
 
+// Use a caller-provided, word-aligned buffer for the memory needed by API operations; the
+//  API then never allocates memory. The first ZBOOT_API_SCRATCH_SIZE bytes are scratch
+//  memory, and the rest the work buffer; ZBOOT_API_BUFFER_SIZE bytes are enough for every
+//  operation, with one ZBOOT_WRITE_ASYNC write at a time. A NULL buffer restores allocation.
+bool zboot_api_init_buffer(void *buffer, uint32_t size)
+{
+   if(NULL != buffer && (((uintptr_t) buffer % sizeof(uint32_t)) != 0
+      || size < ZBOOT_API_SCRATCH_SIZE + 2 * sizeof(uint32_t)))
+      return false;
+
+   zboot_api_init();
+   ZBOOT_LOCK();
+   g_zboot_scratch = (uint8_t *) buffer;
+   g_zboot_scratch_size = (NULL == buffer) ? 0 : ZBOOT_API_SCRATCH_SIZE;
+   g_zboot_scratch_busy = false;
+   g_zboot_work = (NULL == buffer) ? NULL : g_zboot_scratch + ZBOOT_API_SCRATCH_SIZE;
+   g_zboot_work_size = (NULL == buffer) ? 0 : (size - ZBOOT_API_SCRATCH_SIZE) & ~3;
+   g_zboot_work_busy = false;
+   ZBOOT_UNLOCK();
+   return true;
+}
+
 #define CACHE_READ_ENABLE()                                                                 \
    volatile zboot_rtc_data *rtc =                                                           \
       (volatile zboot_rtc_data *)(ESP_RTC_MEM_START + (ZBOOT_RTC_ADDR / sizeof(uint32_t))); \
-   Cache_Read_Enable_original((rtc->rom_addr >> 20) & 1, (rtc->rom_addr >> 21) & 1, 1);
+   Cache_Read_Enable_original(zboot_flash_window_odd(rtc->rom_addr),                        \
+      zboot_flash_window_high(rtc->rom_addr), 1);
 
 void __attribute__((section(".entry.text"))) Cache_Read_Enable_New(void)
 {
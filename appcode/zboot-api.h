@@ -35,11 +35,126 @@
 #define ZBOOT_OPTION_GPIO_ERASES_SDKCONFIG 0x01
 #define ZBOOT_OPTION_UPDATE_BOOT_INDEX     0x02
 
+// Image states, stored in the image header. Each transition clears bits, so it's made
+//  without erasing flash.
+#define ZIMAGE_STATE_WRITTEN    0xffffffff  // Written, not yet verified
+#define ZIMAGE_STATE_VERIFIED   0x7fffffff  // Contents verified by the application
+#define ZIMAGE_STATE_CONFIRMED  0x3fffffff  // Booted and confirmed working
+#define ZIMAGE_STATE_INVALID    0x1fffffff  // Don't boot
+
+#define ZBOOT_PARTITION_APP          0x00  // Application image slot
+#define ZBOOT_PARTITION_FILESYSTEM   0x01
+#define ZBOOT_PARTITION_CALIBRATION  0x02
+#define ZBOOT_PARTITION_LOG          0x03
+#define ZBOOT_PARTITION_DATA         0x04
+#define ZBOOT_PARTITION_TYPES        0x08  // Types 0x05-0x07 are available for application use
+#define ZBOOT_PARTITION_ALL          0xff  // Every type, for the partition lookup functions
+
+typedef struct
+{
+   uint8_t type;        // ZBOOT_PARTITION_*
+   uint8_t subtype;     // Application-defined
+   uint16_t flags;      // ZBOOT_PARTITION_FLAG_*; the other bits are application-defined
+      #define ZBOOT_PARTITION_FLAG_ACTIVE 0x8000  // In use, of the partitions of its type
+   uint32_t address;    // Flash address, sector aligned
+   uint32_t size;       // Size in bytes, sector aligned
+} zboot_partition;
+
+// Flash operation statistics, collected when zboot-api.c is built with ZBOOT_API_STATS
+#define ZBOOT_STATS_CONFIG      0  // Config log records
+#define ZBOOT_STATS_HEADER      1  // Image headers and state
+#define ZBOOT_STATS_OTA         2  // Image writes
+#define ZBOOT_STATS_CATEGORIES  3
+
+#define ZBOOT_STATS_READ        0
+#define ZBOOT_STATS_WRITE       1
+#define ZBOOT_STATS_ERASE       2
+#define ZBOOT_STATS_OPS         3
+
+// Histogram bucket n counts operations taking fewer than ZBOOT_STATS_BUCKET_LIMIT(n) CPU
+//  cycles (51us at 80MHz for bucket 0, each bucket 4x the previous); the last bucket
+//  counts the rest
+#define ZBOOT_STATS_BUCKETS     8
+#define ZBOOT_STATS_BUCKET_LIMIT(n) (1UL << (12 + 2 * (n)))
+
+typedef struct
+{
+   uint32_t count;
+   uint32_t bytes;
+   uint32_t cycles;        // Total, modulo 2^32
+   uint32_t max_cycles;
+   uint32_t histogram[ZBOOT_STATS_BUCKETS];
+} zboot_op_stats;
+
+typedef struct
+{
+   zboot_op_stats op[ZBOOT_STATS_CATEGORIES][ZBOOT_STATS_OPS];
+} zboot_stats;
+
+// zboot_write_init_ex() options
+#define ZBOOT_WRITE_SKIP_UNCHANGED 0x01  // Compare with flash, and leave sectors that match as they are
+#define ZBOOT_WRITE_ASYNC          0x02  // Queue data, to be written by zboot_write_poll()
+
+// Writes that can be in progress at once, each to its own region
+#ifndef ZBOOT_WRITE_CONTEXTS
+#define ZBOOT_WRITE_CONTEXTS 2
+#endif
+
+// Erase cycles by which a slot may be more worn than the least-worn candidate before
+//  zboot_find_best_write_index() passes over it, if wear tracking is enabled
+#ifndef ZBOOT_WEAR_THRESHOLD
+#define ZBOOT_WEAR_THRESHOLD 1000
+#endif
+
+// Queue size for ZBOOT_WRITE_ASYNC; the work buffer is used instead if there is one
+#define ZBOOT_WRITE_QUEUE_SIZE 4096
+
+// Sectors written between copies of a resumable write's progress in the config log; it's
+//  saved in RTC memory at every sector
+#define ZBOOT_WRITE_PROGRESS_SECTORS 16
+
+typedef struct
+{
+   uint32_t length;            // Bytes written so far
+   uint16_t sectors_erased;
+   uint16_t sectors_skipped;   // Sectors left as they were with ZBOOT_WRITE_SKIP_UNCHANGED
+   uint32_t pages_skipped;     // Page programs left out, since their data was all 0xff
+   uint32_t queued;            // Bytes waiting to be written with ZBOOT_WRITE_ASYNC
+} zboot_write_info;
+
+// Result of zboot_write_end_verify()
+#define ZBOOT_VERIFY_OK            0
+#define ZBOOT_VERIFY_INCOMPLETE    1  // Data ended before the image's checksum
+#define ZBOOT_VERIFY_BAD_MAGIC     2  // Not a zboot image
+#define ZBOOT_VERIFY_BAD_HEADER    3  // Section count or entry point out of range
+#define ZBOOT_VERIFY_BAD_ADDRESS   4  // Linked for a different offset in the flash window
+#define ZBOOT_VERIFY_BAD_SECTION   5  // Section length isn't a multiple of 4
+#define ZBOOT_VERIFY_BAD_CHECKSUM  6
+#define ZBOOT_VERIFY_WRITE_FAILED  7  // Flash write failed, or the image overran its slot
+
+// One piece of a chained buffer, such as a network packet, for zboot_write_flashv()
+typedef struct
+{
+   const uint8_t *data;
+   uint32_t length;
+} zboot_segment;
+
+// Buffer for zboot_api_init_buffer(). Its first ZBOOT_API_SCRATCH_SIZE bytes are used
+//  within other operations: to copy the config records when the log is compacted (about
+//  2.3kB with the default MAX_ROMS and MAX_PARTITIONS), and to keep the unchanged start of
+//  a sector that a ZBOOT_WRITE_SKIP_UNCHANGED write erases (up to a sector). Applications
+//  that don't use ZBOOT_WRITE_SKIP_UNCHANGED can define a smaller ZBOOT_API_SCRATCH_SIZE.
+#ifndef ZBOOT_API_SCRATCH_SIZE
+#define ZBOOT_API_SCRATCH_SIZE 4096
+#endif
+#define ZBOOT_API_BUFFER_SIZE (ZBOOT_API_SCRATCH_SIZE + 2048)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void zboot_api_init(void);
+bool zboot_api_init_buffer(void *buffer, uint32_t size);
 
 bool zboot_set_coldboot_index(uint8_t index);
 bool zboot_set_temp_index(uint8_t index);
@@ -49,6 +164,12 @@ bool zboot_set_option(uint8_t option, bool enable);
 bool zboot_set_gpio_number(uint8_t index);
 bool zboot_erase_config(void);
 bool zboot_invalidate_index(uint8_t index);
+bool zboot_set_image_state(uint8_t index, uint32_t state);
+void zboot_invalidate_config_cache(void);
+
+bool zboot_begin_config_update(void);
+bool zboot_commit_config_update(void);
+void zboot_abort_config_update(void);
 
 bool zboot_get_image_address(uint8_t index, uint32_t *address);
 bool zboot_get_coldboot_index(uint8_t *index);
@@ -61,17 +182,47 @@ bool zboot_get_options(uint8_t *options);
 bool zboot_get_current_image_info(uint32_t *version, uint32_t *date,
   uint32_t *address, uint8_t *index, char *description, uint8_t maxDescriptionLength);
 bool zboot_find_best_write_index(uint8_t *index, bool overwriteOldest);
+bool zboot_find_best_write_index_ex(uint8_t *index, bool overwriteOldest, uint8_t exclude);
 bool zboot_get_image_count(uint8_t *count);
 bool zboot_get_image_info(uint8_t index, uint32_t *version, uint32_t *date,
    uint32_t *address, char *description, uint8_t maxDescriptionLength);
+bool zboot_get_image_length(uint8_t index, uint32_t *length, uint32_t *chksum);
+bool zboot_get_image_state(uint8_t index, uint32_t *state);
+bool zboot_check_image_address(uint8_t index, uint32_t address);
+bool zboot_verify_image(uint32_t address, uint32_t *length, uint32_t *chksum);
+bool zboot_read_flash(uint32_t address, void *buffer, uint32_t length);
+bool zboot_get_manifest(uint32_t address, uint32_t length, uint32_t unit, uint32_t *hashes);
+bool zboot_rebuild_catalog(void);
+
+bool zboot_get_partition_count(uint8_t type, uint8_t *count);
+bool zboot_find_partition(uint8_t type, uint8_t index, zboot_partition *partition);
+bool zboot_get_partition(uint8_t index, zboot_partition *partition);
+bool zboot_find_active_partition(uint8_t type, uint8_t *index, zboot_partition *partition);
+bool zboot_set_partitions(const zboot_partition *partitions, uint8_t count);
 
 bool zboot_get_flash_size(uint8_t *size);
+bool zboot_get_stats(zboot_stats *stats, bool reset);
+bool zboot_get_wear(uint32_t address, uint32_t *erases);
+bool zboot_get_image_wear(uint8_t index, uint32_t *cycles);
 bool zboot_get_flash_speed(uint8_t *speed);
 bool zboot_get_flash_mode(uint8_t *mode);
 
+bool zboot_erase_start(uint32_t address, uint32_t length);
+bool zboot_erase_poll(uint32_t budget_us, uint32_t *remaining);
+
 void *zboot_write_init(uint32_t start_addr);
+void *zboot_write_init_ex(uint32_t start_addr, uint32_t size, uint8_t options);
+void *zboot_write_resume(uint32_t start_addr, uint32_t size, uint8_t options, uint32_t image_id,
+   uint32_t *offset);
 bool zboot_write_end(void *context);
+bool zboot_write_end_verify(void *context, uint8_t *result);
+bool zboot_write_get_info(void *context, zboot_write_info *info);
+bool zboot_write_read(void *context, uint32_t offset, uint8_t *buffer, uint32_t length);
 bool zboot_write_flash(void *context, const uint8_t *data, const uint16_t len);
+bool zboot_write_flashv(void *context, const zboot_segment *segments, uint16_t count);
+bool zboot_write_copy(void *context, uint32_t source_addr, uint32_t length);
+bool zboot_write_poll(void *context, uint32_t budget_us);
+bool zboot_write_poll_all(uint32_t budget_us);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,355 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Bundle writing; see zboot-bundle.h, and zbundle_header in zboot.h for the format. Every
+ *  member's destination is worked out from the table before anything is written, so a
+ *  bundle that doesn't fit the partition table is rejected without touching flash. Members
+ *  are then written one after another, each checked against its CRC as it's received.
+ *  Nothing a bundle writes is in use until it's committed: application images go to slots
+ *  other than the running one, and data to partitions other than the active one of their
+ *  type, which the commit then makes active.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "zboot-api.h"
+#include "zboot-bundle.h"
+#include "zboot_util.h"
+
+#define ZBOOT_BUNDLE_HEADER  0
+#define ZBOOT_BUNDLE_TABLE   1
+#define ZBOOT_BUNDLE_MEMBER  2
+#define ZBOOT_BUNDLE_DONE    3
+#define ZBOOT_BUNDLE_ERROR   4
+
+#define ZBOOT_BUNDLE_NO_SLOT 0xff
+
+#define ZBOOT_BUNDLE_PADDED(length) (((length) + sizeof(uint32_t) - 1) & ~3)
+
+// True if a member other than 'skip' is already to be written at 'address'
+static bool zboot_bundle_taken(const zboot_bundle *bundle, uint8_t skip, uint32_t address)
+{
+   uint8_t idx;
+
+   for(idx = 0; idx < bundle->header.count; ++idx)
+      if(idx != skip && bundle->address[idx] == address)
+         return true;
+   return false;
+}
+
+// Choose a partition for a member with ZBUNDLE_INDEX_ANY: the best application slot, or the
+//  first spare partition of its type, that no other member has taken
+static bool zboot_bundle_choose(const zboot_bundle *bundle, uint8_t member, uint8_t *index)
+{
+   zboot_partition partition;
+   uint8_t type = bundle->table[member].type;
+   uint8_t active, idx, exclude = 0;
+
+   if(type == ZBOOT_PARTITION_APP)
+   {
+      for(idx = 0; idx < bundle->header.count; ++idx)
+         if(bundle->slot[idx] != ZBOOT_BUNDLE_NO_SLOT)
+            exclude |= 1 << bundle->slot[idx];
+      return zboot_find_best_write_index_ex(index, true, exclude);
+   }
+
+   if(!zboot_find_active_partition(type, &active, NULL))
+      return false;
+   for(idx = 0; zboot_find_partition(type, idx, &partition); ++idx)
+   {
+      if(idx != active && !zboot_bundle_taken(bundle, member, partition.address))
+      {
+         *index = idx;
+         return true;
+      }
+   }
+   return false;
+}
+
+// Find where each member is to be written: those with a given index first, then those
+//  left to the device. Application images can't go to the running slot, data can't go to
+//  the active partition of its type, and no two members can share a partition.
+static bool zboot_bundle_targets(zboot_bundle *bundle)
+{
+   zboot_partition partition;
+   uint8_t running = ZBOOT_BUNDLE_NO_SLOT;
+   uint8_t index, active, idx, pass;
+
+   zboot_get_current_boot_index(&running);
+   for(pass = 0; pass < 2; ++pass)
+   {
+      for(idx = 0; idx < bundle->header.count; ++idx)
+      {
+         const zbundle_member *member = &bundle->table[idx];
+
+         index = member->index;
+         if((index == ZBUNDLE_INDEX_ANY) != (pass > 0))
+            continue;
+         if(index == ZBUNDLE_INDEX_ANY && !zboot_bundle_choose(bundle, idx, &index))
+            return false;
+         if(!zboot_find_partition(member->type, index, &partition)
+         || 0 == member->length || member->length > partition.size
+         || ((member->flags & ZBUNDLE_FLAG_BOOT) && member->type != ZBOOT_PARTITION_APP)
+         || zboot_bundle_taken(bundle, idx, partition.address))
+            return false;
+         if(member->type == ZBOOT_PARTITION_APP)
+         {
+            if(index == running)
+               return false;
+            bundle->slot[idx] = index;
+         }
+         else if(!zboot_find_active_partition(member->type, &active, NULL) || index == active)
+            return false;
+         bundle->address[idx] = partition.address;
+      }
+   }
+   return true;
+}
+
+// Flag the data partitions the bundle wrote as the active ones of their types, in 'table'.
+//  Returns false if the bundle has no data members, so there's nothing to change.
+static bool zboot_bundle_activate(const zboot_bundle *bundle, zboot_partition *table,
+   uint8_t count)
+{
+   uint8_t idx, entry;
+   bool changed = false;
+
+   for(idx = 0; idx < bundle->header.count; ++idx)
+   {
+      if(bundle->slot[idx] != ZBOOT_BUNDLE_NO_SLOT)
+         continue;
+      for(entry = 0; entry < count; ++entry)
+      {
+         if(table[entry].type != bundle->table[idx].type)
+            continue;
+         if(table[entry].address == bundle->address[idx])
+            table[entry].flags |= ZBOOT_PARTITION_FLAG_ACTIVE;
+         else
+            table[entry].flags &= ~ZBOOT_PARTITION_FLAG_ACTIVE;
+         changed = true;
+      }
+   }
+   return changed;
+}
+
+// Start writing the next member, if there is one
+static bool zboot_bundle_next(zboot_bundle *bundle)
+{
+   const zbundle_member *member;
+
+   if(bundle->member == bundle->header.count)
+   {
+      bundle->state = ZBOOT_BUNDLE_DONE;
+      return true;
+   }
+
+   member = &bundle->table[bundle->member];
+   bundle->context = zboot_write_init_ex(bundle->address[bundle->member], member->length,
+      bundle->options);
+   if(NULL == bundle->context)
+      return false;
+   ++bundle->started;
+   bundle->left = ZBOOT_BUNDLE_PADDED(member->length);
+   bundle->crc = 0;
+   bundle->state = ZBOOT_BUNDLE_MEMBER;
+   return true;
+}
+
+// Complete the current member's write. Application images must also pass the bootloader's
+//  checks.
+static bool zboot_bundle_close(zboot_bundle *bundle)
+{
+   const zbundle_member *member = &bundle->table[bundle->member];
+   void *context = bundle->context;
+   uint8_t result;
+
+   bundle->context = NULL;
+   if(bundle->crc != member->crc)
+   {
+      zboot_write_end(context);
+      return false;
+   }
+   if(bundle->slot[bundle->member] != ZBOOT_BUNDLE_NO_SLOT)
+      return zboot_write_end_verify(context, &result);
+   return zboot_write_end(context);
+}
+
+// Returns false if the bundle is invalid, doesn't fit, or a write failed
+static bool zboot_bundle_run(zboot_bundle *bundle, const uint8_t *data, uint32_t length)
+{
+   const zbundle_member *member;
+   uint32_t piece, padding, used;
+
+   while(length > 0)
+   {
+      switch(bundle->state)
+      {
+         case ZBOOT_BUNDLE_HEADER:
+            piece = sizeof(bundle->header) - bundle->count;
+            if(piece > length)
+               piece = length;
+            memcpy((uint8_t *) &bundle->header + bundle->count, data, piece);
+            bundle->count += piece;
+            data += piece;
+            length -= piece;
+            if(bundle->count < sizeof(bundle->header))
+               break;
+            if(bundle->header.magic != ZBUNDLE_MAGIC || 0 == bundle->header.count
+            || bundle->header.count > ZBUNDLE_MAX_MEMBERS)
+               return false;
+            bundle->count = 0;
+            bundle->state = ZBOOT_BUNDLE_TABLE;
+            break;
+
+         case ZBOOT_BUNDLE_TABLE:
+            piece = bundle->header.count * sizeof(zbundle_member) - bundle->count;
+            if(piece > length)
+               piece = length;
+            memcpy((uint8_t *) bundle->table + bundle->count, data, piece);
+            bundle->count += piece;
+            data += piece;
+            length -= piece;
+            if(bundle->count < bundle->header.count * sizeof(zbundle_member))
+               break;
+            if(zboot_crc32(0, bundle->table, bundle->count) != bundle->header.crc
+            || !zboot_bundle_targets(bundle))
+               return false;
+            bundle->member = 0;
+            if(!zboot_bundle_next(bundle))
+               return false;
+            break;
+
+         case ZBOOT_BUNDLE_MEMBER:
+            member = &bundle->table[bundle->member];
+            piece = (bundle->left < length) ? bundle->left : length;
+
+            // The padding after the data is neither written nor checked
+            padding = ZBOOT_BUNDLE_PADDED(member->length) - member->length;
+            used = (bundle->left > padding) ? bundle->left - padding : 0;
+            if(used > piece)
+               used = piece;
+            if(used > 0)
+            {
+               zboot_segment segment;
+
+               segment.data = data;
+               segment.length = used;
+               bundle->crc = zboot_crc32(bundle->crc, data, used);
+               if(!zboot_write_flashv(bundle->context, &segment, 1))
+                  return false;
+            }
+            data += piece;
+            length -= piece;
+            bundle->left -= piece;
+            if(bundle->left > 0)
+               break;
+            if(!zboot_bundle_close(bundle))
+               return false;
+            ++bundle->member;
+            if(!zboot_bundle_next(bundle))
+               return false;
+            break;
+
+         default:
+            return true;  // Anything after the last member is ignored
+      }
+   }
+   return true;
+}
+
+// Undo a bundle that wasn't completed. Nothing it wrote was in use, but so that nothing
+//  half-written is used later, the application slots it wrote are invalidated, and the
+//  first sector of each spare data partition it wrote is erased.
+static void zboot_bundle_discard(zboot_bundle *bundle)
+{
+   uint32_t remaining;
+   uint8_t idx;
+
+   if(NULL != bundle->context)
+      zboot_write_end(bundle->context);
+   bundle->context = NULL;
+   for(idx = 0; idx < bundle->started; ++idx)
+   {
+      if(bundle->slot[idx] != ZBOOT_BUNDLE_NO_SLOT)
+         zboot_invalidate_index(bundle->slot[idx]);
+      else if(zboot_erase_start(bundle->address[idx], SECTOR_SIZE))
+      {
+         while(zboot_erase_poll(0xffffffff, &remaining) && remaining > 0)
+            ;
+      }
+   }
+}
+
+// Start receiving a bundle; 'options' are the ZBOOT_WRITE_* options used to write each
+//  member. Nothing is written until the member table has been received and checked.
+bool zboot_bundle_init(zboot_bundle *bundle, uint8_t options)
+{
+   memset(bundle, 0, sizeof(*bundle));
+   memset(bundle->slot, ZBOOT_BUNDLE_NO_SLOT, sizeof(bundle->slot));
+   bundle->options = options;
+   bundle->state = ZBOOT_BUNDLE_HEADER;
+   return true;
+}
+
+// Write the next piece of the bundle. Returns false if the bundle is invalid or a write
+//  failed, after which nothing more is written; zboot_bundle_end() then undoes it.
+bool zboot_bundle_write(zboot_bundle *bundle, const uint8_t *data, uint32_t length)
+{
+   if(bundle->state == ZBOOT_BUNDLE_ERROR)
+      return false;
+
+   bundle->bytes_in += length;
+   if(!zboot_bundle_run(bundle, data, length))
+      bundle->state = ZBOOT_BUNDLE_ERROR;
+   return bundle->state != ZBOOT_BUNDLE_ERROR;
+}
+
+// Commit the bundle if every member was received and checked: its application images are
+//  marked verified, the one flagged ZBUNDLE_FLAG_BOOT becomes the image booted, and its data
+//  partitions become the active ones of their types. The boot image is changed by a config
+//  update that's only committed once the partition table has been written, and the table
+//  is put back if the update fails. Any other outcome discards everything the bundle wrote,
+//  and returns false.
+bool zboot_bundle_end(zboot_bundle *bundle)
+{
+   zboot_partition table[MAX_PARTITIONS];
+   uint16_t flags[MAX_PARTITIONS];
+   uint8_t count = 0;
+   bool result = (bundle->state == ZBOOT_BUNDLE_DONE) && zboot_begin_config_update();
+   bool update = result;
+   bool activated = false;
+   uint8_t idx;
+
+   for(idx = 0; result && idx < bundle->header.count; ++idx)
+   {
+      if(bundle->slot[idx] == ZBOOT_BUNDLE_NO_SLOT)
+         continue;
+      result = zboot_set_image_state(bundle->slot[idx], ZIMAGE_STATE_VERIFIED)
+         && (!(bundle->table[idx].flags & ZBUNDLE_FLAG_BOOT)
+            || zboot_set_coldboot_index(bundle->slot[idx]));
+   }
+   if(result)
+   {
+      for(count = 0; count < MAX_PARTITIONS && zboot_get_partition(count, &table[count]); ++count)
+         flags[count] = table[count].flags;
+      if(zboot_bundle_activate(bundle, table, count))
+         result = activated = zboot_set_partitions(table, count);
+   }
+
+   if(result)
+      result = zboot_commit_config_update();
+   else if(update)
+      zboot_abort_config_update();
+   if(!result && activated)
+   {
+      for(idx = 0; idx < count; ++idx)
+         table[idx].flags = flags[idx];
+      zboot_set_partitions(table, count);
+   }
+   if(!result)
+      zboot_bundle_discard(bundle);
+   bundle->state = ZBOOT_BUNDLE_ERROR;
+   return result;
+}
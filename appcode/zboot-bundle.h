@@ -0,0 +1,45 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Writes a bundle made by tools/zbundle as it's received: each member goes to its own slot
+ *  or partition through a zboot-api write context, and the bundle is committed only if
+ *  every member arrived intact.
+ */
+#ifndef ZBOOT_BUNDLE_H
+#define ZBOOT_BUNDLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "zboot.h"
+
+typedef struct
+{
+   uint8_t state;
+   uint8_t options;          // ZBOOT_WRITE_* for each member's write
+   uint8_t member;           // Member being received
+   uint8_t started;          // Members whose writes have begun
+   uint8_t slot[ZBUNDLE_MAX_MEMBERS];        // Application slot of each member, if it has one
+   uint32_t address[ZBUNDLE_MAX_MEMBERS];    // Where each member is written
+   void *context;            // Write context for the current member
+   uint32_t count;           // Header or table bytes read
+   uint32_t left;            // Bytes left in the current member, including its padding
+   uint32_t crc;             // Of the current member so far
+   uint32_t bytes_in;
+   zbundle_header header;
+   zbundle_member table[ZBUNDLE_MAX_MEMBERS];
+} zboot_bundle;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool zboot_bundle_init(zboot_bundle *bundle, uint8_t options);
+bool zboot_bundle_write(zboot_bundle *bundle, const uint8_t *data, uint32_t length);
+bool zboot_bundle_end(zboot_bundle *bundle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZBOOT_BUNDLE_H */
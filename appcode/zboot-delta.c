@@ -0,0 +1,187 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Delta patch application; see zboot-delta.h, and zdelta_header in zboot.h for the format.
+ *  Input can be split anywhere. Data in the patch is written straight from the input, and
+ *  copies from the source image go through a small buffer, so memory use is fixed.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "zboot-api.h"
+#include "zboot-delta.h"
+#include "zboot.h"
+
+#define ZBOOT_DELTA_HEADER  0
+#define ZBOOT_DELTA_OPCODE  1
+#define ZBOOT_DELTA_LENGTH  2
+#define ZBOOT_DELTA_OFFSET  3
+#define ZBOOT_DELTA_DATA    4
+#define ZBOOT_DELTA_DONE    5
+#define ZBOOT_DELTA_ERROR   6
+
+// Write output, adding it to the checksum of the words of the file being built
+static bool zboot_delta_output(zboot_delta *delta, const uint8_t *data, uint32_t length)
+{
+   zboot_segment segment;
+   uint32_t pos;
+
+   for(pos = 0; pos < length; ++pos)
+      delta->chksum += (uint32_t) data[pos] << (8 * ((delta->bytes_out + pos) % sizeof(uint32_t)));
+   delta->bytes_out += length;
+
+   segment.data = data;
+   segment.length = length;
+   return zboot_write_flashv(delta->context, &segment, 1);
+}
+
+// Copy from the source image. The state word is excluded, since it's changed as the image
+//  is booted.
+static bool zboot_delta_copy(zboot_delta *delta)
+{
+   const uint32_t stateOffset = ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t);
+   uint32_t piece;
+
+   if(delta->offset > delta->source_length || delta->length > delta->source_length - delta->offset
+   || (delta->offset < stateOffset + sizeof(uint32_t) && delta->offset + delta->length > stateOffset))
+      return false;
+
+   delta->bytes_copied += delta->length;
+   for(; delta->length > 0; delta->length -= piece)
+   {
+      piece = (delta->length > sizeof(delta->buffer)) ? sizeof(delta->buffer) : delta->length;
+      if(!zboot_read_flash(delta->source_addr + delta->offset, delta->buffer, piece)
+      || !zboot_delta_output(delta, (const uint8_t *) delta->buffer, piece))
+         return false;
+      delta->offset += piece;
+   }
+   return true;
+}
+
+// Returns false if the patch is invalid, or doesn't apply to the source image
+static bool zboot_delta_run(zboot_delta *delta, const uint8_t *data, uint32_t length)
+{
+   const zdelta_header *header = (const zdelta_header *) delta->header;
+   uint32_t piece;
+   uint8_t byte;
+
+   while(length > 0)
+   {
+      switch(delta->state)
+      {
+         case ZBOOT_DELTA_HEADER:
+            piece = sizeof(delta->header) - delta->count;
+            if(piece > length)
+               piece = length;
+            memcpy((uint8_t *) delta->header + delta->count, data, piece);
+            delta->count += piece;
+            data += piece;
+            length -= piece;
+            if(delta->count < sizeof(delta->header))
+               break;
+            if(header->magic != ZDELTA_MAGIC || header->source_length != delta->source_length
+            || header->source_chksum != delta->source_chksum)
+               return false;
+            delta->state = ZBOOT_DELTA_OPCODE;
+            break;
+
+         case ZBOOT_DELTA_OPCODE:
+            delta->opcode = *data++;
+            --length;
+            delta->value = 0;
+            delta->shift = 0;
+            if(delta->opcode == ZDELTA_END)
+               delta->state = ZBOOT_DELTA_DONE;
+            else if(delta->opcode == ZDELTA_COPY || delta->opcode == ZDELTA_DATA)
+               delta->state = ZBOOT_DELTA_LENGTH;
+            else
+               return false;
+            break;
+
+         case ZBOOT_DELTA_LENGTH:
+         case ZBOOT_DELTA_OFFSET:
+            byte = *data++;
+            --length;
+            if(delta->shift > 28)
+               return false;
+            delta->value |= (uint32_t) (byte & 0x7f) << delta->shift;
+            delta->shift += 7;
+            if(byte & 0x80)
+               break;
+
+            if(delta->state == ZBOOT_DELTA_LENGTH)
+            {
+               delta->length = delta->value;
+               if(delta->length > header->target_length - delta->bytes_out)
+                  return false;
+               delta->value = 0;
+               delta->shift = 0;
+               delta->state = (delta->opcode == ZDELTA_COPY) ? ZBOOT_DELTA_OFFSET : ZBOOT_DELTA_DATA;
+               break;
+            }
+            delta->offset += (delta->value >> 1) ^ -(delta->value & 1);
+            if(!zboot_delta_copy(delta))
+               return false;
+            delta->state = ZBOOT_DELTA_OPCODE;
+            break;
+
+         case ZBOOT_DELTA_DATA:
+            piece = (delta->length < length) ? delta->length : length;
+            if(!zboot_delta_output(delta, data, piece))
+               return false;
+            data += piece;
+            length -= piece;
+            delta->length -= piece;
+            if(0 == delta->length)
+               delta->state = ZBOOT_DELTA_OPCODE;
+            break;
+
+         default:
+            return true;  // Anything after the end of the patch is ignored
+      }
+   }
+   return true;
+}
+
+// Start applying a patch to the image at 'source_addr', or to the running image if it's 0,
+//  writing the result to a write context for another slot. The source image is checked
+//  first, and the patch only applies to the image it was made from.
+bool zboot_delta_init(zboot_delta *delta, void *context, uint32_t source_addr)
+{
+   memset(delta, 0, sizeof(*delta) - sizeof(delta->buffer));
+   delta->state = ZBOOT_DELTA_ERROR;
+   if(NULL == context
+   || (0 == source_addr && !zboot_get_current_image_info(NULL, NULL, &source_addr, NULL, NULL, 0))
+   || !zboot_verify_image(source_addr, &delta->source_length, &delta->source_chksum))
+      return false;
+
+   delta->context = context;
+   delta->source_addr = source_addr;
+   delta->state = ZBOOT_DELTA_HEADER;
+   return true;
+}
+
+// Apply the next piece of the patch. Returns false if the patch is invalid or a write
+//  failed, after which nothing more is written.
+bool zboot_delta_write(zboot_delta *delta, const uint8_t *data, uint32_t length)
+{
+   if(delta->state == ZBOOT_DELTA_ERROR)
+      return false;
+
+   delta->bytes_in += length;
+   if(!zboot_delta_run(delta, data, length))
+      delta->state = ZBOOT_DELTA_ERROR;
+   return delta->state != ZBOOT_DELTA_ERROR;
+}
+
+// Returns true if the whole patch was applied, and the result matches the checksum in its
+//  header. The write context is then ended as usual.
+bool zboot_delta_end(zboot_delta *delta)
+{
+   const zdelta_header *header = (const zdelta_header *) delta->header;
+
+   return delta->state == ZBOOT_DELTA_DONE && delta->bytes_out == header->target_length
+      && delta->chksum == header->target_chksum;
+}
@@ -0,0 +1,50 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Applies a delta patch made by tools/zdelta as it's received, building the new image from
+ *  the running one and writing it through a zboot-api write context.
+ */
+#ifndef ZBOOT_DELTA_H
+#define ZBOOT_DELTA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Source image data copied per write
+#define ZBOOT_DELTA_BUFFER 512
+
+typedef struct
+{
+   void *context;            // From zboot_write_init()
+   uint32_t source_addr;     // Image the patch is applied to
+   uint32_t source_length;
+   uint32_t source_chksum;
+   uint8_t state;
+   uint8_t opcode;           // ZDELTA_*
+   uint8_t shift;            // Of the next 7 bits of the value being read
+   uint32_t value;
+   uint32_t count;           // Header bytes read
+   uint32_t header[5];       // zdelta_header
+   uint32_t length;          // Bytes left in the current command
+   uint32_t offset;          // Source offset of the next byte copied
+   uint32_t bytes_in;
+   uint32_t bytes_out;
+   uint32_t bytes_copied;    // Output copied from the source image
+   uint32_t chksum;          // Sum of the output's words
+   uint32_t buffer[ZBOOT_DELTA_BUFFER / sizeof(uint32_t)];
+} zboot_delta;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool zboot_delta_init(zboot_delta *delta, void *context, uint32_t source_addr);
+bool zboot_delta_write(zboot_delta *delta, const uint8_t *data, uint32_t length);
+bool zboot_delta_end(zboot_delta *delta);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZBOOT_DELTA_H */
@@ -0,0 +1,700 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Streaming decompression of images; see zboot-inflate.h. Input can be split anywhere, so
+ *  the decoder is a state machine, and each state only consumes its input once it has all
+ *  it needs. Huffman codes are decoded a bit at a time, as in zlib's puff.c, which needs no
+ *  lookup tables.
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "zboot-api.h"
+#include "zboot-inflate.h"
+#include "zboot_util.h"
+
+#define ZBOOT_INF_HEADER          0   // Format header
+#define ZBOOT_INF_GZIP_FLAGS      1   // Optional gzip header fields
+#define ZBOOT_INF_GZIP_EXTRA      2
+#define ZBOOT_INF_GZIP_STRING     3   // File name or comment
+#define ZBOOT_INF_BLOCK           4   // Deflate block header
+#define ZBOOT_INF_STORED          5
+#define ZBOOT_INF_STORED_CHECK    6   // Stored block length and its complement
+#define ZBOOT_INF_STORED_COPY     7
+#define ZBOOT_INF_TABLE           8   // Dynamic block code counts
+#define ZBOOT_INF_TABLE_CODES     9   // Code lengths of the code length code
+#define ZBOOT_INF_TABLE_LENGTHS  10   // Literal/length and distance code lengths
+#define ZBOOT_INF_CODES          11   // Literal or match length
+#define ZBOOT_INF_DIST           12
+#define ZBOOT_INF_DIST_EXTRA     13
+#define ZBOOT_INF_CHECK          14   // CRC-32 or Adler-32 in the trailer
+#define ZBOOT_INF_SIZE           15   // Uncompressed size in the gzip trailer
+#define ZBOOT_INF_LZ4_BLOCK      16
+#define ZBOOT_INF_LZ4_SIZE       17
+#define ZBOOT_INF_LZ4_RAW        18   // Uncompressed block
+#define ZBOOT_INF_LZ4_TOKEN      19
+#define ZBOOT_INF_LZ4_LITLEN     20
+#define ZBOOT_INF_LZ4_LITERALS   21
+#define ZBOOT_INF_LZ4_OFFSET     22
+#define ZBOOT_INF_LZ4_MATCHLEN   23
+#define ZBOOT_INF_LZ4_BLOCK_END  24
+#define ZBOOT_INF_COPY           25   // Match
+#define ZBOOT_INF_SKIP           26   // Skip 'count' bytes
+#define ZBOOT_INF_WORD           27   // Read a little-endian word into 'value'
+#define ZBOOT_INF_DONE           28
+#define ZBOOT_INF_ERROR          29
+
+#define ZBOOT_INF_MORE    -1  // Ran out of input while decoding a symbol
+#define ZBOOT_INF_INVALID -2
+
+#define ZBOOT_GZIP_FHCRC    0x02
+#define ZBOOT_GZIP_FEXTRA   0x04
+#define ZBOOT_GZIP_FNAME    0x08
+#define ZBOOT_GZIP_FCOMMENT 0x10
+
+#define ZBOOT_LZ4_MAGIC          0x184d2204
+#define ZBOOT_LZ4_CONTENT_CHKSUM 0x04
+#define ZBOOT_LZ4_CONTENT_SIZE   0x08
+#define ZBOOT_LZ4_BLOCK_CHKSUM   0x10
+
+static const uint16_t g_length_base[29] = {
+   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+   35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t g_length_extra[29] = {
+   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t g_dist_base[30] = {
+   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+   257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t g_dist_extra[30] = {
+   0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t g_code_order[19] = {
+   16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Take 'count' bits, up to 25, from the input. Returns false, taking nothing, if there
+//  aren't that many yet.
+static bool zboot_inflate_bits(zboot_inflate *z, uint8_t count, uint32_t *value)
+{
+   while(z->bitcount <= 24 && z->input_left > 0)
+   {
+      z->bitbuf |= (uint32_t) *z->input++ << z->bitcount;
+      z->bitcount += 8;
+      --z->input_left;
+   }
+   if(z->bitcount < count)
+      return false;
+   *value = z->bitbuf & ((1UL << count) - 1);
+   z->bitbuf >>= count;
+   z->bitcount -= count;
+   return true;
+}
+
+// Decode a Huffman-coded symbol without taking its bits, setting 'length' to the number
+//  there are to take
+static int zboot_inflate_decode(zboot_inflate *z, const uint16_t *count, const uint16_t *symbol,
+   uint8_t *length)
+{
+   int code = 0, first = 0, index = 0;
+   uint32_t unused;
+   uint8_t len;
+
+   zboot_inflate_bits(z, 0, &unused);
+   for(len = 1; len < 16; ++len)
+   {
+      if(len > z->bitcount)
+         return ZBOOT_INF_MORE;
+      code |= (z->bitbuf >> (len - 1)) & 1;
+      if(code - (int) count[len] < first)
+      {
+         *length = len;
+         return symbol[index + (code - first)];
+      }
+      index += count[len];
+      first = (first + count[len]) << 1;
+      code <<= 1;
+   }
+   return ZBOOT_INF_INVALID;
+}
+
+// Build a canonical Huffman code from the code length of each symbol. Returns false if the
+//  lengths describe too many codes; too few is allowed.
+static bool zboot_inflate_build(uint16_t *count, uint16_t *symbol, const uint8_t *lengths,
+   uint16_t symbols)
+{
+   uint16_t offset[16];
+   int32_t left = 1;
+   uint16_t len, sym;
+
+   memset(count, 0, 16 * sizeof(uint16_t));
+   for(sym = 0; sym < symbols; ++sym)
+      ++count[lengths[sym]];
+   for(len = 1; len < 16; ++len)
+   {
+      left = (left << 1) - count[len];
+      if(left < 0)
+         return false;
+   }
+
+   offset[1] = 0;
+   for(len = 1; len < 15; ++len)
+      offset[len + 1] = offset[len] + count[len];
+   for(sym = 0; sym < symbols; ++sym)
+      if(lengths[sym] != 0)
+         symbol[offset[lengths[sym]]++] = sym;
+   return true;
+}
+
+static void zboot_inflate_fixed(zboot_inflate *z)
+{
+   memset(z->lengths, 8, 144);
+   memset(z->lengths + 144, 9, 112);
+   memset(z->lengths + 256, 7, 24);
+   memset(z->lengths + 280, 8, 8);
+   zboot_inflate_build(z->len_count, z->len_symbol, z->lengths, 288);
+   memset(z->lengths, 5, 30);
+   zboot_inflate_build(z->dist_count, z->dist_symbol, z->lengths, 30);
+}
+
+// Pass the output waiting to the write context, updating the check value as it goes
+static bool zboot_inflate_flush(zboot_inflate *z)
+{
+   zboot_segment segment;
+   uint32_t pos;
+
+   // The window is flushed each time it fills, so the output waiting doesn't wrap around
+   segment.data = z->window + (z->flushed % ZBOOT_INFLATE_WINDOW);
+   segment.length = z->bytes_out - z->flushed;
+   if(z->format == ZBOOT_INFLATE_GZIP)
+      z->check = zboot_crc32(z->check, segment.data, segment.length);
+   else if(z->format == ZBOOT_INFLATE_ZLIB)
+   {
+      for(pos = 0; pos < segment.length; ++pos)
+      {
+         uint32_t a = ((z->check & 0xffff) + segment.data[pos]) % 65521;
+         z->check = ((((z->check >> 16) + a) % 65521) << 16) | a;
+      }
+   }
+
+   if(segment.length > 0 && !zboot_write_flashv(z->context, &segment, 1))
+      return false;
+   z->flushed = z->bytes_out;
+   return true;
+}
+
+static bool zboot_inflate_put(zboot_inflate *z, uint8_t byte)
+{
+   z->window[z->bytes_out % ZBOOT_INFLATE_WINDOW] = byte;
+   ++z->bytes_out;
+   return z->bytes_out - z->flushed < ZBOOT_INFLATE_WINDOW || zboot_inflate_flush(z);
+}
+
+// Output 'length' bytes from 'distance' bytes back. Recent output is still in the window;
+//  anything older is read back from flash.
+static bool zboot_inflate_copy(zboot_inflate *z)
+{
+   uint32_t chunk[16];
+   uint8_t *bytes = (uint8_t *) chunk;
+   uint32_t pos, piece, idx;
+
+   if(0 == z->distance || z->distance > z->bytes_out)
+      return false;
+
+   while(z->length > 0)
+   {
+      if(z->distance <= ZBOOT_INFLATE_WINDOW)
+      {
+         if(!zboot_inflate_put(z, z->window[(z->bytes_out - z->distance) % ZBOOT_INFLATE_WINDOW]))
+            return false;
+         --z->length;
+         continue;
+      }
+
+      pos = z->bytes_out - z->distance;
+      piece = (z->length < sizeof(chunk)) ? z->length : sizeof(chunk);
+      idx = (pos < z->flushed) ? z->flushed - pos : 0;
+      if(idx > piece)
+         idx = piece;
+      if(idx > 0 && !zboot_write_read(z->context, z->base + pos, bytes, idx))
+         return false;
+      for(; idx < piece; ++idx)
+         bytes[idx] = z->window[(pos + idx) % ZBOOT_INFLATE_WINDOW];
+
+      for(idx = 0; idx < piece; ++idx)
+         if(!zboot_inflate_put(z, bytes[idx]))
+            return false;
+      z->length -= piece;
+   }
+   return true;
+}
+
+static void zboot_inflate_skip(zboot_inflate *z, uint32_t count, uint8_t next)
+{
+   z->count = count;
+   z->next = next;
+   z->state = ZBOOT_INF_SKIP;
+}
+
+static void zboot_inflate_word(zboot_inflate *z, uint8_t next)
+{
+   z->count = 0;
+   z->value = 0;
+   z->next = next;
+   z->state = ZBOOT_INF_WORD;
+}
+
+// Move on from the end of a deflate block, flushing the output after the last one so that
+//  its check value is complete
+static bool zboot_inflate_block_end(zboot_inflate *z)
+{
+   uint32_t unused;
+
+   if(!z->last)
+   {
+      z->state = ZBOOT_INF_BLOCK;
+      return true;
+   }
+   zboot_inflate_bits(z, z->bitcount % 8, &unused);
+   if(!zboot_inflate_flush(z))
+      return false;
+   if(z->format == ZBOOT_INFLATE_DEFLATE)
+      z->state = ZBOOT_INF_DONE;
+   else
+      zboot_inflate_word(z, ZBOOT_INF_CHECK);
+   return true;
+}
+
+static bool zboot_inflate_header(zboot_inflate *z)
+{
+   switch(z->format)
+   {
+      case ZBOOT_INFLATE_GZIP:  // ID1, ID2, CM (deflate), FLG
+         z->flags = z->value >> 24;
+         z->state = ZBOOT_INF_GZIP_FLAGS;
+         return (z->value & 0xffffff) == 0x088b1f && (z->flags & 0xe0) == 0;
+      case ZBOOT_INFLATE_ZLIB:  // CMF, FLG
+         z->state = ZBOOT_INF_BLOCK;
+         return (z->value & 0x0f) == 8 && (z->value & 0x2000) == 0
+            && ((((z->value & 0xff) << 8) | (z->value >> 8)) % 31) == 0;
+      case ZBOOT_INFLATE_LZ4:  // Magic, FLG; BD doesn't matter, since blocks aren't buffered
+         zboot_inflate_skip(z, ((z->flags & ZBOOT_LZ4_CONTENT_SIZE) ? 8 : 0) + 1, ZBOOT_INF_LZ4_BLOCK);
+         return z->value == ZBOOT_LZ4_MAGIC && (z->flags & 0xc3) == 0x40;  // No dictionary
+      default:
+         z->state = ZBOOT_INF_BLOCK;
+         return true;
+   }
+}
+
+// Decode the input available. Returns false if the data is invalid or can't be written.
+static bool zboot_inflate_run(zboot_inflate *z)
+{
+   static const uint8_t headerSize[] = {10, 2, 0, 6};
+   uint32_t value;
+   uint32_t repeat;
+   int sym;
+   uint8_t len;
+
+   for(;;)
+   {
+      switch(z->state)
+      {
+         case ZBOOT_INF_HEADER:
+            for(; z->count < headerSize[z->format]; ++z->count)
+            {
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+               if(z->count < sizeof(uint32_t))
+                  z->value |= value << (8 * z->count);
+               else if(z->count == sizeof(uint32_t))
+                  z->flags = value;
+            }
+            if(!zboot_inflate_header(z))
+               return false;
+            break;
+
+         case ZBOOT_INF_GZIP_FLAGS:  // Each optional field present is skipped in turn
+            if(z->flags & ZBOOT_GZIP_FEXTRA)
+            {
+               z->flags &= ~ZBOOT_GZIP_FEXTRA;
+               z->state = ZBOOT_INF_GZIP_EXTRA;
+            }
+            else if(z->flags & (ZBOOT_GZIP_FNAME | ZBOOT_GZIP_FCOMMENT))
+            {
+               z->flags &= ~((z->flags & ZBOOT_GZIP_FNAME) ? ZBOOT_GZIP_FNAME : ZBOOT_GZIP_FCOMMENT);
+               z->state = ZBOOT_INF_GZIP_STRING;
+            }
+            else if(z->flags & ZBOOT_GZIP_FHCRC)
+            {
+               z->flags &= ~ZBOOT_GZIP_FHCRC;
+               zboot_inflate_skip(z, 2, ZBOOT_INF_GZIP_FLAGS);
+            }
+            else
+               z->state = ZBOOT_INF_BLOCK;
+            break;
+
+         case ZBOOT_INF_GZIP_EXTRA:
+            if(!zboot_inflate_bits(z, 16, &value))
+               return true;
+            zboot_inflate_skip(z, value, ZBOOT_INF_GZIP_FLAGS);
+            break;
+
+         case ZBOOT_INF_GZIP_STRING:
+            do
+            {
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+            } while(value != 0);
+            z->state = ZBOOT_INF_GZIP_FLAGS;
+            break;
+
+         case ZBOOT_INF_BLOCK:
+            if(!zboot_inflate_bits(z, 3, &value))
+               return true;
+            z->last = (value & 1) != 0;
+            if(0 == (value >> 1))
+               z->state = ZBOOT_INF_STORED;
+            else if(1 == (value >> 1))
+            {
+               zboot_inflate_fixed(z);
+               z->state = ZBOOT_INF_CODES;
+            }
+            else if(2 == (value >> 1))
+               z->state = ZBOOT_INF_TABLE;
+            else
+               return false;
+            break;
+
+         case ZBOOT_INF_STORED:
+            zboot_inflate_bits(z, z->bitcount % 8, &value);  // To a byte boundary
+            zboot_inflate_word(z, ZBOOT_INF_STORED_CHECK);
+            break;
+
+         case ZBOOT_INF_STORED_CHECK:
+            if((z->value & 0xffff) != (~z->value >> 16))
+               return false;
+            z->length = z->value & 0xffff;
+            z->state = ZBOOT_INF_STORED_COPY;
+            break;
+
+         case ZBOOT_INF_STORED_COPY:
+            for(; z->length > 0; --z->length)
+            {
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+               if(!zboot_inflate_put(z, value))
+                  return false;
+            }
+            if(!zboot_inflate_block_end(z))
+               return false;
+            break;
+
+         case ZBOOT_INF_TABLE:
+            if(!zboot_inflate_bits(z, 14, &value))
+               return true;
+            z->codes[0] = (value & 0x1f) + 257;
+            z->codes[1] = ((value >> 5) & 0x1f) + 1;
+            z->codes[2] = (value >> 10) + 4;
+            if(z->codes[0] > 286 || z->codes[1] > 30)
+               return false;
+            memset(z->lengths, 0, sizeof(g_code_order));
+            z->count = 0;
+            z->state = ZBOOT_INF_TABLE_CODES;
+            break;
+
+         case ZBOOT_INF_TABLE_CODES:
+            for(; z->count < z->codes[2]; ++z->count)
+            {
+               if(!zboot_inflate_bits(z, 3, &value))
+                  return true;
+               z->lengths[g_code_order[z->count]] = value;
+            }
+            // The code length code is kept in the distance code's tables until it's built
+            if(!zboot_inflate_build(z->dist_count, z->dist_symbol, z->lengths, sizeof(g_code_order)))
+               return false;
+            z->count = 0;
+            z->state = ZBOOT_INF_TABLE_LENGTHS;
+            break;
+
+         case ZBOOT_INF_TABLE_LENGTHS:
+            while(z->count < z->codes[0] + z->codes[1])
+            {
+               sym = zboot_inflate_decode(z, z->dist_count, z->dist_symbol, &len);
+               if(sym == ZBOOT_INF_MORE)
+                  return true;
+               if(sym < 0)
+                  return false;
+               if(sym < 16)
+               {
+                  zboot_inflate_bits(z, len, &value);
+                  z->lengths[z->count++] = sym;
+                  continue;
+               }
+
+               // Repeat the previous length, or zero, 3-6, 3-10 or 11-138 times
+               repeat = (sym == 16) ? 2 : (sym == 17) ? 3 : 7;
+               if(z->bitcount < len + repeat)
+                  return true;
+               zboot_inflate_bits(z, len, &value);
+               zboot_inflate_bits(z, repeat, &repeat);
+               repeat += (sym == 18) ? 11 : 3;
+               if((sym == 16 && 0 == z->count) || z->count + repeat > z->codes[0] + z->codes[1])
+                  return false;
+               memset(z->lengths + z->count, (sym == 16) ? z->lengths[z->count - 1] : 0, repeat);
+               z->count += repeat;
+            }
+            if(0 == z->lengths[256]
+            || !zboot_inflate_build(z->len_count, z->len_symbol, z->lengths, z->codes[0])
+            || !zboot_inflate_build(z->dist_count, z->dist_symbol, z->lengths + z->codes[0], z->codes[1]))
+               return false;
+            z->state = ZBOOT_INF_CODES;
+            break;
+
+         case ZBOOT_INF_CODES:
+            for(;;)
+            {
+               sym = zboot_inflate_decode(z, z->len_count, z->len_symbol, &len);
+               if(sym == ZBOOT_INF_MORE)
+                  return true;
+               if(sym < 0 || sym > 285)
+                  return false;
+               if(sym < 256)
+               {
+                  zboot_inflate_bits(z, len, &value);
+                  if(!zboot_inflate_put(z, sym))
+                     return false;
+                  continue;
+               }
+               if(sym == 256)
+               {
+                  zboot_inflate_bits(z, len, &value);
+                  if(!zboot_inflate_block_end(z))
+                     return false;
+                  break;
+               }
+
+               sym -= 257;
+               if(z->bitcount < len + g_length_extra[sym])
+                  return true;
+               zboot_inflate_bits(z, len, &value);
+               zboot_inflate_bits(z, g_length_extra[sym], &value);
+               z->length = g_length_base[sym] + value;
+               z->state = ZBOOT_INF_DIST;
+               break;
+            }
+            break;
+
+         case ZBOOT_INF_DIST:
+            sym = zboot_inflate_decode(z, z->dist_count, z->dist_symbol, &len);
+            if(sym == ZBOOT_INF_MORE)
+               return true;
+            if(sym < 0 || sym > 29)
+               return false;
+            zboot_inflate_bits(z, len, &value);
+            z->value = sym;
+            z->state = ZBOOT_INF_DIST_EXTRA;
+            break;
+
+         case ZBOOT_INF_DIST_EXTRA:
+            if(!zboot_inflate_bits(z, g_dist_extra[z->value], &value))
+               return true;
+            z->distance = g_dist_base[z->value] + value;
+            z->next = ZBOOT_INF_CODES;
+            z->state = ZBOOT_INF_COPY;
+            break;
+
+         case ZBOOT_INF_CHECK:
+            if(z->format == ZBOOT_INFLATE_GZIP)
+            {
+               if(z->value != z->check)
+                  return false;
+               zboot_inflate_word(z, ZBOOT_INF_SIZE);
+               break;
+            }
+            // Adler-32 is stored most significant byte first
+            if(((z->value >> 24) | ((z->value >> 8) & 0xff00) | ((z->value << 8) & 0xff0000)
+               | (z->value << 24)) != z->check)
+               return false;
+            z->state = ZBOOT_INF_DONE;
+            break;
+
+         case ZBOOT_INF_SIZE:
+            if(z->value != z->bytes_out)
+               return false;
+            z->state = ZBOOT_INF_DONE;
+            break;
+
+         case ZBOOT_INF_LZ4_BLOCK:
+            zboot_inflate_word(z, ZBOOT_INF_LZ4_SIZE);
+            break;
+
+         case ZBOOT_INF_LZ4_SIZE:
+            if(0 == z->value)  // End mark
+            {
+               if(!zboot_inflate_flush(z))
+                  return false;
+               zboot_inflate_skip(z, (z->flags & ZBOOT_LZ4_CONTENT_CHKSUM) ? 4 : 0, ZBOOT_INF_DONE);
+               break;
+            }
+            z->block_left = z->value & 0x7fffffff;
+            z->state = (z->value & 0x80000000) ? ZBOOT_INF_LZ4_RAW : ZBOOT_INF_LZ4_TOKEN;
+            break;
+
+         case ZBOOT_INF_LZ4_RAW:
+            for(; z->block_left > 0; --z->block_left)
+            {
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+               if(!zboot_inflate_put(z, value))
+                  return false;
+            }
+            z->state = ZBOOT_INF_LZ4_BLOCK_END;
+            break;
+
+         case ZBOOT_INF_LZ4_TOKEN:
+            if(0 == z->block_left)
+            {
+               z->state = ZBOOT_INF_LZ4_BLOCK_END;
+               break;
+            }
+            if(!zboot_inflate_bits(z, 8, &value))
+               return true;
+            --z->block_left;
+            z->count = value >> 4;
+            z->length = value & 0x0f;
+            z->state = (z->count == 15) ? ZBOOT_INF_LZ4_LITLEN : ZBOOT_INF_LZ4_LITERALS;
+            break;
+
+         case ZBOOT_INF_LZ4_LITLEN:
+         case ZBOOT_INF_LZ4_MATCHLEN:
+            // Lengths of 15 or more continue in bytes, until one that's less than 255
+            do
+            {
+               if(0 == z->block_left)
+                  return false;
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+               --z->block_left;
+               if(z->state == ZBOOT_INF_LZ4_LITLEN)
+                  z->count += value;
+               else
+                  z->length += value;
+            } while(value == 255);
+            if(z->state == ZBOOT_INF_LZ4_LITLEN)
+               z->state = ZBOOT_INF_LZ4_LITERALS;
+            else
+            {
+               z->length += 4;
+               z->next = ZBOOT_INF_LZ4_TOKEN;
+               z->state = ZBOOT_INF_COPY;
+            }
+            break;
+
+         case ZBOOT_INF_LZ4_LITERALS:
+            for(; z->count > 0; --z->count)
+            {
+               if(0 == z->block_left)
+                  return false;
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+               --z->block_left;
+               if(!zboot_inflate_put(z, value))
+                  return false;
+            }
+            // The last sequence in a block has no match
+            z->state = (0 == z->block_left) ? ZBOOT_INF_LZ4_BLOCK_END : ZBOOT_INF_LZ4_OFFSET;
+            break;
+
+         case ZBOOT_INF_LZ4_OFFSET:
+            if(z->block_left < 2)
+               return false;
+            if(!zboot_inflate_bits(z, 16, &value))
+               return true;
+            z->block_left -= 2;
+            z->distance = value;
+            if(z->length == 15)
+               z->state = ZBOOT_INF_LZ4_MATCHLEN;
+            else
+            {
+               z->length += 4;
+               z->next = ZBOOT_INF_LZ4_TOKEN;
+               z->state = ZBOOT_INF_COPY;
+            }
+            break;
+
+         case ZBOOT_INF_LZ4_BLOCK_END:
+            zboot_inflate_skip(z, (z->flags & ZBOOT_LZ4_BLOCK_CHKSUM) ? 4 : 0, ZBOOT_INF_LZ4_BLOCK);
+            break;
+
+         case ZBOOT_INF_COPY:
+            if(!zboot_inflate_copy(z))
+               return false;
+            z->state = z->next;
+            break;
+
+         case ZBOOT_INF_SKIP:
+            for(; z->count > 0; --z->count)
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+            z->state = z->next;
+            break;
+
+         case ZBOOT_INF_WORD:
+            for(; z->count < sizeof(uint32_t); ++z->count)
+            {
+               if(!zboot_inflate_bits(z, 8, &value))
+                  return true;
+               z->value |= value << (8 * z->count);
+            }
+            z->state = z->next;
+            break;
+
+         case ZBOOT_INF_DONE:
+            return true;  // Anything after the end of the stream is ignored
+
+         default:
+            return false;
+      }
+   }
+}
+
+// Start decompressing data in the given format into a write context. Nothing else should be
+//  written to the context until zboot_inflate_end().
+bool zboot_inflate_init(zboot_inflate *z, void *context, uint8_t format)
+{
+   zboot_write_info info;
+
+   if(NULL == context || format > ZBOOT_INFLATE_LZ4 || !zboot_write_get_info(context, &info))
+      return false;
+
+   memset(z, 0, offsetof(zboot_inflate, len_count));
+   z->context = context;
+   z->format = format;
+   z->state = ZBOOT_INF_HEADER;
+   z->check = (format == ZBOOT_INFLATE_GZIP) ? 0 : 1;
+   z->base = info.length + info.queued;
+   return true;
+}
+
+// Decompress the next piece of the input, which can be split anywhere. Returns false if the
+//  data is invalid or a write failed, after which nothing more is written.
+bool zboot_inflate_write(zboot_inflate *z, const uint8_t *data, uint32_t length)
+{
+   if(z->state == ZBOOT_INF_ERROR)
+      return false;
+
+   z->input = data;
+   z->input_left = length;
+   z->bytes_in += length;
+   if(!zboot_inflate_run(z))
+      z->state = ZBOOT_INF_ERROR;
+   z->input_left = 0;
+   return z->state != ZBOOT_INF_ERROR;
+}
+
+// Returns true if the whole stream was decompressed and its check value matched. The write
+//  context is then ended as usual.
+bool zboot_inflate_end(zboot_inflate *z)
+{
+   return z->state == ZBOOT_INF_DONE;
+}
@@ -0,0 +1,69 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Decompresses an image as it's received, writing it through a zboot-api write context.
+ *  Only the most recent output is kept in memory; matches further back are read from the
+ *  flash already written, so memory use doesn't depend on the compressor's window size.
+ */
+#ifndef ZBOOT_INFLATE_H
+#define ZBOOT_INFLATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ZBOOT_INFLATE_GZIP     0  // gzip file (RFC 1952), as written by gzip
+#define ZBOOT_INFLATE_ZLIB     1  // zlib stream (RFC 1950)
+#define ZBOOT_INFLATE_DEFLATE  2  // Raw deflate data (RFC 1951)
+#define ZBOOT_INFLATE_LZ4      3  // LZ4 frame, as written by lz4
+
+// Output kept in memory, and written to flash each time it fills; a power of two, and
+//  preferably a multiple of the flash sector size
+#ifndef ZBOOT_INFLATE_WINDOW
+#define ZBOOT_INFLATE_WINDOW 4096
+#endif
+
+typedef struct
+{
+   void *context;            // From zboot_write_init()
+   uint8_t format;           // ZBOOT_INFLATE_*
+   uint8_t state;
+   uint8_t next;             // State to continue with after a skip, word or copy
+   uint8_t flags;            // From the gzip or LZ4 frame header
+   bool last;                // Decoding the last deflate block
+   uint8_t bitcount;
+   uint32_t bitbuf;          // Input bits not yet used, least significant first
+   const uint8_t *input;
+   uint32_t input_left;
+   uint32_t count;           // Progress through the current state
+   uint32_t value;
+   uint32_t length;          // Match length, or stored block length
+   uint32_t distance;
+   uint32_t block_left;      // Bytes left in the current LZ4 block
+   uint16_t codes[3];        // Literal/length, distance and code length code counts
+   uint32_t check;           // Running CRC-32 or Adler-32 of the output
+   uint32_t base;            // Image offset of the first byte of output
+   uint32_t bytes_in;
+   uint32_t bytes_out;
+   uint32_t flushed;         // Output passed to the write context
+   uint16_t len_count[16];   // Huffman codes, as the number of codes of each length
+   uint16_t len_symbol[288]; //  and the symbols in code order
+   uint16_t dist_count[16];
+   uint16_t dist_symbol[32];
+   uint8_t lengths[320];     // Code lengths, while reading a dynamic block header
+   uint8_t window[ZBOOT_INFLATE_WINDOW];
+} zboot_inflate;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool zboot_inflate_init(zboot_inflate *inflate, void *context, uint8_t format);
+bool zboot_inflate_write(zboot_inflate *inflate, const uint8_t *data, uint32_t length);
+bool zboot_inflate_end(zboot_inflate *inflate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZBOOT_INFLATE_H */
@@ -0,0 +1,108 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Single-producer, single-consumer ring buffer for image writes; see zboot-ring.h. The
+ *  head and tail counts are each changed by one side only, so no lock is needed.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "zboot-api.h"
+#include "zboot-ring.h"
+#include "esprom.h"
+
+#define ZBOOT_RING_BARRIER() __sync_synchronize()
+
+// 'buffer' must be word-aligned, and 'size' a power of two of at least a sector, so that
+//  whole sectors can be written from it. Set up the ring before anything is written with
+//  'context', so that writes end on sector boundaries.
+bool zboot_ring_init(zboot_ring *ring, void *context, uint8_t *buffer, uint32_t size)
+{
+   if(NULL == context || NULL == buffer || ((uintptr_t) buffer % sizeof(uint32_t)) != 0
+   || size < SECTOR_SIZE || (size & (size - 1)) != 0)
+      return false;
+
+   memset(ring, 0, sizeof(*ring));
+   ring->buffer = buffer;
+   ring->size = size;
+   ring->context = context;
+   return true;
+}
+
+uint32_t zboot_ring_used(const zboot_ring *ring)
+{
+   return ring->head - ring->tail;
+}
+
+uint32_t zboot_ring_space(const zboot_ring *ring)
+{
+   return ring->size - zboot_ring_used(ring);
+}
+
+// Copy as much of the data as there's room for, returning the number of bytes taken. Fewer
+//  than 'length' means the consumer is behind, and the rest should be offered again later.
+uint32_t zboot_ring_put(zboot_ring *ring, const uint8_t *data, uint32_t length)
+{
+   uint32_t head = ring->head;
+   uint32_t space = zboot_ring_space(ring);
+   uint32_t offset = head & (ring->size - 1);
+   uint32_t first;
+
+   if(length > space)
+   {
+      length = space;
+      ++ring->stats.stalls;
+   }
+   first = ring->size - offset;
+   if(first > length)
+      first = length;
+   memcpy(ring->buffer + offset, data, first);
+   memcpy(ring->buffer, data + first, length - first);
+
+   ZBOOT_RING_BARRIER();  // Data before the head that publishes it
+   ring->head = head + length;
+   ring->stats.bytes_in += length;
+   if(head + length - ring->tail > ring->stats.max_used)
+      ring->stats.max_used = head + length - ring->tail;
+   return length;
+}
+
+// Write the data waiting, a sector at a time, ending each write on a sector boundary of the
+//  image. A partial sector is only written if 'flush' is set, once all the data has been
+//  put. Returns false if a write fails.
+bool zboot_ring_drain(zboot_ring *ring, bool flush)
+{
+   uint32_t tail = ring->tail;
+   uint32_t used = ring->head - tail;
+
+   ZBOOT_RING_BARRIER();  // Head before the data it publishes
+   while(used > 0)
+   {
+      zboot_segment segment;
+      uint32_t length = SECTOR_SIZE - (tail % SECTOR_SIZE);
+
+      if(length > used)
+      {
+         if(!flush)
+            break;
+         length = used;
+      }
+
+      // The size is a multiple of the sector size, so a piece that ends at or before a sector
+      //  boundary never wraps around the end of the buffer
+      segment.data = ring->buffer + (tail & (ring->size - 1));
+      segment.length = length;
+      if(!zboot_write_flashv(ring->context, &segment, 1))
+         return false;
+
+      tail += length;
+      used -= length;
+      ++ring->stats.writes;
+      ring->stats.bytes_out += length;
+      ZBOOT_RING_BARRIER();  // Data read before the tail frees it
+      ring->tail = tail;
+   }
+   return true;
+}
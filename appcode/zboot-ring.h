@@ -0,0 +1,52 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Ring buffer between a producer receiving an image, such as a network callback, and a
+ *  task writing it to flash through a zboot-api write context. The producer never blocks;
+ *  the consumer writes whole sectors.
+ */
+#ifndef ZBOOT_RING_H
+#define ZBOOT_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+   uint32_t bytes_in;      // Accepted by zboot_ring_put()
+   uint32_t bytes_out;     // Written to flash
+   uint32_t writes;        // Flash write calls
+   uint32_t stalls;        // zboot_ring_put() calls that couldn't take all their data
+   uint32_t max_used;      // Most bytes waiting at once
+} zboot_ring_stats;
+
+typedef struct
+{
+   uint8_t *buffer;
+   uint32_t size;              // Power of two
+   volatile uint32_t head;     // Bytes put, modulo 2^32; only changed by the producer
+   volatile uint32_t tail;     // Bytes written, modulo 2^32; only changed by the consumer
+   void *context;              // From zboot_write_init()
+   zboot_ring_stats stats;
+} zboot_ring;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool zboot_ring_init(zboot_ring *ring, void *context, uint8_t *buffer, uint32_t size);
+
+// Producer
+uint32_t zboot_ring_put(zboot_ring *ring, const uint8_t *data, uint32_t length);
+uint32_t zboot_ring_space(const zboot_ring *ring);
+
+// Consumer
+uint32_t zboot_ring_used(const zboot_ring *ring);
+bool zboot_ring_drain(zboot_ring *ring, bool flush);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZBOOT_RING_H */
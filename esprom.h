@@ -25,7 +25,7 @@ typedef struct
 #pragma pack(pop)
 
 #define ESP_CHKSUM_INIT 0xef
-static uint8_t esp_checksum8(uint8_t *start, uint8_t length)
+static inline uint8_t esp_checksum8(const uint8_t *start, uint32_t length)
 {
    uint8_t chksum = ESP_CHKSUM_INIT;
    while(length > 0)
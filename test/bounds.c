@@ -0,0 +1,59 @@
+/* \brief zboot - partition bounds test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Writes, background erases and image checks must start inside a partition, and stop at
+ *  its end: flash outside the partition table, such as the bootloader, the config log and
+ *  the SDK's sectors at the end of flash, can't be reached through them.
+ */
+#include <string.h>
+#include "host.h"
+
+#define BOUNDS_IMAGE_SIZE 0x2000
+
+static uint8_t g_image[BOUNDS_IMAGE_SIZE];
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   const uint32_t outside[] = { 0, SECTOR_SIZE * BOOT_CONFIG_SECTOR, HOST_FLASH_SIZE - SECTOR_SIZE };
+   zboot_partition slot;
+   uint32_t length, remaining, idx;
+   void *context;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 0, &slot));
+   length = host_make_image(g_image, sizeof(g_image), 1, 1, 1);
+
+   for(idx = 0; idx < sizeof(outside) / sizeof(outside[0]); ++idx)
+   {
+      HOST_CHECK(NULL == zboot_write_init_ex(outside[idx], 0, 0));
+      HOST_CHECK(NULL == zboot_write_init_ex(outside[idx], SECTOR_SIZE, ZBOOT_WRITE_ASYNC));
+      HOST_CHECK(!zboot_erase_start(outside[idx], 0));
+      HOST_CHECK(!zboot_erase_start(outside[idx], SECTOR_SIZE));
+      HOST_CHECK(!zboot_verify_image(outside[idx], NULL, NULL));
+   }
+   HOST_CHECK(0 == g_host_counts.writes && 0 == g_host_counts.erases);
+
+   // Ranges that start in a partition but run past its end
+   HOST_CHECK(NULL == zboot_write_init_ex(slot.address, slot.size + 1, 0));
+   HOST_CHECK(!zboot_erase_start(slot.address, slot.size + SECTOR_SIZE));
+   memcpy(g_host_flash + slot.address + slot.size - length / 2, g_image, length);
+   HOST_CHECK(!zboot_verify_image(slot.address + slot.size - length / 2, NULL, NULL));
+
+   // An unbounded erase stops at the end of the partition
+   memset(g_host_flash + slot.address + slot.size, 0, SECTOR_SIZE);
+   HOST_CHECK(zboot_erase_start(slot.address + slot.size - 2 * SECTOR_SIZE, 0));
+   while(zboot_erase_poll(0xffffffff, &remaining) && remaining > 0)
+      ;
+   HOST_CHECK(0xff == g_host_flash[slot.address + slot.size - 1]);
+   HOST_CHECK(0 == g_host_flash[slot.address + slot.size]);
+
+   // Within the partition, everything works
+   HOST_CHECK(host_write_image(slot.address, g_image, length, 512));
+   HOST_CHECK(zboot_verify_image(slot.address, &remaining, NULL) && remaining == length);
+
+   printf("Bounds: ok\n");
+   return 0;
+}
@@ -0,0 +1,156 @@
+/* \brief zboot - bundle test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * A bundle must never write to the running slot or to the active partition of a data type,
+ *  members left to the device must each get a slot or partition of their own, and the data
+ *  partitions a bundle wrote must only become active if the whole bundle is committed.
+ */
+#include <string.h>
+#include "host.h"
+#include "zboot_util.h"
+#include "zboot-bundle.h"
+
+#define BUNDLE_IMAGE_SIZE 0x3000
+#define BUNDLE_DATA_SIZE  0x1800
+#define BUNDLE_MAX_SIZE   (sizeof(zbundle_header) + 4 * (sizeof(zbundle_member) + BUNDLE_IMAGE_SIZE))
+
+static const zboot_partition g_table[] =
+{
+   { ZBOOT_PARTITION_APP,         0, 0, 0x004000, 0x0fc000 },
+   { ZBOOT_PARTITION_APP,         0, 0, 0x104000, 0x0fc000 },
+   { ZBOOT_PARTITION_APP,         0, 0, 0x204000, 0x0fc000 },
+   { ZBOOT_PARTITION_FILESYSTEM,  0, 0, 0x300000, 0x040000 },
+   { ZBOOT_PARTITION_FILESYSTEM,  0, 0, 0x340000, 0x040000 },
+   { ZBOOT_PARTITION_CALIBRATION, 0, 0, 0x380000, 0x010000 },
+};
+
+typedef struct
+{
+   uint8_t type;
+   uint8_t index;
+   uint8_t flags;
+   const uint8_t *data;
+   uint32_t length;
+} bundle_part;
+
+static uint8_t g_images[2][BUNDLE_IMAGE_SIZE];
+static uint32_t g_lengths[2];
+static uint8_t g_data[BUNDLE_DATA_SIZE];
+static uint8_t g_bundle[BUNDLE_MAX_SIZE];
+
+// Build a bundle of 'count' parts, and write it in pieces of an awkward size. 'corrupt' names
+//  a member whose CRC is made wrong, or is -1.
+static bool send(const bundle_part *parts, uint32_t count, int corrupt)
+{
+   zbundle_header *header = (zbundle_header *) g_bundle;
+   zbundle_member *table = (zbundle_member *) (header + 1);
+   uint32_t length = sizeof(*header) + count * sizeof(*table);
+   uint32_t idx, offset, piece;
+   zboot_bundle bundle;
+   bool result;
+
+   for(idx = 0; idx < count; ++idx)
+   {
+      memset(&table[idx], 0, sizeof(table[idx]));
+      table[idx].type = parts[idx].type;
+      table[idx].index = parts[idx].index;
+      table[idx].flags = parts[idx].flags;
+      table[idx].length = parts[idx].length;
+      table[idx].crc = zboot_crc32(0, parts[idx].data, parts[idx].length) ^ ((int) idx == corrupt);
+      memcpy(g_bundle + length, parts[idx].data, parts[idx].length);
+      length += (parts[idx].length + 3) & ~3;
+   }
+   header->magic = ZBUNDLE_MAGIC;
+   header->count = count;
+   header->crc = zboot_crc32(0, table, count * sizeof(*table));
+
+   HOST_CHECK(zboot_bundle_init(&bundle, 0));
+   result = true;
+   for(offset = 0; result && offset < length; offset += piece)
+   {
+      piece = (length - offset < 999) ? length - offset : 999;
+      result = zboot_bundle_write(&bundle, g_bundle + offset, piece);
+   }
+   return zboot_bundle_end(&bundle) && result;
+}
+
+static uint8_t active(uint8_t type)
+{
+   uint8_t index;
+
+   HOST_CHECK(zboot_find_active_partition(type, &index, NULL));
+   return index;
+}
+
+static bool holds(const zboot_partition *partition, const uint8_t *data, uint32_t length)
+{
+   return memcmp(g_host_flash + partition->address, data, length) == 0;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition fs[2], calibration;
+   uint8_t index;
+   uint32_t writes, version;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_set_partitions(g_table, sizeof(g_table) / sizeof(g_table[0])));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_FILESYSTEM, 0, &fs[0]));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_FILESYSTEM, 1, &fs[1]));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_CALIBRATION, 0, &calibration));
+   g_lengths[0] = host_make_image(g_images[0], BUNDLE_IMAGE_SIZE, 10, 1, 1);
+   g_lengths[1] = host_make_image(g_images[1], BUNDLE_IMAGE_SIZE, 11, 1, 2);
+   memset(g_data, 0x5a, sizeof(g_data));
+   HOST_CHECK(0 == active(ZBOOT_PARTITION_FILESYSTEM));
+
+   // The active data partition and the running slot are refused before anything's written
+   writes = g_host_counts.writes + g_host_counts.erases;
+   {
+      const bundle_part parts[][1] =
+      {
+         { { ZBOOT_PARTITION_FILESYSTEM, 0, 0, g_data, sizeof(g_data) } },
+         { { ZBOOT_PARTITION_CALIBRATION, ZBUNDLE_INDEX_ANY, 0, g_data, sizeof(g_data) } },
+         { { ZBOOT_PARTITION_APP, 0, 0, g_images[0], g_lengths[0] } },
+      };
+      for(index = 0; index < sizeof(parts) / sizeof(parts[0]); ++index)
+         HOST_CHECK(!send(parts[index], 1, -1));
+   }
+   HOST_CHECK(writes == g_host_counts.writes + g_host_counts.erases);
+
+   // Members left to the device get slots of their own, even with a given slot listed after
+   //  them, and the spare filesystem becomes the active one
+   {
+      const bundle_part parts[] =
+      {
+         { ZBOOT_PARTITION_APP, ZBUNDLE_INDEX_ANY, ZBUNDLE_FLAG_BOOT, g_images[0], g_lengths[0] },
+         { ZBOOT_PARTITION_FILESYSTEM, ZBUNDLE_INDEX_ANY, 0, g_data, sizeof(g_data) },
+         { ZBOOT_PARTITION_APP, 1, 0, g_images[1], g_lengths[1] },
+      };
+      HOST_CHECK(send(parts, 3, -1));
+   }
+   HOST_CHECK(zboot_get_image_info(1, &version, NULL, NULL, NULL, 0) && version == 11);
+   HOST_CHECK(zboot_get_image_info(2, &version, NULL, NULL, NULL, 0) && version == 10);
+   HOST_CHECK(zboot_get_coldboot_index(&index) && index == 2);
+   HOST_CHECK(1 == active(ZBOOT_PARTITION_FILESYSTEM));
+   HOST_CHECK(holds(&fs[1], g_data, sizeof(g_data)));
+
+   // A bundle that fails changes nothing in use
+   memset(g_data, 0xa5, sizeof(g_data));
+   {
+      const bundle_part parts[] =
+      {
+         { ZBOOT_PARTITION_FILESYSTEM, ZBUNDLE_INDEX_ANY, 0, g_data, sizeof(g_data) },
+         { ZBOOT_PARTITION_APP, ZBUNDLE_INDEX_ANY, ZBUNDLE_FLAG_BOOT, g_images[1], g_lengths[1] },
+      };
+      HOST_CHECK(!send(parts, 2, 1));
+   }
+   HOST_CHECK(1 == active(ZBOOT_PARTITION_FILESYSTEM));
+   HOST_CHECK(zboot_get_coldboot_index(&index) && index == 2);
+   HOST_CHECK(g_host_flash[fs[1].address] == 0x5a);
+
+   printf("Bundle: ok\n");
+   return 0;
+}
@@ -0,0 +1,81 @@
+/* \brief zboot - config cache benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * The getters read the config, partition table and image catalog from a cache in RAM, so
+ *  they make no flash reads once it's filled. Their latency is compared with reading
+ *  everything from flash on each call, as they did before the cache, by invalidating the
+ *  cache before every call. Host CPU time is reported along with the flash reads made and
+ *  the time they'd take on the device, during which code running from flash is stalled.
+ */
+#include <string.h>
+#include "host.h"
+
+#define CACHE_CALLS         200000
+#define CACHE_UNCACHED_CALLS 2000
+
+static uint8_t g_image[0x2000];
+
+typedef struct
+{
+   uint64_t wall_us;
+   uint64_t flash_us;
+   uint32_t reads;
+} cache_result;
+
+static void getters(void)
+{
+   uint32_t version;
+   uint8_t index, count;
+
+   HOST_CHECK(zboot_get_coldboot_index(&index) && 0 == index);
+   HOST_CHECK(zboot_get_image_count(&count) && count == 2);
+   HOST_CHECK(zboot_get_image_info(1, &version, NULL, NULL, NULL, 0) && 3 == version);
+}
+
+static cache_result run(uint32_t calls, bool invalidate)
+{
+   cache_result result;
+   uint64_t start;
+   uint32_t idx;
+
+   host_reset_counts();
+   start = host_wall_us();
+   for(idx = 0; idx < calls; ++idx)
+   {
+      if(invalidate)
+         zboot_invalidate_config_cache();
+      getters();
+   }
+   result.wall_us = host_wall_us() - start;
+   result.flash_us = g_host_counts.time_us;
+   result.reads = g_host_counts.reads;
+   printf("%s: %8.0f ns per call on the host, %6.2f flash reads per call, %7.1f us of flash reads per call\n",
+      invalidate ? "Uncached" : "Cached  ", result.wall_us * 1000.0 / calls,
+      (double) result.reads / calls, (double) result.flash_us / calls);
+   return result;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+   cache_result cached, uncached;
+   uint32_t length;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+   length = host_make_image(g_image, sizeof(g_image), 3, 1, 1);
+   HOST_CHECK(host_write_image(slot.address, g_image, length, 1024));
+
+   getters();  // Fill the cache
+   cached = run(CACHE_CALLS, false);
+   uncached = run(CACHE_UNCACHED_CALLS, true);
+
+   HOST_CHECK(0 == cached.reads);
+   HOST_CHECK(uncached.reads >= CACHE_UNCACHED_CALLS);
+   HOST_CHECK(cached.wall_us * CACHE_UNCACHED_CALLS < uncached.wall_us * CACHE_CALLS);
+   printf("Cache: ok\n");
+   return 0;
+}
@@ -0,0 +1,96 @@
+/* \brief zboot - image catalog test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * The catalog must forget a slot whenever any part of it is written or erased, and the
+ *  get operations must not write flash, even when they rebuild the catalog. An image write
+ *  must change the catalog with a small record for its slot rather than rewriting all of
+ *  it, and the slot records must survive compacting the log.
+ */
+#include <string.h>
+#include "host.h"
+
+#define CATALOG_IMAGE_SIZE 0x8000
+#define CATALOG_UPDATES    100     // Enough image writes to compact the log
+
+// Config log bytes an image write may append: forgetting the slot, then describing the image
+#define CATALOG_RECORD_BYTES (2 * (sizeof(zboot_record_header) + sizeof(zboot_catalog_entry)))
+
+static uint8_t g_image[CATALOG_IMAGE_SIZE];
+
+// End of the records in the config log's first sector
+static uint32_t log_end(void)
+{
+   const uint8_t *sector = g_host_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE;
+   uint32_t end = SECTOR_SIZE;
+
+   while(end > 0 && sector[end - 1] == 0xff)
+      --end;
+   return end;
+}
+
+static bool has_image(uint8_t index, uint32_t *version)
+{
+   return zboot_get_image_info(index, version, NULL, NULL, NULL, 0);
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+   uint32_t length, version, remaining, writes, update, end;
+   uint8_t data[SECTOR_SIZE];
+   void *context;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+
+   length = host_make_image(g_image, sizeof(g_image), 7, 1, 1);
+   end = log_end();
+   HOST_CHECK(host_write_image(slot.address, g_image, length, 1024));
+   HOST_CHECK(has_image(1, &version) && version == 7);
+   printf("Image write: %u bytes of config records\n", log_end() - end);
+   HOST_CHECK(log_end() - end <= CATALOG_RECORD_BYTES);
+
+   // A write that starts part way into the slot
+   memset(data, 0, sizeof(data));
+   context = zboot_write_init_ex(slot.address + 0x10000, sizeof(data), 0);
+   HOST_CHECK(NULL != context);
+   HOST_CHECK(!has_image(1, &version));
+   HOST_CHECK(zboot_write_flash(context, data, sizeof(data)));
+   HOST_CHECK(zboot_write_end(context));
+   HOST_CHECK(!has_image(1, &version));
+
+   // An erase of part of the slot
+   HOST_CHECK(host_write_image(slot.address, g_image, length, 1024));
+   HOST_CHECK(has_image(1, &version));
+   HOST_CHECK(zboot_erase_start(slot.address + 0x20000, SECTOR_SIZE));
+   HOST_CHECK(!has_image(1, &version));
+   while(zboot_erase_poll(0xffffffff, &remaining) && remaining > 0)
+      ;
+
+   // Rebuilding the catalog when it's next read mustn't write flash
+   HOST_CHECK(host_write_image(slot.address, g_image, length, 1024));
+   zboot_invalidate_config_cache();
+   writes = g_host_counts.writes + g_host_counts.erases;
+   HOST_CHECK(has_image(1, &version) && version == 7);
+   HOST_CHECK(!has_image(0, &version));
+   HOST_CHECK(writes == g_host_counts.writes + g_host_counts.erases);
+
+   // The other slot's entry is kept when the log is compacted, and after a restart
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 0, &slot));
+   for(update = 0; update < CATALOG_UPDATES; ++update)
+   {
+      g_image[length / 2] = update;
+      host_image_checksum(g_image, length);
+      HOST_CHECK(host_write_image(slot.address, g_image, length, 1024));
+   }
+   zboot_invalidate_config_cache();
+   writes = g_host_counts.writes + g_host_counts.erases;
+   HOST_CHECK(has_image(0, &version) && has_image(1, &version) && version == 7);
+   HOST_CHECK(writes == g_host_counts.writes + g_host_counts.erases);
+
+   printf("Catalog: ok\n");
+   return 0;
+}
@@ -0,0 +1,137 @@
+/* \brief zboot - delta update benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * An image of generated machine code (see host_make_code_image()) is running, and the
+ *  next release inserts code near its start and changes words throughout. tools/zdelta is
+ *  built into this test to make the patch, which is applied in 1460-byte packets and
+ *  compared with downloading the whole new image. The bytes to download, host time, flash
+ *  reads and time, and memory of each are reported; the patch must be under a tenth of
+ *  the image, and the flash must end up holding the new image exactly.
+ */
+#include <string.h>
+#include <unistd.h>
+#include "host.h"
+#include "zboot-delta.h"
+
+#define main zdelta_main
+#include "../tools/zdelta.c"
+#undef main
+
+#define DELTA_IMAGE_SIZE 0x30000
+#define DELTA_PACKET     1460
+#define DELTA_INSERTED   200     // Bytes of code inserted
+#define DELTA_INSERT_AT  0x1000
+#define DELTA_CHANGES    60      // Words changed after it
+
+static uint8_t g_old[DELTA_IMAGE_SIZE];
+static uint8_t g_new[DELTA_IMAGE_SIZE];
+static zboot_delta g_delta;
+
+// The running image, and the next release of it. Returns the images' length.
+static uint32_t make_images(void)
+{
+   uint32_t length, end, offset, i;
+
+   length = host_make_code_image(g_old, sizeof(g_old), 1);
+   end = length - sizeof(uint32_t);
+
+   memcpy(g_new, g_old, DELTA_INSERT_AT);
+   for(i = 0; i < DELTA_INSERTED; ++i)
+      g_new[DELTA_INSERT_AT + i] = i * 7;
+   memcpy(g_new + DELTA_INSERT_AT + DELTA_INSERTED, g_old + DELTA_INSERT_AT,
+      end - DELTA_INSERT_AT - DELTA_INSERTED);
+   for(i = 0; i < DELTA_CHANGES; ++i)
+   {
+      offset = DELTA_INSERT_AT + DELTA_INSERTED + (end - DELTA_INSERT_AT - DELTA_INSERTED) / DELTA_CHANGES * i;
+      offset -= offset % sizeof(uint32_t);
+      *((uint32_t *) (g_new + offset)) ^= 0x00010000 + i;
+   }
+   ((zimage_header *) g_new)->version = 2;
+   host_image_checksum(g_new, length);
+   return length;
+}
+
+// Make the patch with zdelta. Returns its length.
+static uint32_t make_patch(uint32_t length, uint8_t *patch, uint32_t size)
+{
+   char names[3][32] = { "/tmp/zdelta-old-XXXXXX", "/tmp/zdelta-new-XXXXXX", "/tmp/zdelta-patch-XXXXXX" };
+   char *argv[] = { "zdelta", names[0], names[1], names[2], NULL };
+   const uint8_t *images[2] = { g_old, g_new };
+   uint32_t idx, patchLength;
+   FILE *file;
+   int fd;
+
+   for(idx = 0; idx < 3; ++idx)
+   {
+      fd = mkstemp(names[idx]);
+      HOST_CHECK(fd >= 0);
+      HOST_CHECK(idx == 2 || write(fd, images[idx], length) == (ssize_t) length);
+      close(fd);
+   }
+   HOST_CHECK(zdelta_main(4, argv) == 0);
+
+   file = fopen(names[2], "rb");
+   HOST_CHECK(NULL != file);
+   patchLength = fread(patch, 1, size, file);
+   fclose(file);
+   for(idx = 0; idx < 3; ++idx)
+      unlink(names[idx]);
+   return patchLength;
+}
+
+static void run(uint32_t address, uint32_t length, const uint8_t *patch, uint32_t size)
+{
+   const uint8_t *data = (NULL == patch) ? g_new : patch;
+   uint32_t position, piece;
+   uint64_t start, elapsed = 0;
+   void *context;
+
+   host_reset_counts();
+   context = zboot_write_init_ex(address, length, 0);
+   HOST_CHECK(NULL != context);
+   HOST_CHECK(NULL == patch || zboot_delta_init(&g_delta, context, 0));
+   for(position = 0; position < size; position += piece)
+   {
+      piece = (size - position < DELTA_PACKET) ? size - position : DELTA_PACKET;
+      start = host_wall_us();
+      if(NULL == patch)
+         HOST_CHECK(zboot_write_flash(context, data + position, piece));
+      else
+         HOST_CHECK(zboot_delta_write(&g_delta, data + position, piece));
+      elapsed += host_wall_us() - start;
+   }
+   HOST_CHECK(NULL == patch || zboot_delta_end(&g_delta));
+   HOST_CHECK(zboot_write_end(context));
+   HOST_CHECK(memcmp(g_host_flash + address, g_new, length) == 0);
+
+   printf("%s: %6u bytes to download (%5.1f%%), %6llu us on the host, %4u flash reads, %6.1f ms of flash time, %5u bytes of state\n",
+      (NULL == patch) ? "Image" : "Patch", size, size * 100.0 / length,
+      (unsigned long long) elapsed, g_host_counts.reads, g_host_counts.time_us / 1000.0,
+      (NULL == patch) ? 0 : (unsigned) sizeof(g_delta));
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   static uint8_t patch[DELTA_IMAGE_SIZE];
+   zboot_partition slot[2];
+   uint32_t length, patchLength;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 0, &slot[0]));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot[1]));
+
+   // The running image is in the first slot
+   length = make_images();
+   HOST_CHECK(host_write_image(slot[0].address, g_old, length, DELTA_PACKET));
+   patchLength = make_patch(length, patch, sizeof(patch));
+   HOST_CHECK(patchLength < length / 10);
+
+   run(slot[1].address, length, NULL, length);
+   run(slot[1].address, length, patch, patchLength);
+
+   printf("Delta: ok\n");
+   return 0;
+}
@@ -0,0 +1,402 @@
+/* \brief zboot - host test harness
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Simulated flash, RTC memory and clock for zboot-api; see host.h. Flash operations are
+ *  serialized by a mutex, as the SDK serializes them on the device, and follow NOR rules:
+ *  a write can only clear bits, and an erase sets a whole sector to 0xff.
+ */
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include "host.h"
+#include "zboot_private.h"
+#include "zboot_util.h"
+#include "zboot_log.h"
+
+typedef enum {
+    SPI_FLASH_RESULT_OK,
+    SPI_FLASH_RESULT_ERR,
+    SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+uint8_t g_host_flash[HOST_FLASH_SIZE];
+host_flash_counts g_host_counts;
+static uint8_t g_host_rtc[1024];
+static pthread_mutex_t g_host_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ----------------------------------------------------------------------------------------
+ * SDK functions used by zboot-api
+ */
+
+SpiFlashOpResult spi_flash_read(uint32_t addr, uint32_t *buffer, uint32_t length)
+{
+   if((addr % sizeof(uint32_t)) != 0 || ((uintptr_t) buffer % sizeof(uint32_t)) != 0
+   || addr > HOST_FLASH_SIZE || length > HOST_FLASH_SIZE - addr)
+      return SPI_FLASH_RESULT_ERR;
+
+   pthread_mutex_lock(&g_host_mutex);
+   memcpy(buffer, g_host_flash + addr, length);
+   ++g_host_counts.reads;
+   g_host_counts.read_bytes += length;
+   g_host_counts.time_us += HOST_READ_US(length);
+   pthread_mutex_unlock(&g_host_mutex);
+   return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32_t addr, uint32_t *buffer, uint32_t length)
+{
+   const uint8_t *data = (const uint8_t *) buffer;
+   uint32_t pages = 0, i;
+
+   if((addr % sizeof(uint32_t)) != 0 || (length % sizeof(uint32_t)) != 0
+   || ((uintptr_t) buffer % sizeof(uint32_t)) != 0
+   || addr > HOST_FLASH_SIZE || length > HOST_FLASH_SIZE - addr)
+      return SPI_FLASH_RESULT_ERR;
+
+   pthread_mutex_lock(&g_host_mutex);
+   for(i = 0; i < length; ++i)
+      g_host_flash[addr + i] &= data[i];
+   if(length > 0)
+      pages = (addr + length - 1) / 256 - addr / 256 + 1;
+   ++g_host_counts.writes;
+   g_host_counts.pages += pages;
+   g_host_counts.write_bytes += length;
+   g_host_counts.time_us += HOST_WRITE_US(pages, length);
+   pthread_mutex_unlock(&g_host_mutex);
+   return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sector)
+{
+   if(sector >= HOST_FLASH_SIZE / SECTOR_SIZE)
+      return SPI_FLASH_RESULT_ERR;
+
+   pthread_mutex_lock(&g_host_mutex);
+   memset(g_host_flash + sector * SECTOR_SIZE, 0xff, SECTOR_SIZE);
+   ++g_host_counts.erases;
+   g_host_counts.time_us += HOST_ERASE_US;
+   pthread_mutex_unlock(&g_host_mutex);
+   return SPI_FLASH_RESULT_OK;
+}
+
+uint32_t SPIEraseBlock(uint32_t block)
+{
+   if(block >= HOST_FLASH_SIZE / 0x10000)
+      return 1;
+
+   pthread_mutex_lock(&g_host_mutex);
+   memset(g_host_flash + block * 0x10000, 0xff, 0x10000);
+   ++g_host_counts.block_erases;
+   g_host_counts.time_us += HOST_BLOCK_ERASE_US;
+   pthread_mutex_unlock(&g_host_mutex);
+   return 0;
+}
+
+// The clock only advances with flash operations, so time budgets are deterministic
+uint32_t system_get_time(void)
+{
+   uint32_t now;
+
+   pthread_mutex_lock(&g_host_mutex);
+   now = (uint32_t) g_host_counts.time_us;
+   pthread_mutex_unlock(&g_host_mutex);
+   return now;
+}
+
+bool system_rtc_mem_write(uint8_t des_addr, const void *src_addr, uint16_t save_size)
+{
+   if(des_addr * sizeof(uint32_t) + save_size > sizeof(g_host_rtc))
+      return false;
+   memcpy(g_host_rtc + des_addr * sizeof(uint32_t), src_addr, save_size);
+   return true;
+}
+
+bool system_rtc_mem_read(uint8_t des_addr, void *src_addr, uint16_t save_size)
+{
+   if(des_addr * sizeof(uint32_t) + save_size > sizeof(g_host_rtc))
+      return false;
+   memcpy(src_addr, g_host_rtc + des_addr * sizeof(uint32_t), save_size);
+   return true;
+}
+
+void ets_printf(char *format, ...)
+{
+   va_list args;
+
+   va_start(args, format);
+   vprintf(format, args);
+   va_end(args);
+}
+
+void ets_memset(void *buffer, uint8_t value, uint32_t length)
+{
+   memset(buffer, value, length);
+}
+
+void Cache_Read_Enable_original(uint8_t odd, uint8_t high, uint8_t unknown)
+{
+}
+
+void Cache_Read_Disable(void)
+{
+}
+
+void ets_intr_lock(void)
+{
+}
+
+void ets_intr_unlock(void)
+{
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Test setup
+ */
+
+static uint32_t host_log_read(uint32_t addr, void *buffer, uint32_t length)
+{
+   memcpy(buffer, g_host_flash + addr, length);
+   return 0;
+}
+
+static uint32_t host_log_write(uint32_t addr, const void *buffer, uint32_t length)
+{
+   uint32_t i;
+
+   for(i = 0; i < length; ++i)
+      g_host_flash[addr + i] &= ((const uint8_t *) buffer)[i];
+   return 0;
+}
+
+static uint32_t host_log_erase(uint32_t sector)
+{
+   memset(g_host_flash + sector * SECTOR_SIZE, 0xff, SECTOR_SIZE);
+   return 0;
+}
+
+static const zboot_flash_ops g_host_log_ops = { host_log_read, host_log_write, host_log_erase };
+
+// Erased flash holding the default config, as the bootloader writes it on first boot, and
+//  RTC data saying that the first slot is running. Must be called before the first API
+//  call, since the API caches what it reads.
+void host_setup(void)
+{
+   zboot_partition_table partitions;
+   zboot_config config;
+
+   default_config(&config, &partitions, HOST_FLASH_SIZE);
+   host_setup_partitions(partitions.entry, partitions.count);
+}
+
+// Like host_setup(), with the given partition table rather than the default one, such as
+//  the one a device in the field was set up with
+void host_setup_partitions(const zboot_partition *entries, uint8_t count)
+{
+   static uint8_t scratch[SECTOR_SIZE];
+   zboot_partition_table partitions;
+   zboot_config config;
+   zboot_rtc_data rtc;
+   zboot_log log;
+
+   memset(g_host_flash, 0xff, sizeof(g_host_flash));
+   memset(g_host_rtc, 0, sizeof(g_host_rtc));
+
+   default_config(&config, &partitions, HOST_FLASH_SIZE);
+   partitions.count = count;
+   memcpy(partitions.entry, entries, count * sizeof(*entries));
+   zboot_log_scan(&g_host_log_ops, &log);
+   zboot_log_append(&g_host_log_ops, &log, ZBOOT_RECORD_PARTITIONS, &partitions,
+      zboot_partition_table_length(partitions.count), scratch, sizeof(scratch));
+   zboot_log_append(&g_host_log_ops, &log, ZBOOT_RECORD_CONFIG, &config, sizeof(config),
+      scratch, sizeof(scratch));
+
+   memset(&rtc, 0, sizeof(rtc));
+   rtc.magic = ZBOOT_RTC_MAGIC;
+   rtc.last_rom = config.current_rom;
+   rtc.rom_addr = partitions.entry[config.current_rom].address;
+   rtc.chksum = zboot_rtc_checksum(&rtc);
+   system_rtc_mem_write(ZBOOT_RTC_ADDR / sizeof(uint32_t), &rtc, sizeof(rtc));
+
+   host_reset_counts();
+}
+
+void host_reset_counts(void)
+{
+   pthread_mutex_lock(&g_host_mutex);
+   memset(&g_host_counts, 0, sizeof(g_host_counts));
+   pthread_mutex_unlock(&g_host_mutex);
+}
+
+// Real time, for measuring the host CPU cost of API calls
+uint64_t host_wall_us(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Build a bootable image of about 'size' bytes in 'buffer', with a single IRAM section of
+//  pseudo-random data. Returns its length.
+uint32_t host_make_image(uint8_t *buffer, uint32_t size, uint32_t version, uint32_t date,
+   uint32_t seed)
+{
+   zimage_header *header = (zimage_header *) buffer;
+   section_header *section = (section_header *) (header + 1);
+   uint32_t *words = (uint32_t *) (section + 1);
+   uint32_t length, i;
+
+   length = (size - sizeof(*header) - sizeof(*section) - sizeof(uint32_t)) & ~3;
+   memset(header, 0, sizeof(*header));
+   header->magic = ZIMAGE_MAGIC;
+   header->count = 1;
+   header->entry = 0x40100004;
+   header->version = version;
+   header->date = date;
+   header->flags = ZIMAGE_FLAG_IRAM_ONLY;
+   header->state = ZIMAGE_STATE_WRITTEN;
+   strcpy(header->description, "host test image");
+   section->address = 0x40100000;
+   section->length = length;
+   for(i = 0; i < length / sizeof(uint32_t); ++i)
+   {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      words[i] = seed;
+   }
+
+   length += sizeof(*header) + sizeof(*section) + sizeof(uint32_t);
+   host_image_checksum(buffer, length);
+   return length;
+}
+
+static uint32_t host_random(uint32_t *state)
+{
+   *state ^= *state << 13;
+   *state ^= *state >> 17;
+   *state ^= *state << 5;
+   return *state;
+}
+
+// Build a bootable image like host_make_image(), whose data resembles Xtensa machine code
+//  rather than being pseudo-random: functions of 2- and 3-byte instructions taken from a
+//  small set of opcodes with random register fields and call offsets, with a common prologue
+//  and epilogue, idioms repeated from earlier code, and pools of literal addresses. It only
+//  depends on 'seed', so the benchmarks that compress, patch or hash it are repeatable.
+//  Returns its length.
+uint32_t host_make_code_image(uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+   // Opcode bytes, with the register fields left as zero; the last ones take a call offset
+   static const uint8_t narrow[][2] = {
+      { 0x0c, 0x02 }, { 0x1b, 0x00 }, { 0x2d, 0x00 }, { 0x88, 0x00 }, { 0x89, 0x00 },
+      { 0x0d, 0xf0 }, { 0x1d, 0xf0 }, { 0x3d, 0xf0 }};
+   static const uint8_t wide[][3] = {
+      { 0x21, 0x00, 0x00 }, { 0x22, 0x00, 0x00 }, { 0x32, 0x00, 0x00 }, { 0x42, 0x00, 0x00 },
+      { 0x80, 0x00, 0x00 }, { 0x20, 0x00, 0x20 }, { 0x16, 0x00, 0x00 }, { 0x56, 0x00, 0x00 },
+      { 0x26, 0x00, 0x00 }, { 0x66, 0x00, 0x00 }, { 0xa5, 0x00, 0x00 }, { 0xe5, 0x00, 0x00 }};
+   uint8_t *data = buffer + sizeof(zimage_header) + sizeof(section_header);
+   uint32_t length = host_make_image(buffer, size, 1, 1, 1);
+   uint8_t *end = buffer + length - sizeof(uint32_t);
+   uint8_t *out = data;
+   uint32_t count, op, reg, back, i;
+
+   while(out + 64 <= end)
+   {
+      // Prologue: entry a1, 16 to 64
+      *out++ = 0x36;
+      *out++ = 0x41 + ((host_random(&seed) % 4) << 4);
+      *out++ = 0x00;
+
+      for(count = 8 + host_random(&seed) % 48; count > 0 && out + 32 <= end; --count)
+      {
+         op = host_random(&seed);
+         reg = op >> 16;
+         if((op % 8) == 0 && out - data > 64)
+         {
+            // An idiom from earlier code
+            back = 16 + (op >> 8) % 2048;
+            back = (back > (uint32_t) (out - data)) ? (uint32_t) (out - data) : back;
+            for(i = 6 + (op >> 20) % 18; i > 0; --i, ++out)
+               *out = *(out - back);
+         }
+         else if((op % 8) < 4)
+         {
+            memcpy(out, narrow[reg % 8], 2);
+            if(reg % 8 < 5)
+            {
+               out[0] |= (reg & 0x30) << 2;
+               out[1] |= (reg >> 4) & 0x77;
+            }
+            out += 2;
+         }
+         else
+         {
+            memcpy(out, wide[reg % 12], 3);
+            if(reg % 12 < 10)
+            {
+               out[0] |= (reg >> 4) & 0xf0;
+               out[1] |= (reg >> 8) & 0x77;
+            }
+            else
+            {
+               out[1] = host_random(&seed);
+               out[2] = host_random(&seed);
+            }
+            out += 3;
+         }
+      }
+
+      // Epilogue: retw.n, then padding to a word and sometimes a literal pool
+      *out++ = 0x1d;
+      *out++ = 0xf0;
+      while((out - data) % sizeof(uint32_t) != 0)
+         *out++ = 0;
+      if((host_random(&seed) % 4) == 0)
+      {
+         for(count = 2 + host_random(&seed) % 8; count > 0 && out + 4 <= end; --count, out += 4)
+         {
+            op = ((host_random(&seed) % 2) ? 0x40210000 : 0x3ffe8000) + (host_random(&seed) % 0x4000) * 4;
+            memcpy(out, &op, sizeof(op));
+         }
+      }
+   }
+   memset(out, 0, end - out);
+
+   host_image_checksum(buffer, length);
+   return length;
+}
+
+// Set the checksum of an image of 'length' bytes made by host_make_image(), after its
+//  header or data has been changed
+void host_image_checksum(uint8_t *buffer, uint32_t length)
+{
+   uint32_t chksum = 0, i;
+
+   for(i = 0; i < length - sizeof(chksum); i += sizeof(uint32_t))
+      if(i != ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t))
+         chksum += *((uint32_t *) (buffer + i));
+   memcpy(buffer + length - sizeof(chksum), &chksum, sizeof(chksum));
+}
+
+// Write an image through the API, 'chunk' bytes at a time
+bool host_write_image(uint32_t address, const uint8_t *image, uint32_t length, uint32_t chunk)
+{
+   void *context = zboot_write_init_ex(address, length, 0);
+   uint32_t offset, piece;
+
+   if(NULL == context)
+      return false;
+   for(offset = 0; offset < length; offset += piece)
+   {
+      piece = (length - offset < chunk) ? length - offset : chunk;
+      if(!zboot_write_flash(context, image + offset, piece))
+      {
+         zboot_write_end(context);
+         return false;
+      }
+   }
+   return zboot_write_end(context);
+}
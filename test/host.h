@@ -0,0 +1,62 @@
+/* \brief zboot - host test harness
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Runs zboot-api on a PC: the SDK flash, RTC memory and timer functions are replaced by
+ *  a simulated flash chip, whose operations advance a simulated clock by what they would
+ *  take on an ESP8266. Build and run the tests with "make host-test".
+ */
+#ifndef ZBOOT_HOST_H
+#define ZBOOT_HOST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esprom.h"
+#include "zboot.h"
+#include "zboot-api.h"
+
+#define HOST_FLASH_SIZE (4 * 1024 * 1024)
+
+// Assumed flash timings, from typical SPI NOR datasheets at 40MHz
+#define HOST_READ_US(bytes)   (2 + (bytes) / 5)     // Command overhead, then about 5MB/s
+#define HOST_WRITE_US(pages, bytes) ((pages) * 30 + (bytes) * 3)  // Overhead per page program
+#define HOST_ERASE_US         45000                 // Sector erase
+#define HOST_BLOCK_ERASE_US   400000                // 64kB block erase
+
+typedef struct
+{
+   uint32_t reads;
+   uint32_t writes;
+   uint32_t pages;       // Page programs, which a write is split into at page boundaries
+   uint32_t erases;
+   uint32_t block_erases;
+   uint64_t read_bytes;
+   uint64_t write_bytes;
+   uint64_t time_us;     // Simulated time spent in flash operations
+} host_flash_counts;
+
+#define HOST_CHECK(condition)                                                        \
+   do {                                                                              \
+      if(!(condition))                                                               \
+      {                                                                              \
+         fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+         exit(1);                                                                    \
+      }                                                                              \
+   } while(0)
+
+extern uint8_t g_host_flash[HOST_FLASH_SIZE];
+extern host_flash_counts g_host_counts;
+
+void host_setup(void);
+void host_setup_partitions(const zboot_partition *entries, uint8_t count);
+void host_reset_counts(void);
+uint64_t host_wall_us(void);
+uint32_t host_make_image(uint8_t *buffer, uint32_t size, uint32_t version, uint32_t date,
+   uint32_t seed);
+uint32_t host_make_code_image(uint8_t *buffer, uint32_t size, uint32_t seed);
+void host_image_checksum(uint8_t *buffer, uint32_t length);
+bool host_write_image(uint32_t address, const uint8_t *image, uint32_t length, uint32_t chunk);
+
+#endif /* ZBOOT_HOST_H */
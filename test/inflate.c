@@ -0,0 +1,168 @@
+/* \brief zboot - compressed write benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * An image of generated machine code (see host_make_code_image()) is compressed in each
+ *  format zboot-inflate reads and written through it in 1460-byte packets, as well as
+ *  uncompressed. The bytes to download, host time, flash reads and time, and memory of
+ *  each are reported; every format must download less than the raw image, and the flash
+ *  must end up holding it exactly. The deflate formats are compressed with zlib at level
+ *  9, and LZ4 with a simple greedy encoder.
+ */
+#include <string.h>
+#include <zlib.h>
+#include "host.h"
+#include "zboot-inflate.h"
+
+#define INFLATE_IMAGE_SIZE 0x20000
+#define INFLATE_PACKET     1460
+#define INFLATE_ROUNDS     4
+
+static uint8_t g_image[INFLATE_IMAGE_SIZE];
+static uint8_t g_compressed[INFLATE_IMAGE_SIZE * 2];
+static zboot_inflate g_inflate;
+
+static uint32_t deflate_image(uint32_t length, int bits)
+{
+   z_stream stream;
+
+   memset(&stream, 0, sizeof(stream));
+   HOST_CHECK(deflateInit2(&stream, 9, Z_DEFLATED, bits, 9, Z_DEFAULT_STRATEGY) == Z_OK);
+   stream.next_in = g_image;
+   stream.avail_in = length;
+   stream.next_out = g_compressed;
+   stream.avail_out = sizeof(g_compressed);
+   HOST_CHECK(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+   deflateEnd(&stream);
+   return stream.total_out;
+}
+
+static uint8_t *lz4_count(uint8_t *out, uint32_t count)
+{
+   for(; count >= 255; count -= 255)
+      *out++ = 255;
+   *out++ = count;
+   return out;
+}
+
+// Emit a sequence: literals, then a match unless it's the last sequence
+static uint8_t *lz4_sequence(uint8_t *out, const uint8_t *literals, uint32_t count,
+   uint32_t offset, uint32_t match)
+{
+   uint8_t *token = out++;
+
+   *token = ((count < 15) ? count : 15) << 4;
+   if(count >= 15)
+      out = lz4_count(out, count - 15);
+   memcpy(out, literals, count);
+   out += count;
+   if(0 == match)
+      return out;
+
+   *out++ = offset & 0xff;
+   *out++ = offset >> 8;
+   match -= 4;
+   *token |= (match < 15) ? match : 15;
+   if(match >= 15)
+      out = lz4_count(out, match - 15);
+   return out;
+}
+
+// An LZ4 frame holding one block. The header checksum is left as zero, since zboot-inflate
+//  doesn't check it.
+static uint32_t lz4_image(uint32_t length)
+{
+   static uint32_t table[1 << 14];  // Position after the last 4 bytes with each hash
+   static const uint8_t header[] = { 0x04, 0x22, 0x4d, 0x18, 0x40, 0x70, 0x00 };
+   uint8_t *out = g_compressed + sizeof(header) + sizeof(uint32_t);
+   uint32_t pos = 0, anchor = 0, size, sequence, hash, candidate, match;
+
+   memset(table, 0, sizeof(table));
+   while(pos + 12 <= length)  // The last match must start 12 bytes before the end
+   {
+      memcpy(&sequence, g_image + pos, sizeof(sequence));
+      hash = (sequence * 2654435761u) >> 18;
+      candidate = table[hash];
+      table[hash] = pos + 1;
+      if(0 == candidate-- || pos - candidate > 0xffff
+      || memcmp(g_image + candidate, g_image + pos, sizeof(sequence)) != 0)
+      {
+         ++pos;
+         continue;
+      }
+
+      for(match = sizeof(sequence); pos + match < length - 5
+         && g_image[candidate + match] == g_image[pos + match]; ++match)
+         ;
+      out = lz4_sequence(out, g_image + anchor, pos - anchor, pos - candidate, match);
+      pos += match;
+      anchor = pos;
+   }
+   out = lz4_sequence(out, g_image + anchor, length - anchor, 0, 0);
+
+   memcpy(g_compressed, header, sizeof(header));
+   size = out - g_compressed - sizeof(header) - sizeof(uint32_t);
+   memcpy(g_compressed + sizeof(header), &size, sizeof(size));
+   memset(out, 0, sizeof(uint32_t));  // End mark
+   return out + sizeof(uint32_t) - g_compressed;
+}
+
+// Write the image, compressed in 'format' unless it's ZBOOT_INFLATE_LZ4 + 1, and report
+static void run(uint32_t address, uint32_t length, uint8_t format, uint32_t compressed)
+{
+   static const char *names[] = { "gzip", "zlib", "deflate", "LZ4", "Raw" };
+   const uint8_t *data = (format > ZBOOT_INFLATE_LZ4) ? g_image : g_compressed;
+   uint32_t size = (format > ZBOOT_INFLATE_LZ4) ? length : compressed;
+   uint32_t position, piece, round;
+   uint64_t start, elapsed = 0;
+   void *context;
+
+   HOST_CHECK(format > ZBOOT_INFLATE_LZ4 || size < length);
+   host_reset_counts();
+   for(round = 0; round < INFLATE_ROUNDS; ++round)
+   {
+      context = zboot_write_init_ex(address, length, 0);
+      HOST_CHECK(NULL != context);
+      HOST_CHECK(format > ZBOOT_INFLATE_LZ4 || zboot_inflate_init(&g_inflate, context, format));
+      for(position = 0; position < size; position += piece)
+      {
+         piece = (size - position < INFLATE_PACKET) ? size - position : INFLATE_PACKET;
+         start = host_wall_us();
+         if(format > ZBOOT_INFLATE_LZ4)
+            HOST_CHECK(zboot_write_flash(context, data + position, piece));
+         else
+            HOST_CHECK(zboot_inflate_write(&g_inflate, data + position, piece));
+         elapsed += host_wall_us() - start;
+      }
+      HOST_CHECK(format > ZBOOT_INFLATE_LZ4 || zboot_inflate_end(&g_inflate));
+      HOST_CHECK(zboot_write_end(context));
+      HOST_CHECK(memcmp(g_host_flash + address, g_image, length) == 0);
+   }
+
+   printf("%-7s: %6u bytes to download (%3u%%), %6.0f us per image on the host, %4u flash reads, %6.1f ms of flash time, %5u bytes of state\n",
+      names[format], size, (unsigned) ((uint64_t) size * 100 / length),
+      (double) elapsed / INFLATE_ROUNDS, g_host_counts.reads / INFLATE_ROUNDS,
+      g_host_counts.time_us / 1000.0 / INFLATE_ROUNDS,
+      (format > ZBOOT_INFLATE_LZ4) ? 0 : (unsigned) sizeof(g_inflate));
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+   uint32_t length;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+   length = host_make_code_image(g_image, sizeof(g_image), 1);
+
+   run(slot.address, length, ZBOOT_INFLATE_LZ4 + 1, 0);
+   run(slot.address, length, ZBOOT_INFLATE_GZIP, deflate_image(length, 16 + 15));
+   run(slot.address, length, ZBOOT_INFLATE_ZLIB, deflate_image(length, 15));
+   run(slot.address, length, ZBOOT_INFLATE_DEFLATE, deflate_image(length, -15));
+   run(slot.address, length, ZBOOT_INFLATE_LZ4, lz4_image(length));
+
+   printf("Inflate: ok\n");
+   return 0;
+}
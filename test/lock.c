@@ -0,0 +1,72 @@
+/* \brief zboot - manifest lock test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * zboot_get_manifest() must only hold the API lock while it reads each unit, so that other
+ *  tasks aren't held up for the whole slot, and must refuse a range that isn't within a
+ *  partition.
+ *
+ * zboot-api.c is built into this test, with the flash time spent under its lock observed.
+ */
+#include <string.h>
+#include <pthread.h>
+#include "host.h"
+
+int lock_mutex_lock(pthread_mutex_t *mutex);
+int lock_mutex_unlock(pthread_mutex_t *mutex);
+
+#define pthread_mutex_lock lock_mutex_lock
+#define pthread_mutex_unlock lock_mutex_unlock
+#include "zboot-api.c"
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+#define LOCK_IMAGE_SIZE 0x20000
+
+static uint8_t g_image[LOCK_IMAGE_SIZE];
+static uint32_t g_hashes[LOCK_IMAGE_SIZE / SECTOR_SIZE];
+static uint64_t g_locked_at;
+static uint64_t g_longest;     // Longest flash time spent holding the lock
+
+int lock_mutex_lock(pthread_mutex_t *mutex)
+{
+   int result = pthread_mutex_lock(mutex);
+
+   g_locked_at = g_host_counts.time_us;
+   return result;
+}
+
+int lock_mutex_unlock(pthread_mutex_t *mutex)
+{
+   if(g_host_counts.time_us - g_locked_at > g_longest)
+      g_longest = g_host_counts.time_us - g_locked_at;
+   return pthread_mutex_unlock(mutex);
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+   uint32_t length;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+   length = host_make_code_image(g_image, sizeof(g_image), 1);
+   HOST_CHECK(host_write_image(slot.address, g_image, length, 1460));
+
+   // Each sector is read under its own hold of the lock
+   g_longest = 0;
+   HOST_CHECK(zboot_get_manifest(slot.address, length, SECTOR_SIZE, g_hashes));
+   printf("Manifest of %u sectors: longest lock hold %.1f ms of flash time\n",
+      length / SECTOR_SIZE, g_longest / 1000.0);
+   HOST_CHECK(g_longest < 2 * HOST_READ_US(SECTOR_SIZE));
+
+   // The range must be within one partition
+   HOST_CHECK(zboot_get_manifest(slot.address + slot.size - SECTOR_SIZE, SECTOR_SIZE, SECTOR_SIZE, g_hashes));
+   HOST_CHECK(!zboot_get_manifest(slot.address + slot.size - SECTOR_SIZE, 2 * SECTOR_SIZE, SECTOR_SIZE, g_hashes));
+   HOST_CHECK(!zboot_get_manifest(HOST_FLASH_SIZE, SECTOR_SIZE, SECTOR_SIZE, g_hashes));
+
+   printf("Lock: ok\n");
+   return 0;
+}
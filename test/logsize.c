@@ -0,0 +1,91 @@
+/* \brief zboot - config log size test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Built with a two-sector config log. On a device set up with a single log sector, the
+ *  first slot starts in the sector that the second log sector would take; compacting the
+ *  log must never erase it, and the device's legacy config and partition table must still
+ *  be accepted. On a new device, the log uses both sectors.
+ */
+#include <string.h>
+#include "host.h"
+#include "zboot_util.h"
+
+#if BOOT_CONFIG_SECTOR_COUNT != 2
+#error Build with BOOT_CONFIG_SECTOR_COUNT=2
+#endif
+
+#define LOGSIZE_IMAGE_SIZE 0x8000
+#define LOGSIZE_UPDATES    500     // Enough config records to compact the log several times
+
+static const zboot_partition g_field[] =
+{
+   { ZBOOT_PARTITION_APP, 0, 0, 0x003000, 0x1fd000 },
+   { ZBOOT_PARTITION_APP, 0, 0, 0x203000, 0x1f9000 },
+};
+
+static uint8_t g_image[LOGSIZE_IMAGE_SIZE];
+
+static uint32_t flash_word(uint32_t address)
+{
+   uint32_t word;
+
+   memcpy(&word, g_host_flash + address, sizeof(word));
+   return word;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_legacy_config legacy;
+   zboot_partition_table partitions;
+   zboot_partition slot;
+   zboot_config config;
+   uint32_t length, version, update;
+   uint8_t index;
+   bool second = false;
+
+   // A new device uses both log sectors, with the slots after them
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 0, &slot) && slot.address == 0x4000);
+   for(update = 0; update < LOGSIZE_UPDATES; ++update)
+   {
+      HOST_CHECK(zboot_set_coldboot_index(update % 2));
+      second = second || flash_word((BOOT_CONFIG_SECTOR + 1) * SECTOR_SIZE) == ZBOOT_RECORD_MAGIC;
+   }
+   HOST_CHECK(second);
+
+   // A device in the field, with its first slot in the second log sector
+   host_setup_partitions(g_field, 2);
+   length = host_make_image(g_image, sizeof(g_image), 3, 1, 1);
+   memcpy(g_host_flash + g_field[0].address, g_image, length);
+   zboot_invalidate_config_cache();
+
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 0, &slot) && slot.address == 0x3000);
+   for(update = 0; update < LOGSIZE_UPDATES; ++update)
+      HOST_CHECK(zboot_set_coldboot_index(update % 2));
+   HOST_CHECK(memcmp(g_host_flash + g_field[0].address, g_image, length) == 0);
+   HOST_CHECK(zboot_get_image_info(0, &version, NULL, NULL, NULL, 0) && version == 3);
+   HOST_CHECK(zboot_set_partitions(g_field, 2));
+
+   // A scan after a restart must come to the same conclusion
+   zboot_invalidate_config_cache();
+   HOST_CHECK(zboot_get_coldboot_index(&index) && index == (LOGSIZE_UPDATES - 1) % 2);
+   HOST_CHECK(zboot_set_coldboot_index(0));
+   HOST_CHECK(memcmp(g_host_flash + g_field[0].address, g_image, length) == 0);
+
+   // Its legacy config is converted if the log is limited to one sector
+   memset(&legacy, 0, sizeof(legacy));
+   legacy.magic = ZBOOT_LEGACY_CONFIG_MAGIC;
+   legacy.count = 2;
+   legacy.roms[0] = g_field[0].address;
+   legacy.roms[1] = g_field[1].address;
+   legacy.chksum = zboot_legacy_config_checksum(&legacy);
+   HOST_CHECK(convert_legacy_config(&legacy, &config, &partitions, HOST_FLASH_SIZE, 1));
+   HOST_CHECK(partitions.entry[0].address == g_field[0].address);
+   HOST_CHECK(!convert_legacy_config(&legacy, &config, &partitions, HOST_FLASH_SIZE, 2));
+
+   printf("Log size: ok\n");
+   return 0;
+}
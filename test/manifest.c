@@ -0,0 +1,127 @@
+/* \brief zboot - manifest update benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * An image of generated machine code (see host_make_code_image()) is running, and the
+ *  next release changes a few bytes in a handful of sectors. For each unit size, the
+ *  running slot's manifest is taken, the units whose hashes differ from the new image's
+ *  are downloaded and the rest are copied from the running slot with zboot_write_copy().
+ *  The manifest's host time and flash time, the bytes to download and the time to write
+ *  the new image are reported and compared with a full download. The hashes must match
+ *  zlib's crc32, and the flash must end up holding the new image exactly.
+ */
+#include <string.h>
+#include <zlib.h>
+#include "host.h"
+
+#define MANIFEST_IMAGE_SIZE 0x30000
+#define MANIFEST_PACKET     1460
+#define MANIFEST_ROUNDS     16
+#define MANIFEST_CHANGED    5       // Sectors changed, besides the header's and the checksum's
+
+static uint8_t g_old[MANIFEST_IMAGE_SIZE];
+static uint8_t g_new[MANIFEST_IMAGE_SIZE];
+static uint32_t g_hashes[MANIFEST_IMAGE_SIZE / SECTOR_SIZE];
+
+static void write_data(void *context, const uint8_t *data, uint32_t length)
+{
+   uint32_t position, piece;
+
+   for(position = 0; position < length; position += piece)
+   {
+      piece = (length - position < MANIFEST_PACKET) ? length - position : MANIFEST_PACKET;
+      HOST_CHECK(zboot_write_flash(context, data + position, piece));
+   }
+}
+
+// Update 'target' from 'source' with manifests of 'unit' bytes, or with the whole image if
+//  'unit' is 0
+static void run(uint32_t source, uint32_t target, uint32_t length, uint32_t unit)
+{
+   uint32_t units = unit ? (length + unit - 1) / unit : 0;
+   uint32_t idx, offset, piece, round, downloaded = 0;
+   uint64_t start, elapsed, manifest_us = 0;
+   void *context;
+
+   // The manifest the device sends, checked against the image it was written from
+   host_reset_counts();
+   start = host_wall_us();
+   for(round = 0; round < MANIFEST_ROUNDS && unit > 0; ++round)
+      HOST_CHECK(zboot_get_manifest(source, length, unit, g_hashes));
+   elapsed = host_wall_us() - start;
+   if(unit > 0)
+      manifest_us = g_host_counts.time_us / MANIFEST_ROUNDS;
+   for(idx = 0; idx < units; ++idx)
+   {
+      piece = (length - idx * unit < unit) ? length - idx * unit : unit;
+      HOST_CHECK(g_hashes[idx] == crc32(0, g_old + idx * unit, piece));
+   }
+
+   host_reset_counts();
+   context = zboot_write_init_ex(target, length, 0);
+   HOST_CHECK(NULL != context);
+   if(0 == unit)
+   {
+      write_data(context, g_new, length);
+      downloaded = length;
+   }
+   for(idx = 0; idx < units; ++idx)
+   {
+      offset = idx * unit;
+      piece = (length - offset < unit) ? length - offset : unit;
+      if(g_hashes[idx] == crc32(0, g_new + offset, piece))
+         HOST_CHECK(zboot_write_copy(context, source + offset, piece));
+      else
+      {
+         write_data(context, g_new + offset, piece);
+         downloaded += piece;
+      }
+   }
+   HOST_CHECK(zboot_write_end(context));
+   HOST_CHECK(memcmp(g_host_flash + target, g_new, length) == 0);
+
+   if(0 == unit)
+      printf("Whole image   : %6u bytes to download (%3u%%), %6.1f ms of flash time to write\n",
+         downloaded, 100, g_host_counts.time_us / 1000.0);
+   else
+      printf("%2u kB manifest: %6u bytes to download (%3u%%), %6.1f ms of flash time to write, manifest of %2u hashes in %5.0f us on the host and %5.1f ms of flash time\n",
+         unit / 1024, downloaded, (unsigned) ((uint64_t) downloaded * 100 / length),
+         g_host_counts.time_us / 1000.0, units, (double) elapsed / MANIFEST_ROUNDS,
+         manifest_us / 1000.0);
+   // Only the changed sectors, the header's and the checksum's are downloaded
+   HOST_CHECK(unit != SECTOR_SIZE || downloaded <= (MANIFEST_CHANGED + 2) * SECTOR_SIZE);
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot[2];
+   uint32_t length, idx, offset;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 0, &slot[0]));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot[1]));
+
+   // The running image is in the first slot; the new one changes two bytes in each of a
+   //  few sectors spread through it, and its header
+   length = host_make_code_image(g_old, sizeof(g_old), 1);
+   HOST_CHECK(host_write_image(slot[0].address, g_old, length, MANIFEST_PACKET));
+   memcpy(g_new, g_old, length);
+   for(idx = 1; idx <= MANIFEST_CHANGED; ++idx)
+   {
+      offset = (length / SECTOR_SIZE) * idx / (MANIFEST_CHANGED + 1) * SECTOR_SIZE + 0x100 * idx;
+      g_new[offset] ^= 0x01;
+      g_new[offset + 0x40] ^= 0x10;
+   }
+   ((zimage_header *) g_new)->version = 2;
+   host_image_checksum(g_new, length);
+
+   run(slot[0].address, slot[1].address, length, 0);
+   run(slot[0].address, slot[1].address, length, SECTOR_SIZE);
+   run(slot[0].address, slot[1].address, length, 4 * SECTOR_SIZE);
+   run(slot[0].address, slot[1].address, length, 16 * SECTOR_SIZE);
+
+   printf("Manifest: ok\n");
+   return 0;
+}
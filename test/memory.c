@@ -0,0 +1,90 @@
+/* \brief zboot - work buffer test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Once zboot_api_init_buffer() has been given a buffer, no operation may allocate memory,
+ *  even when the work buffer is held by an asynchronous write: here, a resumable,
+ *  asynchronous write that skips unchanged data erases sectors part way through, while
+ *  config updates compact the log and a second write stages unaligned data.
+ *
+ * zboot-api.c is built into this test, with its allocations counted.
+ */
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include "host.h"
+
+static uint32_t g_allocations;
+
+static void *memory_malloc(size_t size)
+{
+   ++g_allocations;
+   return malloc(size);
+}
+
+#define malloc memory_malloc
+#include "zboot-api.c"
+#undef malloc
+
+#define MEMORY_IMAGE_SIZE 0x6000
+
+static uint8_t g_image[MEMORY_IMAGE_SIZE];
+static uint8_t g_other[MEMORY_IMAGE_SIZE + 1];
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot[2];
+   zboot_write_info info;
+   zboot_segment segment;
+   uint32_t length, offset, update;
+   void *context, *other;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 0, &slot[0]));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot[1]));
+
+   // An image to rewrite, changed part way into its second sector
+   length = host_make_image(g_image, sizeof(g_image), 1, 1, 1);
+   HOST_CHECK(host_write_image(slot[1].address, g_image, length, 1024));
+   g_image[SECTOR_SIZE + 0x800] ^= 0xff;
+   g_image[length - 4] ^= 0xff;  // Checksum
+   g_allocations = 0;
+
+   context = zboot_write_resume(slot[1].address, length,
+      ZBOOT_WRITE_ASYNC | ZBOOT_WRITE_SKIP_UNCHANGED, 1, &offset);
+   HOST_CHECK(NULL != context && 0 == offset);
+   HOST_CHECK(NULL == zboot_write_init_ex(slot[0].address, 0, ZBOOT_WRITE_ASYNC));
+
+   // The second write gets unaligned data, so it's staged without the work buffer
+   other = zboot_write_init_ex(slot[0].address, 0, 0);
+   HOST_CHECK(NULL != other);
+   host_make_image(g_other + 1, MEMORY_IMAGE_SIZE, 2, 2, 2);
+
+   for(offset = 0, update = 0; offset < length; offset += segment.length, ++update)
+   {
+      segment.data = g_image + offset;
+      segment.length = (length - offset < 700) ? length - offset : 700;
+      HOST_CHECK(zboot_write_flashv(context, &segment, 1));
+      HOST_CHECK(zboot_write_poll(context, 100000));
+
+      segment.data = g_other + 1 + offset;
+      HOST_CHECK(zboot_write_flashv(other, &segment, 1));
+
+      // Enough config records to compact the log several times
+      HOST_CHECK(zboot_set_coldboot_index(update % 2));
+      HOST_CHECK(zboot_set_gpio_number(update));
+   }
+   HOST_CHECK(zboot_write_get_info(context, &info));
+   HOST_CHECK(zboot_write_end(context));
+   HOST_CHECK(zboot_write_end(other));
+
+   HOST_CHECK(info.sectors_skipped >= 1 && info.sectors_erased >= 1);
+   HOST_CHECK(memcmp(g_host_flash + slot[1].address, g_image, length) == 0);
+   HOST_CHECK(memcmp(g_host_flash + slot[0].address, g_other + 1, length) == 0);
+   HOST_CHECK(0 == g_allocations);
+
+   printf("Memory: ok\n");
+   return 0;
+}
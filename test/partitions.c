@@ -0,0 +1,65 @@
+/* \brief zboot - partition table replacement test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * zboot_set_partitions() must refuse while flash is being written or erased, and must not
+ *  remove the current or failsafe slot. The catalog must describe the new slots.
+ */
+#include <string.h>
+#include "host.h"
+
+#define PARTITIONS_IMAGE_SIZE 0x4000
+
+static const zboot_partition g_table[] =
+{
+   { ZBOOT_PARTITION_APP, 0, 0, 0x004000, 0x0fc000 },
+   { ZBOOT_PARTITION_APP, 0, 0, 0x104000, 0x0fc000 },
+   { ZBOOT_PARTITION_APP, 0, 0, 0x204000, 0x0fc000 },
+};
+
+static uint8_t g_image[PARTITIONS_IMAGE_SIZE];
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   uint32_t length, version, remaining;
+   void *context;
+   uint8_t index;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_set_partitions(g_table, 3));
+
+   // Nothing is replaced while a write or erase is in progress
+   context = zboot_write_init_ex(g_table[2].address, 0, 0);
+   HOST_CHECK(NULL != context);
+   HOST_CHECK(!zboot_set_partitions(g_table, 2));
+   HOST_CHECK(zboot_write_end(context));
+   HOST_CHECK(zboot_erase_start(g_table[2].address, 2 * SECTOR_SIZE));
+   HOST_CHECK(!zboot_set_partitions(g_table, 2));
+   while(zboot_erase_poll(0xffffffff, &remaining) && remaining > 0)
+      ;
+   length = host_make_image(g_image, sizeof(g_image), 9, 1, 1);
+   HOST_CHECK(host_write_image(g_table[2].address, g_image, length, 1024));
+
+   // Slot 2 can only be removed once neither the current nor the failsafe slot
+   HOST_CHECK(zboot_set_coldboot_index(2));
+   HOST_CHECK(!zboot_set_partitions(g_table, 2));
+   HOST_CHECK(zboot_set_coldboot_index(0));
+   HOST_CHECK(zboot_set_failsafe_index(2));
+   HOST_CHECK(!zboot_set_partitions(g_table, 2));
+   HOST_CHECK(zboot_begin_config_update());
+   HOST_CHECK(zboot_set_failsafe_index(0));
+   HOST_CHECK(!zboot_set_partitions(g_table, 2));  // The committed config still uses it
+   HOST_CHECK(zboot_commit_config_update());
+   HOST_CHECK(zboot_set_partitions(g_table, 2));
+   HOST_CHECK(zboot_get_image_count(&index) && index == 2);
+
+   // The catalog follows the slots' new addresses
+   HOST_CHECK(zboot_set_partitions(g_table + 1, 2));
+   HOST_CHECK(zboot_get_image_info(1, &version, NULL, NULL, NULL, 0) && version == 9);
+   HOST_CHECK(!zboot_get_image_info(0, &version, NULL, NULL, NULL, 0));
+
+   printf("Partitions: ok\n");
+   return 0;
+}
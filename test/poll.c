@@ -0,0 +1,131 @@
+/* \brief zboot - asynchronous write budget test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * zboot_write_poll() may go over its budget by at most one step, so with a budget shorter
+ *  than a sector erase, an erase must only ever be made by the first step of a poll: before
+ *  any other flash change, and before any data is consumed, even data that's skipped.
+ *  That includes the erases a ZBOOT_WRITE_SKIP_UNCHANGED write makes when it finds changed
+ *  data, and those made when saving a resumable write's progress compacts the config log.
+ *
+ * zboot-api.c is built into this test, with its flash writes and erases observed.
+ */
+#include <string.h>
+#include "host.h"
+
+#define spi_flash_write poll_flash_write
+#define spi_flash_erase_sector poll_flash_erase_sector
+#include "zboot-api.c"
+#undef spi_flash_write
+#undef spi_flash_erase_sector
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sec);
+SpiFlashOpResult spi_flash_write(uint32_t des_addr, uint32_t *src_addr, uint32_t size);
+
+#define POLL_IMAGE_SIZE 0x28000
+#define POLL_BUDGET_US  10000
+
+static uint8_t g_image[POLL_IMAGE_SIZE];
+static zboot_write_status *g_status;
+static bool g_in_poll;
+static uint32_t g_poll_addr;     // Write address when the current poll started
+static uint32_t g_changes;       // Flash writes and erases made by the current poll
+static uint32_t g_late_erases;   // Erases made after another step in the same poll
+static uint32_t g_log_erases;
+static bool g_erase_timed;
+
+SpiFlashOpResult poll_flash_write(uint32_t des_addr, uint32_t *src_addr, uint32_t size)
+{
+   if(g_in_poll)
+      ++g_changes;
+   return spi_flash_write(des_addr, src_addr, size);
+}
+
+SpiFlashOpResult poll_flash_erase_sector(uint16_t sec)
+{
+   if(g_in_poll)
+   {
+      // Until an erase has been timed, the API can't know it won't fit
+      if(g_erase_timed && (g_changes > 0 || g_status->start_addr != g_poll_addr))
+         ++g_late_erases;
+      ++g_changes;
+      if(sec >= BOOT_CONFIG_SECTOR && sec < BOOT_CONFIG_SECTOR + BOOT_CONFIG_SECTOR_COUNT)
+         ++g_log_erases;
+   }
+   return spi_flash_erase_sector(sec);
+}
+
+static void poll(void *context, uint32_t *polls, uint64_t *longest)
+{
+   uint64_t start = g_host_counts.time_us;
+   uint32_t erases = g_host_counts.erases;
+
+   g_in_poll = true;
+   g_poll_addr = g_status->start_addr;
+   g_changes = 0;
+   HOST_CHECK(zboot_write_poll(context, POLL_BUDGET_US));
+   g_in_poll = false;
+   if(g_host_counts.erases > erases)
+      g_erase_timed = true;
+   else if(g_host_counts.time_us - start > *longest)
+      *longest = g_host_counts.time_us - start;
+   ++*polls;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   static const uint32_t changed[] = { 3, 10, 11, 25 };  // Sectors that differ
+   zboot_write_info info;
+   zboot_partition slot;
+   zboot_segment segment;
+   uint32_t length, offset, idx, polls = 0;
+   uint64_t longest = 0;
+   void *context;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+   length = host_make_image(g_image, sizeof(g_image), 1, 1, 1);
+   HOST_CHECK(host_write_image(slot.address, g_image, length, 1024));
+   for(idx = 0; idx < sizeof(changed) / sizeof(changed[0]); ++idx)
+      g_image[changed[idx] * SECTOR_SIZE + 0x234] ^= 0x5a;
+
+   context = zboot_write_resume(slot.address, length,
+      ZBOOT_WRITE_ASYNC | ZBOOT_WRITE_SKIP_UNCHANGED, 1, &offset);
+   HOST_CHECK(NULL != context && 0 == offset);
+   g_status = (zboot_write_status *) context;
+
+   // Leave the log too full for both of the write's progress records, so one compacts it
+   for(idx = 0; !zboot_log_needs_compact(zboot_get_log(), 2 * sizeof(zboot_write_progress)); ++idx)
+      HOST_CHECK(zboot_set_gpio_number(idx));
+   host_reset_counts();
+
+   // Only queue what fits, so that all the work is done by polls
+   for(offset = 0; offset < length; offset += segment.length)
+   {
+      segment.data = g_image + offset;
+      segment.length = g_status->queue_size - g_status->queued;
+      if(segment.length > 1460)
+         segment.length = 1460;
+      if(segment.length > length - offset)
+         segment.length = length - offset;
+      HOST_CHECK(zboot_write_flashv(context, &segment, 1));
+      poll(context, &polls, &longest);
+   }
+   while(zboot_write_has_work(g_status))
+      poll(context, &polls, &longest);
+   HOST_CHECK(zboot_write_get_info(context, &info));
+   HOST_CHECK(zboot_write_end(context));
+
+   printf("Poll: %u polls of %u us, longest without an erase %llu us, %u log compactions\n",
+      polls, POLL_BUDGET_US, (unsigned long long) longest, g_log_erases);
+   HOST_CHECK(memcmp(g_host_flash + slot.address, g_image, length) == 0);
+   HOST_CHECK(info.sectors_erased == sizeof(changed) / sizeof(changed[0]));
+   HOST_CHECK(g_log_erases >= 1);
+   HOST_CHECK(0 == g_late_erases);
+   HOST_CHECK(longest <= POLL_BUDGET_US + 1000);
+
+   printf("Poll: ok\n");
+   return 0;
+}
@@ -0,0 +1,113 @@
+/* \brief zboot - image write ring buffer test and benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * An image is put into rings of one and two sectors in packet-sized pieces, so that both
+ *  the data and the drained writes cross the end of the buffer many times, and must reach
+ *  flash intact. The second run has a producer thread racing the consumer. The number of
+ *  flash write calls and the simulated flash time are reported for each ring size.
+ */
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "host.h"
+#include "zboot-ring.h"
+
+#define RING_IMAGE_SIZE 0x23456
+
+static uint8_t g_image[RING_IMAGE_SIZE];
+static uint32_t g_ring_buffer[2 * SECTOR_SIZE / sizeof(uint32_t)];
+static uint32_t g_length;
+
+// Packet sizes that don't divide the sector size
+static uint32_t packet_size(uint32_t count)
+{
+   static const uint32_t sizes[] = { 1460, 537, 4096, 3, 2900, 1 };
+   return sizes[count % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+static void *producer(void *arg)
+{
+   zboot_ring *ring = (zboot_ring *) arg;
+   uint32_t offset, piece, count;
+
+   for(offset = 0, count = 0; offset < g_length; offset += piece, ++count)
+   {
+      piece = packet_size(count);
+      if(piece > g_length - offset)
+         piece = g_length - offset;
+      piece = zboot_ring_put(ring, g_image + offset, piece);
+      if(0 == piece)
+         sched_yield();
+   }
+   return NULL;
+}
+
+static void run(uint32_t slot_addr, uint32_t size, bool threaded)
+{
+   zboot_ring ring;
+   pthread_t thread;
+   void *context;
+   uint32_t offset, piece, count;
+
+   memset(g_host_flash + slot_addr, 0xff, RING_IMAGE_SIZE + SECTOR_SIZE);
+   host_reset_counts();
+   context = zboot_write_init_ex(slot_addr, g_length, 0);
+   HOST_CHECK(NULL != context);
+   HOST_CHECK(zboot_ring_init(&ring, context, (uint8_t *) g_ring_buffer, size));
+
+   if(threaded)
+   {
+      HOST_CHECK(pthread_create(&thread, NULL, producer, &ring) == 0);
+      while(ring.stats.bytes_in < g_length)
+      {
+         HOST_CHECK(zboot_ring_drain(&ring, false));
+         sched_yield();
+      }
+      pthread_join(thread, NULL);
+   }
+   else
+   {
+      // Drain only when the ring is full, so each drain starts wherever the last one stopped
+      for(offset = 0, count = 0; offset < g_length; offset += piece, ++count)
+      {
+         piece = packet_size(count);
+         if(piece > g_length - offset)
+            piece = g_length - offset;
+         piece = zboot_ring_put(&ring, g_image + offset, piece);
+         if(0 == zboot_ring_space(&ring))
+            HOST_CHECK(zboot_ring_drain(&ring, false));
+      }
+   }
+   HOST_CHECK(zboot_ring_drain(&ring, true));
+   HOST_CHECK(0 == zboot_ring_used(&ring));
+   HOST_CHECK(zboot_write_end(context));
+
+   HOST_CHECK(ring.stats.bytes_in == g_length && ring.stats.bytes_out == g_length);
+   HOST_CHECK(ring.stats.writes >= g_length / SECTOR_SIZE);
+   HOST_CHECK(memcmp(g_host_flash + slot_addr, g_image, g_length) == 0);
+   HOST_CHECK(zboot_verify_image(slot_addr, NULL, NULL));
+
+   printf("%s ring of %5u bytes: %u bytes, %u drain writes, %u stalls, %u flash writes, %llu ms flash time\n",
+      threaded ? "Threaded" : "Single  ", size, g_length, ring.stats.writes, ring.stats.stalls,
+      g_host_counts.writes, (unsigned long long) g_host_counts.time_us / 1000);
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+   g_length = host_make_image(g_image, sizeof(g_image), 1, 1, 1);
+
+   run(slot.address, SECTOR_SIZE, false);
+   run(slot.address, 2 * SECTOR_SIZE, false);
+   run(slot.address, SECTOR_SIZE, true);
+   run(slot.address, 2 * SECTOR_SIZE, true);
+
+   printf("Ring: ok\n");
+   return 0;
+}
@@ -0,0 +1,63 @@
+/* \brief zboot - sparse write benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * A 64kB image padded to 256kB is written, with 0xff padding as a padded image or a
+ *  sparse data partition holds it, and with zero padding, which has to be programmed. The
+ *  page programs, those left out and the time spent programming and erasing are
+ *  reported; every page of 0xff padding must be left out.
+ */
+#include <string.h>
+#include "host.h"
+
+#define SPARSE_IMAGE_SIZE  0x10000
+#define SPARSE_PADDED_SIZE 0x40000
+#define SPARSE_PACKET      1460
+
+static uint8_t g_image[SPARSE_PADDED_SIZE];
+
+// Returns the page programs left out
+static uint32_t run(uint32_t address, uint8_t padding)
+{
+   zboot_write_info info;
+   uint32_t length, position, piece;
+   void *context;
+
+   memset(g_image, padding, sizeof(g_image));
+   length = host_make_image(g_image, SPARSE_IMAGE_SIZE, 1, 1, 1);
+
+   host_reset_counts();
+   context = zboot_write_init_ex(address, sizeof(g_image), 0);
+   HOST_CHECK(NULL != context);
+   for(position = 0; position < sizeof(g_image); position += piece)
+   {
+      piece = (sizeof(g_image) - position < SPARSE_PACKET) ? sizeof(g_image) - position : SPARSE_PACKET;
+      HOST_CHECK(zboot_write_flash(context, g_image + position, piece));
+   }
+   HOST_CHECK(zboot_write_get_info(context, &info));
+   HOST_CHECK(zboot_write_end(context));
+   HOST_CHECK(memcmp(g_host_flash + address, g_image, sizeof(g_image)) == 0);
+
+   printf("Image of %5u bytes with %s padding: %5u flash writes, %5u page programs, %5u left out, %6.1f ms programming, %6.1f ms erasing\n",
+      length, padding ? "0xff" : "zero", g_host_counts.writes, g_host_counts.pages,
+      info.pages_skipped, (g_host_counts.time_us - g_host_counts.erases * HOST_ERASE_US
+         - g_host_counts.block_erases * HOST_BLOCK_ERASE_US) / 1000.0,
+      (g_host_counts.erases * HOST_ERASE_US + g_host_counts.block_erases * HOST_BLOCK_ERASE_US) / 1000.0);
+   return info.pages_skipped;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+
+   HOST_CHECK(0 == run(slot.address, 0));
+   HOST_CHECK(run(slot.address, 0xff) >= (SPARSE_PADDED_SIZE - SPARSE_IMAGE_SIZE) / 256);
+
+   printf("Sparse: ok\n");
+   return 0;
+}
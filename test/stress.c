@@ -0,0 +1,225 @@
+/* \brief zboot - concurrency stress test and benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Reader threads take snapshots of the config and partition table while a writer
+ *  replaces them and writes images. Every snapshot must match a state the writer
+ *  published: a config whose checksum is valid and whose current and failsafe slots are
+ *  equal, since the writer always changes both in one update, and partition entries
+ *  identical to an entry of one of the two tables the writer alternates between.
+ *
+ * zboot-api.c is built into this test, so readers can take whole-config snapshots with
+ *  zboot_get_config(). In the first run, its copies are made a byte at a time, yielding
+ *  part way through, so that readers and the writer interleave within a copy even on a
+ *  single CPU. The throughput of lock-free reads is then measured with plain copies, and
+ *  compared with readers that take the API lock.
+ */
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "host.h"
+
+static bool g_interleave;
+
+static void *stress_memcpy(void *dest, const void *src, size_t length)
+{
+   static volatile uint32_t calls;
+   size_t i;
+
+   if(!g_interleave)
+      return memcpy(dest, src, length);
+   for(i = 0; i < length; ++i)
+   {
+      ((volatile uint8_t *) dest)[i] = ((const volatile uint8_t *) src)[i];
+      if(i == length / 2 && (++calls % 16) == 0)
+         sched_yield();
+   }
+   return dest;
+}
+
+#define memcpy stress_memcpy
+#include "zboot-api.c"
+#undef memcpy
+
+#define STRESS_READERS        4
+#define STRESS_UPDATES        100000  // Config updates made by the writer
+#define STRESS_TABLE_EVERY    8      // Updates between partition table changes
+#define STRESS_IMAGE_EVERY    5000   // Updates between image writes
+#define STRESS_IMAGE_SIZE     0x10000
+#define STRESS_SLOTS          4
+#define STRESS_ENTRIES        6
+
+#define STRESS_VERSION        0x01020304
+#define STRESS_DATE           0x20181231
+
+static const zboot_partition g_tables[2][STRESS_ENTRIES] =
+{
+   {
+      { ZBOOT_PARTITION_APP,        0, 0x000, 0x004000, 0x0fc000 },
+      { ZBOOT_PARTITION_APP,        0, 0x001, 0x104000, 0x0fc000 },
+      { ZBOOT_PARTITION_APP,        0, 0x002, 0x204000, 0x0fc000 },
+      { ZBOOT_PARTITION_APP,        0, 0x003, 0x304000, 0x0bc000 },
+      { ZBOOT_PARTITION_FILESYSTEM, 0, 0x004, 0x3c0000, 0x030000 },
+   },
+   {
+      { ZBOOT_PARTITION_APP,        1, 0x100, 0x004000, 0x07c000 },
+      { ZBOOT_PARTITION_APP,        1, 0x101, 0x104000, 0x07c000 },
+      { ZBOOT_PARTITION_APP,        1, 0x102, 0x204000, 0x07c000 },
+      { ZBOOT_PARTITION_APP,        1, 0x103, 0x304000, 0x07c000 },
+      { ZBOOT_PARTITION_FILESYSTEM, 1, 0x104, 0x384000, 0x040000 },
+      { ZBOOT_PARTITION_DATA,       1, 0x105, 0x3c4000, 0x010000 },
+   },
+};
+static const uint8_t g_table_count[2] = { 5, 6 };
+
+static pthread_barrier_t g_start;
+static volatile bool g_stop;
+static bool g_locked;
+static uint64_t g_config_reads, g_partition_reads, g_image_reads;
+static uint8_t g_image[STRESS_IMAGE_SIZE];
+
+static void check_config(const zboot_config *config)
+{
+   HOST_CHECK(config->magic == ZBOOT_CONFIG_MAGIC);
+   HOST_CHECK(config->chksum == zboot_config_checksum(config));
+   HOST_CHECK(config->current_rom == config->failsafe_rom);
+   HOST_CHECK(config->current_rom < STRESS_SLOTS);
+}
+
+static void check_partition(uint8_t index, const zboot_partition *partition)
+{
+   uint8_t table;
+
+   for(table = 0; table < 2; ++table)
+      if(index < g_table_count[table]
+      && memcmp(partition, &g_tables[table][index], sizeof(*partition)) == 0)
+         return;
+   HOST_CHECK(!"partition entry matches neither table");
+}
+
+static void *reader(void *arg)
+{
+   uint64_t configs = 0, partitions = 0, images = 0;
+   zboot_partition partition;
+   zboot_config config;
+   uint32_t version, date;
+   uint8_t index;
+
+   pthread_barrier_wait(&g_start);
+   while(!g_stop)
+   {
+      if(g_locked)
+      {
+         ZBOOT_LOCK();
+         HOST_CHECK(zboot_read_config(&config));
+         ZBOOT_UNLOCK();
+      }
+      else
+         HOST_CHECK(zboot_get_config(&config));
+      check_config(&config);
+      ++configs;
+
+      for(index = 0; index < STRESS_ENTRIES; ++index)
+      {
+         bool found;
+
+         if(g_locked)
+         {
+            ZBOOT_LOCK();
+            found = zboot_read_partition(ZBOOT_PARTITION_ALL, index, &partition, NULL);
+            ZBOOT_UNLOCK();
+         }
+         else
+            found = zboot_get_partition(index, &partition);
+         if(found)
+            check_partition(index, &partition);
+         else
+            HOST_CHECK(index >= g_table_count[0]);
+         ++partitions;
+      }
+
+      // Slot 1 is never rewritten
+      if(zboot_get_image_info(1, &version, &date, NULL, NULL, 0))
+      {
+         HOST_CHECK(version == STRESS_VERSION && date == STRESS_DATE);
+         ++images;
+      }
+   }
+
+   __sync_fetch_and_add(&g_config_reads, configs);
+   __sync_fetch_and_add(&g_partition_reads, partitions);
+   __sync_fetch_and_add(&g_image_reads, images);
+   return NULL;
+}
+
+static void run(bool interleave, bool locked)
+{
+   pthread_t threads[STRESS_READERS];
+   uint32_t update, tables = 0, images = 0, length;
+   uint64_t start, elapsed;
+   uint8_t idx;
+
+   g_interleave = interleave;
+   g_locked = locked;
+   g_stop = false;
+   g_config_reads = g_partition_reads = g_image_reads = 0;
+   HOST_CHECK(pthread_barrier_init(&g_start, NULL, STRESS_READERS + 1) == 0);
+   for(idx = 0; idx < STRESS_READERS; ++idx)
+      HOST_CHECK(pthread_create(&threads[idx], NULL, reader, NULL) == 0);
+   pthread_barrier_wait(&g_start);
+
+   start = host_wall_us();
+   for(update = 0; update < STRESS_UPDATES; ++update)
+   {
+      uint8_t slot = update % STRESS_SLOTS;
+
+      HOST_CHECK(zboot_begin_config_update());
+      HOST_CHECK(zboot_set_coldboot_index(slot));
+      HOST_CHECK(zboot_set_failsafe_index(slot));
+      HOST_CHECK(zboot_commit_config_update());
+
+      if((update % STRESS_TABLE_EVERY) == 0)
+      {
+         HOST_CHECK(zboot_set_partitions(g_tables[tables % 2], g_table_count[tables % 2]));
+         ++tables;
+      }
+      if((update % STRESS_IMAGE_EVERY) == 0)
+      {
+         length = host_make_image(g_image, sizeof(g_image), update, update, update + 1);
+         HOST_CHECK(host_write_image(g_tables[0][2 + images % 2].address, g_image, length, 1460));
+         ++images;
+      }
+   }
+   elapsed = host_wall_us() - start;
+
+   g_stop = true;
+   for(idx = 0; idx < STRESS_READERS; ++idx)
+      pthread_join(threads[idx], NULL);
+   pthread_barrier_destroy(&g_start);
+   g_interleave = false;
+
+   printf("%s readers: %u updates, %u tables, %u images in %llu ms\n",
+      interleave ? "Interleaved lock-free" : (locked ? "Locked" : "Lock-free"), STRESS_UPDATES, tables, images,
+      (unsigned long long) elapsed / 1000);
+   printf("   writer:      %8.0f config updates/s\n", STRESS_UPDATES * 1e6 / elapsed);
+   printf("   readers:     %8.0f config reads/s, %8.0f partition reads/s, %8.0f image reads/s\n",
+      g_config_reads * 1e6 / elapsed, g_partition_reads * 1e6 / elapsed,
+      g_image_reads * 1e6 / elapsed);
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   uint32_t length;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_set_partitions(g_tables[0], g_table_count[0]));
+   length = host_make_image(g_image, sizeof(g_image), STRESS_VERSION, STRESS_DATE, 1);
+   HOST_CHECK(host_write_image(g_tables[0][1].address, g_image, length, 1460));
+
+   run(true, false);
+   run(false, false);
+   run(false, true);
+   return 0;
+}
@@ -0,0 +1,67 @@
+/* \brief zboot - config update ownership test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * A config update belongs to the thread that began it. While it's open, another thread's
+ *  set operations, and its attempts to begin, commit or abort an update, must fail without
+ *  touching the pending changes, and its get operations must return the committed config.
+ */
+#include <string.h>
+#include <pthread.h>
+#include "host.h"
+
+static void *other_thread(void *arg)
+{
+   uint8_t index;
+
+   (void) arg;
+   HOST_CHECK(zboot_get_coldboot_index(&index) && index == 0);
+   HOST_CHECK(!zboot_set_coldboot_index(0));
+   HOST_CHECK(!zboot_set_failsafe_index(0));
+   HOST_CHECK(!zboot_erase_config());
+   HOST_CHECK(!zboot_begin_config_update());
+   HOST_CHECK(!zboot_commit_config_update());
+   zboot_abort_config_update();
+   return NULL;
+}
+
+static void *begin_thread(void *arg)
+{
+   (void) arg;
+   HOST_CHECK(zboot_begin_config_update());
+   return NULL;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   pthread_t thread;
+   uint32_t writes;
+   uint8_t index;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_get_coldboot_index(&index) && index == 0);
+
+   HOST_CHECK(zboot_begin_config_update());
+   HOST_CHECK(zboot_set_coldboot_index(1));
+   writes = g_host_counts.writes + g_host_counts.erases;
+   HOST_CHECK(pthread_create(&thread, NULL, other_thread, NULL) == 0);
+   HOST_CHECK(pthread_join(thread, NULL) == 0);
+   HOST_CHECK(writes == g_host_counts.writes + g_host_counts.erases);
+
+   // The owner's update is intact
+   HOST_CHECK(zboot_set_failsafe_index(1));
+   HOST_CHECK(zboot_commit_config_update());
+   HOST_CHECK(zboot_get_coldboot_index(&index) && index == 1);
+   HOST_CHECK(zboot_get_failsafe_index(&index) && index == 1);
+
+   // Once it's committed, another thread can begin an update, which this one can't change
+   HOST_CHECK(pthread_create(&thread, NULL, begin_thread, NULL) == 0);
+   HOST_CHECK(pthread_join(thread, NULL) == 0);
+   HOST_CHECK(!zboot_set_coldboot_index(0));
+   HOST_CHECK(zboot_get_coldboot_index(&index) && index == 1);
+
+   printf("Transaction: ok\n");
+   return 0;
+}
@@ -0,0 +1,103 @@
+/* \brief zboot - vectored write benchmark
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * An image arrives as TCP segments, each a chain of three buffers, as a network stack's
+ *  pbufs would hold it. Flattening each chain into a packet buffer for zboot_write_flash()
+ *  is compared with passing the chain to zboot_write_flashv(), with the buffers' payload
+ *  both word-aligned and not. Host time, flash writes, page programs and the RAM each needs
+ *  are reported, and the chains must take no more page programs than the flattened data.
+ */
+#include <string.h>
+#include "host.h"
+
+#define VECTORED_IMAGE_SIZE 0x40000
+#define VECTORED_PACKET     1460
+#define VECTORED_PIECES     3
+#define VECTORED_ROUNDS     8
+
+static uint8_t g_image[VECTORED_IMAGE_SIZE];
+static uint8_t g_pbufs[VECTORED_PIECES][VECTORED_PACKET + 8] __attribute__((aligned(4)));
+
+// Copy the next packet into the chain's buffers, at 'offset' bytes into each
+static uint16_t chain(uint32_t position, uint32_t length, uint32_t offset, zboot_segment *segments)
+{
+   static const uint16_t sizes[VECTORED_PIECES] = { 512, 512, VECTORED_PACKET - 1024 };
+   uint16_t idx, count = 0;
+
+   for(idx = 0; idx < VECTORED_PIECES && length > 0; ++idx, ++count)
+   {
+      segments[idx].length = (length < sizes[idx]) ? length : sizes[idx];
+      segments[idx].data = g_pbufs[idx] + offset;
+      memcpy(g_pbufs[idx] + offset, g_image + position, segments[idx].length);
+      position += segments[idx].length;
+      length -= segments[idx].length;
+   }
+   return count;
+}
+
+// Returns the page programs per image
+static uint32_t run(uint32_t address, uint32_t length, uint32_t offset, bool vectored)
+{
+   static uint32_t packet[VECTORED_PACKET / sizeof(uint32_t) + 1];
+   zboot_segment segments[VECTORED_PIECES];
+   uint32_t position, piece, total, round;
+   uint64_t start, elapsed = 0;
+   uint16_t count, idx;
+   void *context;
+
+   host_reset_counts();
+   for(round = 0; round < VECTORED_ROUNDS; ++round)
+   {
+      context = zboot_write_init_ex(address, length, 0);
+      HOST_CHECK(NULL != context);
+      for(position = 0; position < length; position += piece)
+      {
+         piece = (length - position < VECTORED_PACKET) ? length - position : VECTORED_PACKET;
+         count = chain(position, piece, offset, segments);
+
+         start = host_wall_us();
+         if(vectored)
+            HOST_CHECK(zboot_write_flashv(context, segments, count));
+         else
+         {
+            for(idx = 0, total = 0; idx < count; total += segments[idx++].length)
+               memcpy((uint8_t *) packet + total, segments[idx].data, segments[idx].length);
+            HOST_CHECK(zboot_write_flash(context, (const uint8_t *) packet, total));
+         }
+         elapsed += host_wall_us() - start;
+      }
+      HOST_CHECK(zboot_write_end(context));
+      HOST_CHECK(memcmp(g_host_flash + address, g_image, length) == 0);
+   }
+
+   printf("%s, %s buffers: %6.0f us per image on the host, %5u flash writes, %5u page programs, %5.1f ms of flash time, %5u bytes of packet buffer\n",
+      vectored ? "Vectored " : "Flattened", offset ? "unaligned" : "aligned  ",
+      (double) elapsed / VECTORED_ROUNDS, g_host_counts.writes / VECTORED_ROUNDS,
+      g_host_counts.pages / VECTORED_ROUNDS, g_host_counts.time_us / 1000.0 / VECTORED_ROUNDS,
+      vectored ? 0 : (unsigned) sizeof(packet));
+   return g_host_counts.pages / VECTORED_ROUNDS;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+   uint32_t length, flattened, vectored;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+   length = host_make_image(g_image, sizeof(g_image), 1, 1, 1);
+
+   // Segments mustn't cost page programs that flattening them would save
+   flattened = run(slot.address, length, 0, false);
+   vectored = run(slot.address, length, 0, true);
+   HOST_CHECK(vectored <= flattened + flattened / 100);
+   flattened = run(slot.address, length, 2, false);
+   vectored = run(slot.address, length, 2, true);
+   HOST_CHECK(vectored <= flattened + flattened / 100);
+
+   printf("Vectored: ok\n");
+   return 0;
+}
@@ -0,0 +1,66 @@
+/* \brief zboot - image verification test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * zboot_verify_image() must reject whatever the bootloader's check_image() rejects, even
+ *  when the image's checksum is valid: an entry point outside IRAM and flash, an image
+ *  marked invalid, and flash-mapped code linked for another offset in the flash window.
+ */
+#include <string.h>
+#include "host.h"
+
+#define VERIFY_IMAGE_SIZE 0x3000
+
+static uint8_t g_image[VERIFY_IMAGE_SIZE];
+
+// Change a header word, keeping the checksum valid
+static void set_header(uint32_t length, uint32_t offset, uint32_t value)
+{
+   uint32_t *words = (uint32_t *) g_image;
+   uint32_t *chksum = (uint32_t *) (g_image + length - sizeof(uint32_t));
+
+   *chksum += value - words[offset];
+   words[offset] = value;
+}
+
+static bool write_and_verify(uint32_t address, uint32_t length)
+{
+   HOST_CHECK(host_write_image(address, g_image, length, 1024));
+   return zboot_verify_image(address, NULL, NULL);
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   zboot_partition slot;
+   uint32_t length, state = ZIMAGE_STATE_INVALID;
+
+   host_setup();
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+   HOST_CHECK(zboot_find_partition(ZBOOT_PARTITION_APP, 1, &slot));
+   length = host_make_image(g_image, sizeof(g_image), 1, 1, 1);
+   HOST_CHECK(write_and_verify(slot.address, length));
+
+   // Marked invalid
+   memcpy(g_host_flash + slot.address + ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t), &state,
+      sizeof(state));
+   HOST_CHECK(!zboot_verify_image(slot.address, NULL, NULL));
+
+   // Entry points outside IRAM and flash-mapped code
+   set_header(length, ZIMAGE_HEADER_OFFSET_ENTRY, 0x3ffe8000);
+   HOST_CHECK(!write_and_verify(slot.address, length));
+   set_header(length, ZIMAGE_HEADER_OFFSET_ENTRY, 0x40300000);
+   HOST_CHECK(!write_and_verify(slot.address, length));
+   set_header(length, ZIMAGE_HEADER_OFFSET_ENTRY, 0x40210000);
+   HOST_CHECK(write_and_verify(slot.address, length));
+
+   // Flash-mapped code only runs at the offset it was linked for
+   set_header(length, ZIMAGE_HEADER_OFFSET_FLAGS, ZIMAGE_FLAG_LINK_OFFSET);
+   set_header(length, ZIMAGE_HEADER_OFFSET_LINK, (slot.address + SECTOR_SIZE) % ZBOOT_FLASH_WINDOW_SIZE);
+   HOST_CHECK(!write_and_verify(slot.address, length));
+   set_header(length, ZIMAGE_HEADER_OFFSET_LINK, slot.address % ZBOOT_FLASH_WINDOW_SIZE);
+   HOST_CHECK(write_and_verify(slot.address, length));
+
+   printf("Verify: ok\n");
+   return 0;
+}
@@ -0,0 +1,84 @@
+/* \brief zboot - wear-aware slot selection test
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Built with wear tracking and a small ZBOOT_WEAR_THRESHOLD. zboot_find_best_write_index()
+ *  must prefer the slot with the oldest image, or an empty slot, until it has been erased
+ *  more than the threshold beyond the least-worn slot, and then pass over it.
+ */
+#include <string.h>
+#include "host.h"
+
+#if !defined(BOOT_WEAR_ENABLED) || ZBOOT_WEAR_THRESHOLD != 4
+#error Build with BOOT_WEAR_ENABLED and ZBOOT_WEAR_THRESHOLD=4
+#endif
+
+#define WEAR_IMAGE_SIZE 0x8000
+#define WEAR_SLOT_SIZE  ZBOOT_WEAR_REGION_SIZE
+
+static const zboot_partition g_slots[] =
+{
+   { ZBOOT_PARTITION_APP, 0, 0, 1 * WEAR_SLOT_SIZE, WEAR_SLOT_SIZE },
+   { ZBOOT_PARTITION_APP, 0, 0, 2 * WEAR_SLOT_SIZE, WEAR_SLOT_SIZE },
+   { ZBOOT_PARTITION_APP, 0, 0, 3 * WEAR_SLOT_SIZE, WEAR_SLOT_SIZE },
+   { ZBOOT_PARTITION_APP, 0, 0, 4 * WEAR_SLOT_SIZE, WEAR_SLOT_SIZE },
+};
+
+static uint8_t g_image[WEAR_IMAGE_SIZE];
+
+// Add erase cycles to a slot by erasing its last sector, which the image doesn't reach
+static void wear(uint8_t index, uint32_t cycles)
+{
+   uint32_t sector = g_slots[index].address + g_slots[index].size - SECTOR_SIZE;
+   uint32_t erases, remaining;
+
+   for(erases = 0; erases < cycles * (ZBOOT_WEAR_REGION_SIZE / SECTOR_SIZE); ++erases)
+   {
+      HOST_CHECK(zboot_erase_start(sector, SECTOR_SIZE));
+      while(zboot_erase_poll(0xffffffff, &remaining) && remaining > 0)
+         ;
+   }
+   HOST_CHECK(zboot_rebuild_catalog());
+}
+
+static uint8_t best(void)
+{
+   uint8_t index;
+
+   HOST_CHECK(zboot_find_best_write_index(&index, true));
+   return index;
+}
+
+int main(void)
+{
+   static uint32_t buffer[ZBOOT_API_BUFFER_SIZE / sizeof(uint32_t)];
+   uint32_t length, cycles;
+   uint8_t idx;
+
+   host_setup_partitions(g_slots, 4);
+   HOST_CHECK(zboot_api_init_buffer(buffer, sizeof(buffer)));
+
+   // The first slot is running; the others hold images, oldest first
+   for(idx = 1; idx < 4; ++idx)
+   {
+      length = host_make_image(g_image, sizeof(g_image), idx, idx, idx);
+      HOST_CHECK(host_write_image(g_slots[idx].address, g_image, length, 1024));
+   }
+   HOST_CHECK(best() == 1);
+
+   // The oldest image's slot is chosen while it's within the threshold
+   wear(1, ZBOOT_WEAR_THRESHOLD);
+   HOST_CHECK(zboot_get_image_wear(1, &cycles) && cycles == ZBOOT_WEAR_THRESHOLD + 1);
+   HOST_CHECK(best() == 1);
+   wear(1, 1);
+   HOST_CHECK(best() == 2);
+
+   // So is an empty slot
+   HOST_CHECK(zboot_invalidate_index(3));
+   HOST_CHECK(best() == 3);
+   wear(3, ZBOOT_WEAR_THRESHOLD + 1);
+   HOST_CHECK(best() == 2);
+
+   printf("Wear: ok\n");
+   return 0;
+}
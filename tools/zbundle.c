@@ -0,0 +1,226 @@
+/* \brief zbundle - pack images and data into a single zboot update bundle
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * The bundle is written on the device by appcode/zboot-bundle.c; see zbundle_header in
+ *  zboot.h for the format. Each member is given as type[:index][:boot]=file, where type
+ *  is a partition type name or number, and index selects a partition of that type.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "zboot.h"
+#include "zboot_private.h"
+#include "zboot_util.h"
+
+static const struct
+{
+   const char *name;
+   uint8_t type;
+} partition_types[] =
+{
+   { "app",         ZBOOT_PARTITION_APP },
+   { "fs",          ZBOOT_PARTITION_FILESYSTEM },
+   { "calibration", ZBOOT_PARTITION_CALIBRATION },
+   { "log",         ZBOOT_PARTITION_LOG },
+   { "data",        ZBOOT_PARTITION_DATA },
+};
+
+static void usage(const char *name)
+{
+   fprintf(stderr, "Usage: %s bundle.bin type[:index][:boot]=file ...\n", name);
+   fprintf(stderr, "  type is app, fs, calibration, log, data or a partition type number\n");
+   fprintf(stderr, "  index defaults to the best slot for app, and a spare partition otherwise;\n");
+   fprintf(stderr, "  the device won't write to the running slot or the active data partition\n");
+   fprintf(stderr, "  boot marks the application image to boot once the bundle is written\n");
+}
+
+static uint8_t *read_file(const char *filename, uint32_t *length)
+{
+   uint8_t *data;
+   long size;
+   FILE *f;
+
+   f = fopen(filename, "rb");
+   if(NULL == f)
+   {
+      fprintf(stderr, "Failed to open '%s'\n", filename);
+      return NULL;
+   }
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+   rewind(f);
+   data = malloc(size + sizeof(uint32_t));
+   if(NULL == data || fread(data, 1, size, f) != (size_t) size)
+   {
+      fprintf(stderr, "Failed to read '%s'\n", filename);
+      free(data);
+      data = NULL;
+   }
+   else
+   {
+      memset(data + size, 0, sizeof(uint32_t));  // Padding, written after the data
+      *length = size;
+   }
+   fclose(f);
+   return data;
+}
+
+// Parse type[:index][:boot], returning the file name that follows it
+static const char *parse_member(char *arg, zbundle_member *member)
+{
+   char *file, *field, *end;
+   unsigned long value;
+   uint32_t i;
+
+   file = strchr(arg, '=');
+   if(NULL == file)
+      return NULL;
+   *file++ = '\0';
+
+   memset(member, 0, sizeof(*member));
+   field = strtok(arg, ":");
+   if(NULL == field)
+      return NULL;
+   for(i = 0; i < sizeof(partition_types) / sizeof(partition_types[0]); ++i)
+      if(strcmp(field, partition_types[i].name) == 0)
+         break;
+   if(i < sizeof(partition_types) / sizeof(partition_types[0]))
+      member->type = partition_types[i].type;
+   else
+   {
+      value = strtoul(field, &end, 0);
+      if(*end != '\0' || value >= ZBOOT_PARTITION_TYPES)
+         return NULL;
+      member->type = value;
+   }
+   member->index = ZBUNDLE_INDEX_ANY;
+
+   while(NULL != (field = strtok(NULL, ":")))
+   {
+      if(strcmp(field, "boot") == 0)
+      {
+         if(member->type != ZBOOT_PARTITION_APP)
+            return NULL;
+         member->flags |= ZBUNDLE_FLAG_BOOT;
+         continue;
+      }
+      value = strtoul(field, &end, 0);
+      if(*end != '\0' || value >= ZBUNDLE_INDEX_ANY)
+         return NULL;
+      member->index = value;
+   }
+   return file;
+}
+
+// An application image must pass the bootloader's checks, or the device will reject it
+static bool check_image(const uint8_t *data, uint32_t length)
+{
+   const zimage_header *header = (const zimage_header *) data;
+   section_header sect;
+   uint32_t offset = sizeof(zimage_header);
+   uint32_t sum = 0, i;
+
+   if(length < sizeof(zimage_header) || header->magic != ZIMAGE_MAGIC)
+      return false;
+   for(i = 0; i < header->count; ++i)
+   {
+      if(length - offset < sizeof(sect))
+         return false;
+      memcpy(&sect, data + offset, sizeof(sect));
+      if((sect.length % sizeof(uint32_t)) != 0 || sect.length > length - offset - sizeof(sect))
+         return false;
+      offset += sizeof(sect) + sect.length;
+   }
+   if(length - offset < sizeof(uint32_t))
+      return false;
+
+   for(i = 0; i < offset; i += sizeof(uint32_t))
+      if(i != ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t))
+         sum += *((const uint32_t *) (data + i));
+   return sum == *((const uint32_t *) (data + offset));
+}
+
+int main(int argc, char *argv[])
+{
+   zbundle_header header;
+   zbundle_member table[ZBUNDLE_MAX_MEMBERS];
+   uint8_t *data[ZBUNDLE_MAX_MEMBERS];
+   const char *file;
+   uint32_t idx, boot = 0, total;
+   FILE *f;
+
+   if(argc < 3 || argc - 2 > ZBUNDLE_MAX_MEMBERS)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   header.magic = ZBUNDLE_MAGIC;
+   header.count = argc - 2;
+   for(idx = 0; idx < header.count; ++idx)
+   {
+      file = parse_member(argv[idx + 2], &table[idx]);
+      if(NULL == file)
+      {
+         usage(argv[0]);
+         return 1;
+      }
+      data[idx] = read_file(file, &table[idx].length);
+      if(NULL == data[idx])
+         return 1;
+      if(0 == table[idx].length)
+      {
+         fprintf(stderr, "'%s' is empty\n", file);
+         return 1;
+      }
+      if(table[idx].type == ZBOOT_PARTITION_APP && !check_image(data[idx], table[idx].length))
+      {
+         fprintf(stderr, "'%s' isn't a valid zboot image\n", file);
+         return 1;
+      }
+      if(table[idx].flags & ZBUNDLE_FLAG_BOOT)
+         ++boot;
+      table[idx].crc = zboot_crc32(0, data[idx], table[idx].length);
+   }
+   if(boot > 1)
+   {
+      fprintf(stderr, "Only one image can be booted\n");
+      return 1;
+   }
+   header.crc = zboot_crc32(0, table, header.count * sizeof(zbundle_member));
+
+   f = fopen(argv[1], "wb");
+   if(NULL == f || fwrite(&header, sizeof(header), 1, f) != 1
+   || fwrite(table, sizeof(zbundle_member), header.count, f) != header.count)
+   {
+      fprintf(stderr, "Failed to write '%s'\n", argv[1]);
+      return 1;
+   }
+   total = sizeof(header) + header.count * sizeof(zbundle_member);
+   for(idx = 0; idx < header.count; ++idx)
+   {
+      uint32_t padded = (table[idx].length + sizeof(uint32_t) - 1) & ~3;
+      char index[8];
+
+      if(fwrite(data[idx], 1, padded, f) != padded)
+      {
+         fprintf(stderr, "Failed to write '%s'\n", argv[1]);
+         return 1;
+      }
+      if(table[idx].index == ZBUNDLE_INDEX_ANY)
+         strcpy(index, "any");
+      else
+         sprintf(index, "%u", table[idx].index);
+      printf("Member %u:    type %u, index %s%s, %u bytes, CRC %08x\n", idx, table[idx].type,
+         index, (table[idx].flags & ZBUNDLE_FLAG_BOOT) ? ", boot" : "", table[idx].length,
+         table[idx].crc);
+      total += padded;
+      free(data[idx]);
+   }
+   fclose(f);
+   printf("Bundle:      %u bytes\n", total);
+   return 0;
+}
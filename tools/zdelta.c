@@ -0,0 +1,282 @@
+/* \brief zdelta - make a delta patch between two zboot application images
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * The patch is applied on the device by appcode/zboot-delta.c; see zdelta_header in zboot.h
+ *  for the format. The new image is built from copies of the old one, found by hashing every
+ *  position in the old image, and data from the new one wherever there's no match.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "zboot.h"
+#include "zboot_private.h"
+
+#define HASH_BITS  16
+#define MIN_MATCH  8    // Shortest copy worth a command
+#define MAX_CHAIN  64   // Candidates checked at each position
+
+typedef struct
+{
+   uint8_t *data;
+   uint32_t length;
+   uint32_t used;
+} patch_buffer;
+
+static void usage(const char *name)
+{
+   fprintf(stderr, "Usage: %s old.bin new.bin patch.bin\n", name);
+}
+
+static uint8_t *read_file(const char *filename, uint32_t *length)
+{
+   uint8_t *data;
+   long size;
+   FILE *f;
+
+   f = fopen(filename, "rb");
+   if(NULL == f)
+   {
+      fprintf(stderr, "Failed to open '%s'\n", filename);
+      return NULL;
+   }
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+   rewind(f);
+   data = malloc(size + sizeof(uint32_t));
+   if(NULL == data || fread(data, 1, size, f) != (size_t) size)
+   {
+      fprintf(stderr, "Failed to read '%s'\n", filename);
+      free(data);
+      data = NULL;
+   }
+   else
+   {
+      memset(data + size, 0, sizeof(uint32_t));  // Pads the last word for checksums
+      *length = size;
+   }
+   fclose(f);
+   return data;
+}
+
+// Find the length of an image, up to and including its checksum word, and check the checksum
+static bool image_length(const uint8_t *data, uint32_t size, uint32_t *length, uint32_t *chksum)
+{
+   const zimage_header *header = (const zimage_header *) data;
+   section_header sect;
+   uint32_t offset = sizeof(zimage_header);
+   uint32_t sum = 0, i;
+
+   if(size < sizeof(zimage_header) || header->magic != ZIMAGE_MAGIC)
+      return false;
+   for(i = 0; i < header->count; ++i)
+   {
+      if(size - offset < sizeof(sect))
+         return false;
+      memcpy(&sect, data + offset, sizeof(sect));
+      if((sect.length % sizeof(uint32_t)) != 0 || sect.length > size - offset - sizeof(sect))
+         return false;
+      offset += sizeof(sect) + sect.length;
+   }
+   if(size - offset < sizeof(uint32_t))
+      return false;
+
+   for(i = 0; i < offset; i += sizeof(uint32_t))
+      if(i != ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t))
+         sum += *((const uint32_t *) (data + i));
+   if(sum != *((const uint32_t *) (data + offset)))
+      return false;
+   *length = offset + sizeof(uint32_t);
+   *chksum = sum;
+   return true;
+}
+
+static uint32_t hash(const uint8_t *data)
+{
+   uint32_t a, b;
+
+   memcpy(&a, data, sizeof(a));
+   memcpy(&b, data + sizeof(a), sizeof(b));
+   return ((a * 2654435761u) ^ (b * 2246822519u)) >> (32 - HASH_BITS);
+}
+
+// Length of the match between the old image at 'source' and the new one at 'target'. The old
+//  image's state word can't be copied, since it changes on the device.
+static uint32_t match_length(const uint8_t *old, uint32_t oldLength, uint32_t source,
+   const uint8_t *new, uint32_t newLength, uint32_t target)
+{
+   const uint32_t stateOffset = ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t);
+   uint32_t limit = oldLength - source;
+   uint32_t len;
+
+   if(limit > newLength - target)
+      limit = newLength - target;
+   if(source < stateOffset)
+   {
+      if(limit > stateOffset - source)
+         limit = stateOffset - source;
+   }
+   else if(source < stateOffset + sizeof(uint32_t))
+      limit = 0;
+   for(len = 0; len < limit && old[source + len] == new[target + len]; ++len)
+      ;
+   return len;
+}
+
+static void put_byte(patch_buffer *patch, uint8_t value)
+{
+   if(patch->used == patch->length)
+   {
+      patch->length *= 2;
+      patch->data = realloc(patch->data, patch->length);
+      if(NULL == patch->data)
+      {
+         fprintf(stderr, "Out of memory\n");
+         exit(1);
+      }
+   }
+   patch->data[patch->used++] = value;
+}
+
+static void put_value(patch_buffer *patch, uint32_t value)
+{
+   for(; value >= 0x80; value >>= 7)
+      put_byte(patch, (value & 0x7f) | 0x80);
+   put_byte(patch, value);
+}
+
+static void put_data(patch_buffer *patch, const uint8_t *data, uint32_t length)
+{
+   uint32_t i;
+
+   if(0 == length)
+      return;
+   put_byte(patch, ZDELTA_DATA);
+   put_value(patch, length);
+   for(i = 0; i < length; ++i)
+      put_byte(patch, data[i]);
+}
+
+int main(int argc, char *argv[])
+{
+   zdelta_header header;
+   patch_buffer patch;
+   uint8_t *old, *new;
+   int32_t *head, *chain;
+   uint32_t oldSize, newSize, newLength, newChksum, i;
+   uint32_t pos, literal = 0, copied = 0, copies = 0, sourceEnd = 0;
+   int32_t displacement = 0;
+   FILE *f;
+
+   if(argc != 4)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   old = read_file(argv[1], &oldSize);
+   new = read_file(argv[2], &newSize);
+   if(NULL == old || NULL == new)
+      return 1;
+
+   header.magic = ZDELTA_MAGIC;
+   if(!image_length(old, oldSize, &header.source_length, &header.source_chksum))
+   {
+      fprintf(stderr, "'%s' isn't a valid zboot image\n", argv[1]);
+      return 1;
+   }
+   if(!image_length(new, newSize, &newLength, &newChksum))
+   {
+      fprintf(stderr, "'%s' isn't a valid zboot image\n", argv[2]);
+      return 1;
+   }
+   header.target_length = newSize;  // Including anything after the image
+   header.target_chksum = 0;
+   for(i = 0; i < newSize; i += sizeof(uint32_t))
+      header.target_chksum += *((const uint32_t *) (new + i));
+
+   // Index every position in the old image, most recent first in each chain
+   head = malloc(sizeof(int32_t) << HASH_BITS);
+   chain = malloc(sizeof(int32_t) * (header.source_length + 1));
+   patch.length = 4096;
+   patch.used = 0;
+   patch.data = malloc(patch.length);
+   if(NULL == head || NULL == chain || NULL == patch.data)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   memset(head, 0xff, sizeof(int32_t) << HASH_BITS);
+   for(i = 0; i + MIN_MATCH <= header.source_length; ++i)
+   {
+      uint32_t key = hash(old + i);
+      chain[i] = head[key];
+      head[key] = i;
+   }
+
+   memcpy(patch.data, &header, sizeof(header));
+   patch.used = sizeof(header);
+   for(pos = 0; pos + MIN_MATCH <= newSize; )
+   {
+      uint32_t bestLength = 0, bestSource = 0, len, n;
+      int32_t source;
+
+      // Code that's moved shifts everything after it by the same amount, so the position
+      //  following on from the last copy is tried first
+      if(copies > 0 && (int64_t) pos + displacement >= 0
+      && (int64_t) pos + displacement < header.source_length)
+      {
+         bestSource = pos + displacement;
+         bestLength = match_length(old, header.source_length, bestSource, new, newSize, pos);
+      }
+      for(source = head[hash(new + pos)], n = 0; source >= 0 && n < MAX_CHAIN;
+         source = chain[source], ++n)
+      {
+         len = match_length(old, header.source_length, source, new, newSize, pos);
+         if(len > bestLength)
+         {
+            bestLength = len;
+            bestSource = source;
+         }
+      }
+
+      if(bestLength < MIN_MATCH)
+      {
+         ++pos;
+         continue;
+      }
+      put_data(&patch, new + literal, pos - literal);
+      put_byte(&patch, ZDELTA_COPY);
+      put_value(&patch, bestLength);
+      source = (int32_t) bestSource - (int32_t) sourceEnd;
+      put_value(&patch, ((uint32_t) source << 1) ^ (uint32_t) (source >> 31));
+      sourceEnd = bestSource + bestLength;
+      displacement = (int32_t) bestSource - (int32_t) pos;
+      copied += bestLength;
+      ++copies;
+      pos += bestLength;
+      literal = pos;
+   }
+   put_data(&patch, new + literal, newSize - literal);
+   put_byte(&patch, ZDELTA_END);
+
+   f = fopen(argv[3], "wb");
+   if(NULL == f || fwrite(patch.data, 1, patch.used, f) != patch.used)
+   {
+      fprintf(stderr, "Failed to write '%s'\n", argv[3]);
+      return 1;
+   }
+   fclose(f);
+
+   printf("Patch:       %u bytes, %.1f%% of the new image\n", patch.used,
+      100.0 * patch.used / newSize);
+   printf("Copied:      %u bytes in %u copies\n", copied, copies);
+   printf("Data:        %u bytes\n", newSize - copied);
+   free(patch.data);
+   free(chain);
+   free(head);
+   free(old);
+   free(new);
+   return 0;
+}
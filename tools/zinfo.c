@@ -0,0 +1,215 @@
+/* \brief zinfo - display and check zboot application images
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "zboot.h"
+#include "zboot_private.h"
+#include "zboot_util.h"
+
+static void usage(const char *name)
+{
+   fprintf(stderr, "Usage: %s [-a address] [-l offset | -i] image.bin\n", name);
+   fprintf(stderr, "  -a address  Check whether the image can execute from this flash address\n");
+   fprintf(stderr, "  -l offset   Record the offset within a 1MB flash window that the image's\n");
+   fprintf(stderr, "              flash-mapped code is linked for, updating the image\n");
+   fprintf(stderr, "  -i          Record that the image has no flash-mapped code, updating the image\n");
+}
+
+// Update the image's relocation information, and its checksum to match
+static bool update_relocation(const char *filename, zimage_header *header, uint32_t checksumPos,
+   uint32_t chksum, uint32_t flags, uint32_t linkOffset)
+{
+   FILE *f;
+   bool result;
+
+   chksum -= header->flags + header->link_offset;
+   header->flags = (header->flags & ~(ZIMAGE_FLAG_LINK_OFFSET | ZIMAGE_FLAG_IRAM_ONLY)) | flags;
+   header->link_offset = linkOffset;
+   chksum += header->flags + header->link_offset;
+
+   f = fopen(filename, "r+b");
+   if(NULL == f)
+      return false;
+   result = fwrite(header, sizeof(*header), 1, f) == 1
+      && fseek(f, checksumPos, SEEK_SET) == 0
+      && fwrite(&chksum, sizeof(chksum), 1, f) == 1;
+   return (fclose(f) == 0) && result;
+}
+
+static bool read_words(FILE *f, void *buffer, uint32_t length, uint32_t *chksum)
+{
+   uint32_t i;
+
+   if(fread(buffer, 1, length, f) != length)
+      return false;
+   if(NULL != chksum)
+      for(i = 0; i < length; i += sizeof(uint32_t))
+         *chksum += *((uint32_t *) (((uint8_t *) buffer) + i));
+   return true;
+}
+
+int main(int argc, char *argv[])
+{
+   zimage_header header;
+   section_header sect;
+   uint8_t buffer[BUFFER_SIZE];
+   uint32_t chksum = 0, expected, address = 0, linkOffset = 0, setFlags = 0, checksumPos = 0, i;
+   bool checkAddress = false, flashMapped = false;
+   const char *filename = NULL;
+   FILE *f;
+   int arg, result = 0;
+
+   for(arg = 1; arg < argc; ++arg)
+   {
+      if(strcmp(argv[arg], "-a") == 0 && arg + 1 < argc)
+      {
+         address = strtoul(argv[++arg], NULL, 0);
+         checkAddress = true;
+      }
+      else if(strcmp(argv[arg], "-l") == 0 && arg + 1 < argc && 0 == setFlags)
+      {
+         linkOffset = strtoul(argv[++arg], NULL, 0);
+         setFlags = ZIMAGE_FLAG_LINK_OFFSET;
+         if(linkOffset >= ZBOOT_FLASH_WINDOW_SIZE || (linkOffset % SECTOR_SIZE) != 0)
+         {
+            fprintf(stderr, "Link offset must be a sector within a 1MB window\n");
+            return 1;
+         }
+      }
+      else if(strcmp(argv[arg], "-i") == 0 && 0 == setFlags)
+         setFlags = ZIMAGE_FLAG_IRAM_ONLY;
+      else if(argv[arg][0] != '-' && NULL == filename)
+         filename = argv[arg];
+      else
+      {
+         usage(argv[0]);
+         return 1;
+      }
+   }
+   if(NULL == filename)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   f = fopen(filename, "rb");
+   if(NULL == f)
+   {
+      fprintf(stderr, "Failed to open '%s'\n", filename);
+      return 1;
+   }
+
+   if(!read_words(f, &header, sizeof(header), &chksum) || header.magic != ZIMAGE_MAGIC)
+   {
+      fprintf(stderr, "Not a zboot image\n");
+      fclose(f);
+      return 1;
+   }
+   chksum -= header.state;  // Not included in the checksum
+
+   printf("Version:     %08x\n", header.version);
+   printf("Date:        %08x\n", header.date);
+   printf("Entry:       %08x\n", header.entry);
+   printf("Sections:    %u\n", header.count);
+   printf("Description: %.*s\n", (int) sizeof(header.description), header.description);
+   printf("State:       %s\n",
+      (header.state == ZIMAGE_STATE_WRITTEN) ? "written" :
+      (header.state == ZIMAGE_STATE_VERIFIED) ? "verified" :
+      (header.state == ZIMAGE_STATE_CONFIRMED) ? "confirmed" :
+      (header.state == ZIMAGE_STATE_INVALID) ? "invalid" : "not tracked");
+
+   for(i = 0; i < header.count && result == 0; ++i)
+   {
+      uint32_t remaining;
+
+      if(!read_words(f, &sect, sizeof(sect), &chksum) || (sect.length % sizeof(uint32_t)) != 0)
+      {
+         fprintf(stderr, "Section %u: invalid header\n", i);
+         result = 1;
+         break;
+      }
+      printf("Section %u:   address %08x, length %08x%s\n", i, sect.address, sect.length,
+         (sect.address == 0) ? " (flash-mapped)" : "");
+      if(sect.address == 0)
+         flashMapped = true;
+
+      for(remaining = sect.length; remaining > 0; )
+      {
+         uint32_t readlen = (remaining > sizeof(buffer)) ? sizeof(buffer) : remaining;
+         if(!read_words(f, buffer, readlen, &chksum))
+         {
+            fprintf(stderr, "Section %u: truncated\n", i);
+            result = 1;
+            break;
+         }
+         remaining -= readlen;
+      }
+   }
+
+   if(result == 0)
+   {
+      checksumPos = ftell(f);
+      if(!read_words(f, &expected, sizeof(expected), NULL))
+      {
+         fprintf(stderr, "Missing checksum\n");
+         result = 1;
+      }
+      else if(expected != chksum)
+      {
+         fprintf(stderr, "Checksum mismatch (calculated %08x, expected %08x)\n", chksum, expected);
+         result = 1;
+      }
+      else
+         printf("Checksum:    %08x (valid)\n", chksum);
+   }
+   fclose(f);
+
+   if(result == 0 && setFlags != 0)
+   {
+      if(setFlags == ZIMAGE_FLAG_IRAM_ONLY && flashMapped)
+      {
+         fprintf(stderr, "Image has flash-mapped code\n");
+         return 1;
+      }
+      if(!update_relocation(filename, &header, checksumPos, chksum, setFlags, linkOffset))
+      {
+         fprintf(stderr, "Failed to update '%s'\n", filename);
+         return 1;
+      }
+      printf("Updated:     relocation information written\n");
+   }
+
+   if(header.flags & ZIMAGE_FLAG_IRAM_ONLY)
+      printf("Relocation:  any address (no flash-mapped code)\n");
+   else if(header.flags & ZIMAGE_FLAG_LINK_OFFSET)
+      printf("Relocation:  any slot at offset %05x within a 1MB flash window\n", header.link_offset);
+   else if(result == 0 && !flashMapped)
+      printf("Relocation:  WARNING: no relocation information, though the image has no "
+         "flash-mapped code; mark it with -i\n");
+   else
+      printf("Relocation:  WARNING: no relocation information; image must be stored at the "
+         "address it was linked for\n");
+
+   if(checkAddress)
+   {
+      if(!zimage_check_address(&header, address))
+      {
+         fprintf(stderr, "Image can't execute from %08x\n", address);
+         result = 2;
+      }
+      else if(!(header.flags & (ZIMAGE_FLAG_IRAM_ONLY | ZIMAGE_FLAG_LINK_OFFSET)))
+      {
+         fprintf(stderr, "Unable to verify image can execute from %08x\n", address);
+         result = 2;
+      }
+      else
+         printf("Image can execute from %08x\n", address);
+   }
+
+   return result;
+}
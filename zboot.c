@@ -11,6 +11,7 @@
 #include "esprtc.h"
 #include "espgpio.h"
 #include "zboot_util.h"
+#include "zboot_log.h"
 #include "zboot.h"
 #include "zboot_private.h"
 
@@ -37,7 +38,34 @@ uint32_t CacheEnable;
 uint8_t buffer[BUFFER_SIZE];
 zboot_rtc_data rtc;
 zboot_config config;
+zboot_partition_table partitions;
+uint8_t app_count;
 zimage_header zheader;
+zboot_log config_log;
+
+// -------------------------------------------------------------------------------------------------
+// Flash access for the config log
+
+static uint32_t boot_flash_read(uint32_t addr, void *buffer, uint32_t length)
+{
+   return SPIRead(addr, buffer, length);
+}
+
+static uint32_t boot_flash_write(uint32_t addr, const void *buffer, uint32_t length)
+{
+   return SPIWrite(addr, (void *) buffer, length);
+}
+
+static uint32_t boot_flash_erase(uint32_t sector)
+{
+   return SPIEraseSector(sector);
+}
+
+static const zboot_flash_ops boot_flash_ops = {
+   boot_flash_read,
+   boot_flash_write,
+   boot_flash_erase
+};
 
 void __attribute__((section(".final.text"))) load_rom(uint32_t start_addr)
 {
@@ -166,10 +194,22 @@ static uint32_t check_image(uint32_t readpos)
       DBG("Invalid entrypoint (%08x)\n", zheader.entry);
       return 0;
    }
+   if(zheader.state == ZIMAGE_STATE_INVALID)
+   {
+      DBG("Image marked invalid\n");
+      return 0;
+   }
+   if(!zimage_check_address(&zheader, readpos - sizeof(zheader)))
+   {
+      DBG("Image linked for flash offset %08x, not relocatable to %08x\n",
+         zheader.link_offset, readpos - sizeof(zheader));
+      return 0;
+   }
 
-   // Add image header to checksum
+   // Add image header to checksum; the state word changes after the image is written
    for(i = 0; i < sizeof(zheader); i += sizeof(uint32_t))
-      chksum += *((uint32_t *) (((uint8_t *)&zheader) + i));
+      if(i != ZIMAGE_HEADER_OFFSET_STATE * sizeof(uint32_t))
+         chksum += *((uint32_t *) (((uint8_t *)&zheader) + i));
    
    // test each section
    DBG("Calculating checksum of %u sections\n", zheader.count);
@@ -244,9 +284,9 @@ static void calculate_frst_index(uint8_t *index, uint8_t *mode)
    {
       if(rtc.next_mode == ZBOOT_MODE_TEMP_ROM)
       {
-         if(rtc.next_rom >= config.count)
+         if(rtc.next_rom >= app_count)
          {
-            ets_printf("Invalid temp ROM selected (%u, %u max)\n", rtc.next_rom, config.count);
+            ets_printf("Invalid temp ROM selected (%u, %u max)\n", rtc.next_rom, app_count);
          }
          else
          {
@@ -264,7 +304,7 @@ static void calculate_frst_index(uint8_t *index, uint8_t *mode)
          case ZBOOT_MODE_GPIO_ROM:
             if(gpio_asserted(config.gpio_num))
             {
-               if(config.gpio_rom < config.count)
+               if(config.gpio_rom >= app_count)
                {
                   ets_printf("Invalid GPIO ROM selected.\r\n");
                }
@@ -281,7 +321,7 @@ static void calculate_frst_index(uint8_t *index, uint8_t *mode)
             if(gpio_asserted(config.gpio_num))
             {
                bootIndex = config.current_rom + 1;
-               if(bootIndex >= config.count)
+               if(bootIndex >= app_count)
                   bootIndex = 0;
                ets_printf("Booting GPIO-skip ROM index %u\n", bootIndex);
                bootMode = ZBOOT_MODE_GPIO_SKIP;
@@ -293,7 +333,7 @@ static void calculate_frst_index(uint8_t *index, uint8_t *mode)
       }
    }
 
-   if(config.current_rom >= config.count)
+   if(bootIndex >= app_count)
    {
       ets_printf("Invalid ROM selected, defaulting to 0.\n");
       bootIndex = 0;
@@ -335,42 +375,54 @@ void zboot_main(void)
       ZBOOT_VERSION_INCREMENTAL);
    esprom_get_flash_info(&flashSize, &esp_rom_header);
 
-   // Read the zboot config from flash
-   SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &config, sizeof(config));
-   if(config.magic != ZBOOT_CONFIG_MAGIC)
+   // Find the current zboot config and partition table in the config log
+   zboot_log_scan(&boot_flash_ops, &config_log);
+   if(!zboot_log_read(&boot_flash_ops, &config_log, ZBOOT_RECORD_CONFIG, &config, sizeof(config))
+   || config_log.length[ZBOOT_RECORD_CONFIG] != sizeof(config)
+   || config.magic != ZBOOT_CONFIG_MAGIC
+   || !zboot_log_read(&boot_flash_ops, &config_log, ZBOOT_RECORD_PARTITIONS, &partitions,
+         sizeof(partitions))
+   || !zboot_partition_table_valid(&partitions, config_log.length[ZBOOT_RECORD_PARTITIONS]))
    {
-      ets_printf("Invalid zboot config magic\n");
+      ets_printf("No valid zboot config\n");
       updateConfig = true;
    }
-   else
+   if(updateConfig)
    {
-      uint8_t chksum = zboot_config_checksum(&config);
-      if(chksum != config.chksum)
+      if(0 != config_log.legacy
+      && SPIRead(config_log.legacy, buffer, sizeof(zboot_legacy_config)) == 0
+      && convert_legacy_config((zboot_legacy_config *) buffer, &config, &partitions, flashSize,
+         config_log.sectors))
       {
-         ets_printf("zboot config checksum mismatch (%02x calculated, %02x expected)\n",
-            chksum, config.chksum);
-         updateConfig = true;
+         ets_printf("Converting boot config.\n");
       }
+      else
+      {
+         ets_printf("Writing default boot config.\n");
+         default_config(&config, &partitions, flashSize);
+      }
+
+      // The partition table is written first; a legacy config is erased when the log is
+      //  compacted, and the slot addresses can't be recovered from the default config
+      zboot_log_append(&boot_flash_ops, &config_log, ZBOOT_RECORD_PARTITIONS, &partitions,
+         zboot_partition_table_length(partitions.count), buffer, BUFFER_SIZE);
+      zboot_log_append(&boot_flash_ops, &config_log, ZBOOT_RECORD_CONFIG, &config, sizeof(config),
+         buffer, BUFFER_SIZE);
    }
-   if(updateConfig)
-   {
-      ets_printf("Writing default boot config.\n");
-      default_config(&config, flashSize);
-      SPIEraseSector(BOOT_CONFIG_SECTOR);
-      SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &config, sizeof(config));
-   }
+
+   // Application slots are at the start of the partition table
+   for(app_count = 0; app_count < partitions.count
+      && partitions.entry[app_count].type == ZBOOT_PARTITION_APP; ++app_count);
 
    calculate_frst_index(&bootIndex, &bootMode);
 
    // Loop through all ROMs, strting with the selected one
-   for(runAddr = 0, i = 0; runAddr == 0 && i < config.count; ++i)
+   for(runAddr = 0, i = 0; runAddr == 0 && i < app_count; ++i)
    {
-      uint8_t tryIndex = bootIndex + i;
+      uint8_t tryIndex = (bootIndex + i) % app_count;
       uint32_t tryAddress; 
 
-      if(tryIndex >= config.count)
-         tryIndex = 0;
-      tryAddress = config.roms[tryIndex];
+      tryAddress = partitions.entry[tryIndex].address;
       DBG("Checking image %u @ %08x\n", tryIndex, tryAddress); 
 
       runAddr = check_image(tryAddress);
@@ -392,7 +444,7 @@ void zboot_main(void)
    {
       uint8_t sec;
       ets_printf("Erasing SDK config sectors before booting.\r\n");
-      for (sec = 1; sec < 5; sec++)
+      for (sec = 1; sec <= BOOT_SDK_CONFIG_SECTORS; sec++)
       {
          SPIEraseSector((flashSize / SECTOR_SIZE) - sec);
       }
@@ -406,11 +458,11 @@ void zboot_main(void)
       ets_printf("Updating zboot config with ROM index %u\n", bootIndex);
       config.current_rom = bootIndex;
       config.chksum = zboot_config_checksum(&config);
-      SPIEraseSector(BOOT_CONFIG_SECTOR);
-      SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE);
+      zboot_log_append(&boot_flash_ops, &config_log, ZBOOT_RECORD_CONFIG, &config, sizeof(config),
+         buffer, BUFFER_SIZE);
    }
 
-   flashSize = config.roms[bootIndex];
+   flashSize = partitions.entry[bootIndex].address;
 
    // set rtc boot data for app to read
    rtc.magic = ZBOOT_RTC_MAGIC;
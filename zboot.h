@@ -44,33 +44,181 @@ extern "C" {
 
 #define BOOT_CONFIG_SECTOR 2
 
+// number of sectors, starting at BOOT_CONFIG_SECTOR, used for the config log
+//  (see zboot_record_header). With two or more sectors, the previous records
+//  stay intact while the log is compacted, so a power loss can't lose the
+//  config. Each extra sector moves the default slots up by a sector, so
+//  devices already in the field must keep the default of 1.
+//#define BOOT_CONFIG_SECTOR_COUNT 2
+
+// uncomment to keep flash wear counters (see zboot_wear_sector) in the sector
+//  following the config log
+//#define BOOT_WEAR_ENABLED
+
 // defaults for unset user options
+#ifndef BOOT_CONFIG_SECTOR_COUNT
+#define BOOT_CONFIG_SECTOR_COUNT 1
+#endif
+
 #ifndef BOOT_GPIO_NUM
 #define BOOT_GPIO_NUM 16
 #endif
 
+#ifdef BOOT_WEAR_ENABLED
+#define BOOT_WEAR_SECTOR (BOOT_CONFIG_SECTOR + BOOT_CONFIG_SECTOR_COUNT)
+#define BOOT_WEAR_SECTOR_COUNT 1
+#else
+#define BOOT_WEAR_SECTOR_COUNT 0
+#endif
+
+// first sector available for partitions
+#define BOOT_FIRST_FREE_SECTOR \
+   (BOOT_CONFIG_SECTOR + BOOT_CONFIG_SECTOR_COUNT + BOOT_WEAR_SECTOR_COUNT)
+
+// maximum number of application image slots
 #ifndef MAX_ROMS
-#define MAX_ROMS 4
+#define MAX_ROMS 8
+#endif
+
+// maximum number of entries in the partition table, including application slots
+#ifndef MAX_PARTITIONS
+#define MAX_PARTITIONS 32
 #endif
 
+// sectors at the end of flash reserved for SDK configuration
+#define BOOT_SDK_CONFIG_SECTORS 4
+
 // --------------------------------------------------------------------------------------------
 
-#pragma pack(push,1)
+#pragma pack(push,0)
 typedef struct {
    uint32_t magic;
-      #define ZBOOT_CONFIG_MAGIC 0xdcce4b28 
+      #define ZBOOT_CONFIG_MAGIC 0xdcce4b29
    uint8_t mode;            /* one of ZBOOT_MODE_* */
    uint8_t current_rom;     ///< Currently selected ROM (will be used for next standard boot)
    uint8_t gpio_rom;        ///< ROM to use for GPIO boot (hardware switch) with mode set to MODE_GPIO_ROM
-   uint8_t count;           ///< Quantity of ROMs available to boot
-   uint32_t roms[MAX_ROMS]; ///< Flash addresses of each ROM
    uint8_t failsafe_rom;
    uint8_t options;         /* one of ZBOOT_OPTION_* */
    uint8_t gpio_num;
+   uint8_t reserved;
    uint8_t chksum;          ///< Checksum of this configuration structure
 } zboot_config;
 #pragma pack(pop)
 
+// Configuration written by zboot versions without a partition table
+#pragma pack(push,1)
+typedef struct {
+   uint32_t magic;
+      #define ZBOOT_LEGACY_CONFIG_MAGIC 0xdcce4b28
+   uint8_t mode;
+   uint8_t current_rom;
+   uint8_t gpio_rom;
+   uint8_t count;
+   uint32_t roms[4];
+   uint8_t failsafe_rom;
+   uint8_t options;
+   uint8_t gpio_num;
+   uint8_t chksum;
+} zboot_legacy_config;
+#pragma pack(pop)
+
+// --------------------------------------------------------------------------------------------
+
+// Flash partitions, sorted by type so the n-th partition of a type can be found directly.
+//  Application image slots (ZBOOT_PARTITION_APP) come first; "ROM index" n is entry n.
+//  Only the first 'count' entries are stored.
+
+#define ZBOOT_PARTITION_TABLE_VERSION 1
+
+#pragma pack(push,0)
+typedef struct {
+   uint16_t version;    ///< ZBOOT_PARTITION_TABLE_VERSION
+   uint16_t count;      ///< Number of entries in use
+   zboot_partition entry[MAX_PARTITIONS];
+} zboot_partition_table;
+#pragma pack(pop)
+
+#define zboot_partition_table_length(count) \
+   (sizeof(zboot_partition_table) - (MAX_PARTITIONS - (count)) * sizeof(zboot_partition))
+
+// --------------------------------------------------------------------------------------------
+
+// The config sectors hold a log of records, each a header followed by its payload. Updates
+//  are appended to erased flash, and the newest valid record of each type is current. When
+//  the active sector is full, the next sector is erased and the current record of each type
+//  is copied there. A sector starting with ZBOOT_LEGACY_CONFIG_MAGIC holds a single,
+//  headerless zboot_legacy_config written by an earlier version of zboot.
+
+#pragma pack(push,0)
+typedef struct {
+   uint32_t magic;
+      #define ZBOOT_RECORD_MAGIC 0x5a4c4f47
+   uint32_t sequence;  ///< Incremented for each record written
+   uint16_t type;      ///< One of ZBOOT_RECORD_*
+   uint16_t length;    ///< Payload length in bytes (multiple of 4)
+   uint32_t chksum;    ///< zboot_checksum32 of the payload, seeded with the fields above
+} zboot_record_header;
+#pragma pack(pop)
+
+#define ZBOOT_RECORD_CONFIG     0   // zboot_config
+#define ZBOOT_RECORD_CATALOG    1   // zboot_catalog
+#define ZBOOT_RECORD_PARTITIONS 2   // zboot_partition_table
+#define ZBOOT_RECORD_PROGRESS   3   // zboot_write_progress, or empty if there's none
+#define ZBOOT_RECORD_SLOT       4   // zboot_catalog_entry of slot (type - ZBOOT_RECORD_SLOT),
+                                    //  overriding the catalog record if it's newer
+#define ZBOOT_RECORD_TYPES      (ZBOOT_RECORD_SLOT + MAX_ROMS)
+
+// --------------------------------------------------------------------------------------------
+
+// Flash wear counters. Sector erases are counted per region of ZBOOT_WEAR_REGION_SIZE bytes.
+//  Each erase clears the next bit of the region's tally, so counting it is a single write;
+//  when a tally is used up, the tallies are added to the base counts and the sector is
+//  erased and rewritten.
+
+#define ZBOOT_WEAR_REGION_SIZE  0x10000
+#define ZBOOT_WEAR_REGIONS      64       // Covers 4MB of flash
+#define ZBOOT_WEAR_TALLY_WORDS  14
+#define ZBOOT_WEAR_TALLY_BITS   (ZBOOT_WEAR_TALLY_WORDS * 32)
+
+#pragma pack(push,0)
+typedef struct {
+   uint32_t magic;
+      #define ZBOOT_WEAR_MAGIC 0x5a574541
+   uint32_t regions;                          // ZBOOT_WEAR_REGIONS
+   uint32_t base[ZBOOT_WEAR_REGIONS];         // Erases counted before the last fold
+} zboot_wear_header;
+
+typedef struct {
+   zboot_wear_header header;
+   uint32_t tally[ZBOOT_WEAR_REGIONS][ZBOOT_WEAR_TALLY_WORDS];  // One cleared bit per erase
+} zboot_wear_sector;
+#pragma pack(pop)
+
+// --------------------------------------------------------------------------------------------
+
+// Summary of the image in each slot, kept up to date by the application API so the images
+//  can be listed without reading each image header. A rebuilt catalog is written as a
+//  single record, and each later change as a record for just the slot that changed.
+
+#pragma pack(push,0)
+typedef struct {
+   uint32_t address;      ///< Address of the slot this entry describes
+   uint32_t flags;        ///< ZBOOT_CATALOG_*
+      #define ZBOOT_CATALOG_IMAGE   0x01  // Slot contains an image with a valid header
+      #define ZBOOT_CATALOG_WRITTEN 0x02  // Written by the API; length and chksum are known
+      #define ZBOOT_CATALOG_VERIFIED 0x04 // Checksum verified while the image was written
+   uint32_t version;
+   uint32_t date;
+   uint32_t length;       ///< Image length in bytes
+   uint32_t chksum;       ///< Image checksum (last word of the image)
+   char     description[88];
+} zboot_catalog_entry;
+
+typedef struct {
+   zboot_catalog_entry entry[MAX_ROMS];
+} zboot_catalog;
+#pragma pack(pop)
+
 // --------------------------------------------------------------------------------------------
 
 #define ZBOOT_RTC_ADDR 64  // Start of RTC "user" area
@@ -91,6 +239,31 @@ typedef struct {
 } zboot_rtc_data;
 #pragma pack(pop)
 
+// Progress of an image write started with zboot_write_resume(), so that it can continue
+//  after a reset or a lost connection. It's saved in RTC memory, following zboot_rtc_data,
+//  at each sector boundary, and in the config log less often.
+#pragma pack(push,0)
+typedef struct {
+   uint32_t magic;
+      #define ZBOOT_PROGRESS_MAGIC 0x5a505247
+   uint32_t image_id;       ///< Identifies the image being written; chosen by the application
+   uint32_t image_addr;
+   uint32_t image_size;     ///< Expected size, or 0 if unknown
+   uint32_t written;        ///< Bytes written, ending on a sector boundary
+   uint32_t chksum;         ///< Image checksum of those bytes
+   uint32_t image_extent;   ///< Image parser state, at the end of those bytes
+   uint32_t parse_next;
+   uint32_t sections_left;
+   uint8_t parse_field;
+   uint8_t verify;
+   uint8_t options;
+   uint8_t reserved;
+   uint32_t check;          ///< zboot_checksum32 of the fields above
+} zboot_write_progress;
+#pragma pack(pop)
+
+#define ZBOOT_RTC_PROGRESS_ADDR (ZBOOT_RTC_ADDR + sizeof(zboot_rtc_data))
+
 // --------------------------------------------------------------------------------------------
 
 #define ZIMAGE_HEADER_OFFSET_MAGIC   0
@@ -98,6 +271,9 @@ typedef struct {
 #define ZIMAGE_HEADER_OFFSET_ENTRY   2
 #define ZIMAGE_HEADER_OFFSET_VERSION 3
 #define ZIMAGE_HEADER_OFFSET_DATE    4
+#define ZIMAGE_HEADER_OFFSET_FLAGS   5
+#define ZIMAGE_HEADER_OFFSET_LINK    6
+#define ZIMAGE_HEADER_OFFSET_STATE   7
 
 #pragma pack(push,0)
 typedef struct
@@ -108,11 +284,65 @@ typedef struct
    uint32_t entry;     // entrypoint address
    uint32_t version;
    uint32_t date;
-   uint32_t reserved[3];
+   uint32_t flags;        // ZIMAGE_FLAG_*
+      #define ZIMAGE_FLAG_LINK_OFFSET  0x00000001  // link_offset is valid
+      #define ZIMAGE_FLAG_IRAM_ONLY    0x00000002  // No flash-mapped code; runs from any address
+   uint32_t link_offset;  // Offset within the 1MB flash window that flash-mapped code is linked for
+   uint32_t state;        // ZIMAGE_STATE_*; not included in the image checksum
    char     description[88];
 } zimage_header;
+
+// The ESP8266 cache maps one 1MB window of flash at 0x40200000. An image with flash-mapped
+//  code is linked for its offset within that window, so it can run from any slot located at
+//  the same offset within a different window.
+#define ZBOOT_FLASH_WINDOW_SIZE 0x100000
 #pragma pack(pop)
 
+// --------------------------------------------------------------------------------------------
+
+// Delta patch, made by tools/zdelta and applied by appcode/zboot-delta.c. The header is
+//  followed by commands, each an opcode byte followed by values encoded as LEB128.
+typedef struct
+{
+   uint32_t magic;
+      #define ZDELTA_MAGIC 0x31544c44  // "DLT1"
+   uint32_t source_length;  // Image the patch applies to, up to and including its checksum word
+   uint32_t source_chksum;  //  and its image checksum
+   uint32_t target_length;  // File the patch produces
+   uint32_t target_chksum;  //  and the sum of its words, with the last one zero-padded
+} zdelta_header;
+
+#define ZDELTA_END   0x00
+#define ZDELTA_COPY  0x01  // Length, then source offset relative to the end of the last copy, zigzag encoded
+#define ZDELTA_DATA  0x02  // Length, then that many bytes
+
+// --------------------------------------------------------------------------------------------
+
+// Bundle of images sent as one stream, made by tools/zbundle and written by
+//  appcode/zboot-bundle.c. The header is followed by a table of 'count' members, then each
+//  member's data in the same order, padded to a multiple of 4 bytes.
+#define ZBUNDLE_MAX_MEMBERS 8
+
+typedef struct
+{
+   uint8_t type;        // ZBOOT_PARTITION_* the member is written to
+   uint8_t index;       //  and which partition of that type, or ZBUNDLE_INDEX_ANY
+      #define ZBUNDLE_INDEX_ANY 0xff  // Application slot or spare partition chosen by the device
+   uint8_t flags;
+      #define ZBUNDLE_FLAG_BOOT 0x01  // Application image to boot once the bundle is committed
+   uint8_t reserved;
+   uint32_t length;
+   uint32_t crc;        // zboot_crc32 of the data
+} zbundle_member;
+
+typedef struct
+{
+   uint32_t magic;
+      #define ZBUNDLE_MAGIC 0x4c444e42  // "BNDL"
+   uint32_t count;      // Members, up to ZBUNDLE_MAX_MEMBERS
+   uint32_t crc;        // zboot_crc32 of the member table
+} zbundle_header;
+
 #ifdef __cplusplus
 }
 #endif
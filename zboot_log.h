@@ -0,0 +1,311 @@
+/* \brief zboot - bootloader for ESP8266
+ * Copyright 2018 Zorxx Software, zorxx@zorxx.com
+ * See license.txt for license terms.
+ *
+ * Config log, shared by the bootloader and the application API. See zboot_record_header
+ *  for a description of the format.
+ */
+#ifndef ZBOOT_LOG_H
+#define ZBOOT_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esprom.h"
+#include "zboot.h"
+#include "zboot_util.h"
+
+// Flash access functions, each returning 0 on success. Buffers must be 4-byte aligned.
+typedef struct
+{
+   uint32_t (*read)(uint32_t addr, void *buffer, uint32_t length);
+   uint32_t (*write)(uint32_t addr, const void *buffer, uint32_t length);
+   uint32_t (*erase)(uint32_t sector);
+} zboot_flash_ops;
+
+typedef struct
+{
+   uint32_t address[ZBOOT_RECORD_TYPES];   // Payload address of the current record of each type, 0 if none
+   uint32_t sequence[ZBOOT_RECORD_TYPES];
+   uint16_t length[ZBOOT_RECORD_TYPES];
+   uint32_t next_sequence;
+   uint32_t write_addr;  // Next free location in the active sector, 0 if it's full
+   uint32_t legacy;      // Address of a zboot_legacy_config, 0 if none
+   uint8_t active;       // Log sector holding the newest record
+   uint8_t sectors;      // Log sectors in use; see zboot_log_sector_foreign()
+} zboot_log;
+
+#define ZBOOT_LOG_SECTOR_ADDR(index) ((BOOT_CONFIG_SECTOR + (index)) * SECTOR_SIZE)
+#define ZBOOT_LOG_ERASED 0xffffffff
+
+static inline uint32_t zboot_checksum32(uint32_t chksum, const void *data, uint32_t length)
+{
+   const uint32_t *word = (const uint32_t *) data;
+   for(; length >= sizeof(uint32_t); length -= sizeof(uint32_t), ++word)
+      chksum += *word;
+   return chksum;
+}
+
+#define zboot_record_seed(header) \
+   ((header)->sequence + (((uint32_t) (header)->type << 16) | (header)->length))
+
+static inline bool zboot_log_checksum(const zboot_flash_ops *ops, uint32_t addr, uint32_t length,
+   uint32_t *chksum)
+{
+   uint32_t chunk[32];
+
+   while(length > 0)
+   {
+      uint32_t readlen = (length > sizeof(chunk)) ? sizeof(chunk) : length;
+      if(ops->read(addr, chunk, readlen) != 0)
+         return false;
+      *chksum = zboot_checksum32(*chksum, chunk, readlen);
+      addr += readlen;
+      length -= readlen;
+   }
+   return true;
+}
+
+// True if a log sector after the first holds something other than the log: its first word
+//  is neither erased nor a record. That's an image in a slot laid out for a smaller log,
+//  such as one at 0x3000 on a device that was built with a single log sector; it's never
+//  erased, and the log is limited to the sectors before it.
+static inline bool zboot_log_sector_foreign(const zboot_flash_ops *ops, uint8_t sector)
+{
+   uint32_t magic;
+
+   if(ops->read(ZBOOT_LOG_SECTOR_ADDR(sector), &magic, sizeof(magic)) != 0)
+      return true;
+   return magic != ZBOOT_LOG_ERASED && magic != ZBOOT_RECORD_MAGIC;
+}
+
+// Locate the current record of each type, and the location where the next record will be written
+static inline void zboot_log_scan(const zboot_flash_ops *ops, zboot_log *log)
+{
+   zboot_record_header header;
+   uint32_t active_end = SECTOR_SIZE;
+   uint8_t sector;
+   uint16_t type;
+
+   for(type = 0; type < ZBOOT_RECORD_TYPES; ++type)
+   {
+      log->address[type] = 0;
+      log->sequence[type] = 0;
+      log->length[type] = 0;
+   }
+   log->next_sequence = 1;
+   log->legacy = 0;
+   log->active = 0;
+   log->sectors = BOOT_CONFIG_SECTOR_COUNT;
+
+   for(sector = 0; sector < log->sectors; ++sector)
+   {
+      uint32_t base = ZBOOT_LOG_SECTOR_ADDR(sector);
+      uint32_t offset = 0;
+      bool newest = false;
+
+      if(sector > 0 && zboot_log_sector_foreign(ops, sector))
+      {
+         log->sectors = sector;
+         break;
+      }
+
+      while(offset + sizeof(header) <= SECTOR_SIZE)
+      {
+         uint32_t chksum;
+
+         if(ops->read(base + offset, &header, sizeof(header)) != 0)
+         {
+            offset = SECTOR_SIZE;
+            break;
+         }
+         if(header.magic == ZBOOT_LOG_ERASED)
+            break;  // Start of free space
+
+         if(offset == 0 && header.magic == ZBOOT_LEGACY_CONFIG_MAGIC)
+         {
+            // Sector written by a previous version of zboot; the bootloader converts it
+            //  if there's no config record
+            log->legacy = base;
+            offset = SECTOR_SIZE;
+            break;
+         }
+
+         if(header.magic != ZBOOT_RECORD_MAGIC || (header.length % sizeof(uint32_t)) != 0
+         || header.length > SECTOR_SIZE - sizeof(header) - offset)
+         {
+            offset = SECTOR_SIZE;  // Corrupt; don't append to this sector
+            break;
+         }
+         offset += sizeof(header);
+
+         chksum = zboot_record_seed(&header);
+         if(header.type < ZBOOT_RECORD_TYPES
+         && zboot_log_checksum(ops, base + offset, header.length, &chksum)
+         && chksum == header.chksum
+         && (0 == log->address[header.type] || header.sequence > log->sequence[header.type]))
+         {
+            log->address[header.type] = base + offset;
+            log->sequence[header.type] = header.sequence;
+            log->length[header.type] = header.length;
+         }
+         if(header.sequence >= log->next_sequence)
+         {
+            log->next_sequence = header.sequence + 1;
+            newest = true;
+         }
+         offset += header.length;
+      }
+
+      if(newest || sector == 0)
+      {
+         log->active = sector;
+         active_end = offset;
+      }
+   }
+
+   if(active_end + sizeof(header) <= SECTOR_SIZE)
+      log->write_addr = ZBOOT_LOG_SECTOR_ADDR(log->active) + active_end;
+   else
+      log->write_addr = 0;
+}
+
+// Copy the current record of the given type, returning false if there's no such record
+//  or it's larger than maxLength
+static inline bool zboot_log_read(const zboot_flash_ops *ops, const zboot_log *log, uint16_t type,
+   void *payload, uint16_t maxLength)
+{
+   if(type >= ZBOOT_RECORD_TYPES || 0 == log->address[type] || log->length[type] > maxLength)
+      return false;
+   return ops->read(log->address[type], payload, log->length[type]) == 0;
+}
+
+static inline bool zboot_log_write_record(const zboot_flash_ops *ops, zboot_log *log, uint16_t type,
+   const void *payload, uint16_t length)
+{
+   zboot_record_header header;
+   uint32_t addr = log->write_addr;
+   uint32_t chksum;
+
+   header.magic = ZBOOT_RECORD_MAGIC;
+   header.sequence = log->next_sequence;
+   header.type = type;
+   header.length = length;
+   header.chksum = zboot_checksum32(zboot_record_seed(&header), payload, length);
+
+   ++log->next_sequence;
+   log->write_addr = 0;  // Don't append after a failed write
+   if(ops->write(addr, &header, sizeof(header)) != 0)
+      return false;
+   addr += sizeof(header);
+   chksum = zboot_record_seed(&header);
+   if(length > 0 && ops->write(addr, payload, length) != 0)
+      return false;
+   if(!zboot_log_checksum(ops, addr, length, &chksum) || chksum != header.chksum)
+      return false;
+
+   log->address[type] = addr;
+   log->sequence[type] = header.sequence;
+   log->length[type] = length;
+
+   addr += length;
+   if(ZBOOT_LOG_SECTOR_ADDR(log->active) + SECTOR_SIZE - addr >= sizeof(header))
+      log->write_addr = addr;
+   return true;
+}
+
+// Scratch space needed to compact the log before writing a record of the given type
+static inline uint32_t zboot_log_compact_size(const zboot_log *log, uint16_t skip)
+{
+   uint32_t size = 0;
+   uint16_t type;
+
+   for(type = 0; type < ZBOOT_RECORD_TYPES; ++type)
+      if(type != skip && 0 != log->address[type])
+         size += log->length[type];
+   return size;
+}
+
+// Erase the next log sector and copy the current record of each type, other than 'skip',
+//  into it. The payloads are staged in 'scratch' since, with a single log sector, the
+//  sector being erased is the one they're stored in. A sector that has come to hold
+//  other data since the scan isn't erased; the log wraps to the first sector instead.
+static inline bool zboot_log_compact(const zboot_flash_ops *ops, zboot_log *log, uint16_t skip,
+   uint8_t *scratch, uint32_t scratchSize)
+{
+   uint16_t length[ZBOOT_RECORD_TYPES];
+   uint8_t next = (log->active + 1) % log->sectors;
+   uint32_t base;
+   uint32_t used = 0;
+   uint16_t type;
+   bool success = true;
+
+   if(next > 0 && zboot_log_sector_foreign(ops, next))
+   {
+      log->sectors = next;
+      next = 0;
+   }
+   base = ZBOOT_LOG_SECTOR_ADDR(next);
+
+   for(type = 0; type < ZBOOT_RECORD_TYPES; ++type)
+   {
+      length[type] = 0;
+      if(type == skip || 0 == log->address[type])
+         continue;
+      if(used + log->length[type] > scratchSize
+      || ops->read(log->address[type], scratch + used, log->length[type]) != 0)
+         return false;
+      length[type] = log->length[type];
+      used += length[type];
+   }
+
+   log->write_addr = 0;
+   if(ops->erase(BOOT_CONFIG_SECTOR + next) != 0)
+      return false;
+   log->active = next;
+   log->write_addr = base;
+   for(type = 0; type < ZBOOT_RECORD_TYPES; ++type)
+   {
+      if(log->address[type] >= base && log->address[type] < base + SECTOR_SIZE)
+         log->address[type] = 0;
+   }
+   if(log->legacy == base)
+      log->legacy = 0;
+
+   used = 0;
+   for(type = 0; type < ZBOOT_RECORD_TYPES; ++type)
+   {
+      if(0 == length[type])
+         continue;
+      if(!zboot_log_write_record(ops, log, type, scratch + used, length[type]))
+         success = false;
+      used += length[type];
+   }
+   return success;
+}
+
+// True if appending a record of 'length' bytes will compact the log first, which erases a
+//  sector
+static inline bool zboot_log_needs_compact(const zboot_log *log, uint16_t length)
+{
+   uint32_t end = ZBOOT_LOG_SECTOR_ADDR(log->active) + SECTOR_SIZE;
+
+   return 0 == log->write_addr || end - log->write_addr < sizeof(zboot_record_header) + length;
+}
+
+// Append a record, compacting the log first if there's not enough room in the active sector
+static inline bool zboot_log_append(const zboot_flash_ops *ops, zboot_log *log, uint16_t type,
+   const void *payload, uint16_t length, uint8_t *scratch, uint32_t scratchSize)
+{
+   if(type >= ZBOOT_RECORD_TYPES || (length % sizeof(uint32_t)) != 0
+   || length > SECTOR_SIZE - sizeof(zboot_record_header))
+      return false;
+
+   if(zboot_log_needs_compact(log, length))
+   {
+      if(!zboot_log_compact(ops, log, type, scratch, scratchSize))
+         return false;
+   }
+   return zboot_log_write_record(ops, log, type, payload, length);
+}
+
+#endif /* ZBOOT_LOG_H */
@@ -13,11 +13,11 @@
 #endif
 
 #ifndef BOOT_DEFAULT_CONFIG_ROM0
-#define BOOT_DEFAULT_CONFIG_ROM0 (SECTOR_SIZE * (BOOT_CONFIG_SECTOR + 1))
+#define BOOT_DEFAULT_CONFIG_ROM0 (SECTOR_SIZE * BOOT_FIRST_FREE_SECTOR)
 #endif
 
 #ifndef BOOT_DEFAULT_CONFIG_ROM1
-#define BOOT_DEFAULT_CONFIG_ROM1 ((flashsize / 2) + (SECTOR_SIZE * (BOOT_CONFIG_SECTOR + 1)))
+#define BOOT_DEFAULT_CONFIG_ROM1 ((flashsize / 2) + (SECTOR_SIZE * BOOT_FIRST_FREE_SECTOR))
 #endif
 
 #ifndef BOOT_DEFAULT_CONFIG_ROM2
@@ -28,15 +28,40 @@
 #define BOOT_DEFAULT_CONFIG_ROM3 0
 #endif
 
-void default_config(zboot_config *config, uint32_t flashsize)
+// Partitions without a size extend to the start of the next partition, or to the SDK
+//  config sectors at the end of flash
+static void partition_fill_sizes(zboot_partition_table *partitions, uint32_t flashsize)
 {
+   uint32_t flashend = flashsize - (BOOT_SDK_CONFIG_SECTORS * SECTOR_SIZE);
+   uint16_t idx, other;
+
+   for(idx = 0; idx < partitions->count; ++idx)
+   {
+      zboot_partition *entry = &partitions->entry[idx];
+      uint32_t end = flashend;
+
+      if(entry->size != 0 || entry->address == 0 || entry->address >= flashend)
+         continue;
+      for(other = 0; other < partitions->count; ++other)
+      {
+         uint32_t start = partitions->entry[other].address;
+         if(start > entry->address && start < end)
+            end = start;
+      }
+      entry->size = end - entry->address;
+   }
+}
+
+void default_config(zboot_config *config, zboot_partition_table *partitions, uint32_t flashsize)
+{
+   const uint32_t roms[] = {
+      BOOT_DEFAULT_CONFIG_ROM0, BOOT_DEFAULT_CONFIG_ROM1,
+      BOOT_DEFAULT_CONFIG_ROM2, BOOT_DEFAULT_CONFIG_ROM3
+   };
+   uint8_t idx;
+
    ets_memset(config, 0, sizeof(*config));
    config->magic = ZBOOT_CONFIG_MAGIC;
-   config->count = BOOT_DEFAULT_CONFIG_IMAGE_COUNT;
-   config->roms[0] = BOOT_DEFAULT_CONFIG_ROM0;
-   config->roms[1] = BOOT_DEFAULT_CONFIG_ROM1;
-   config->roms[2] = BOOT_DEFAULT_CONFIG_ROM2;
-   config->roms[3] = BOOT_DEFAULT_CONFIG_ROM3;
 #ifdef BOOT_GPIO_ENABLED
    config->mode = ZBOOT_MODE_GPIO_ROM;
 #endif
@@ -44,5 +69,59 @@ void default_config(zboot_config *config, uint32_t flashsize)
    config->mode = ZBOOT_MODE_GPIO_SKIP;
 #endif
    config->chksum = zboot_config_checksum(config);
+
+   ets_memset(partitions, 0, sizeof(*partitions));
+   partitions->version = ZBOOT_PARTITION_TABLE_VERSION;
+   for(idx = 0; idx < BOOT_DEFAULT_CONFIG_IMAGE_COUNT && idx < sizeof(roms)/sizeof(roms[0]); ++idx)
+   {
+      partitions->entry[idx].type = ZBOOT_PARTITION_APP;
+      partitions->entry[idx].address = roms[idx];
+   }
+   partitions->count = idx;
+   partition_fill_sizes(partitions, flashsize);
 }
 
+// Split a config written by an earlier version of zboot into a config and a partition table.
+//  'logSectors' is the number of config log sectors in use, which zboot_log_scan() limits
+//  to those before a slot.
+bool convert_legacy_config(const zboot_legacy_config *legacy, zboot_config *config,
+   zboot_partition_table *partitions, uint32_t flashsize, uint8_t logSectors)
+{
+#ifdef BOOT_WEAR_ENABLED
+   const uint32_t reserved = SECTOR_SIZE * BOOT_FIRST_FREE_SECTOR;
+#else
+   const uint32_t reserved = SECTOR_SIZE * (BOOT_CONFIG_SECTOR + logSectors);
+#endif
+   uint8_t idx;
+
+   if(legacy->magic != ZBOOT_LEGACY_CONFIG_MAGIC
+   || legacy->chksum != zboot_legacy_config_checksum(legacy)
+   || legacy->count > sizeof(legacy->roms)/sizeof(legacy->roms[0]))
+      return false;
+
+   // A slot inside the config log, or the wear sector, would be erased
+   for(idx = 0; idx < legacy->count; ++idx)
+      if(legacy->roms[idx] < reserved)
+         return false;
+
+   ets_memset(config, 0, sizeof(*config));
+   config->magic = ZBOOT_CONFIG_MAGIC;
+   config->mode = legacy->mode;
+   config->current_rom = legacy->current_rom;
+   config->gpio_rom = legacy->gpio_rom;
+   config->failsafe_rom = legacy->failsafe_rom;
+   config->options = legacy->options;
+   config->gpio_num = legacy->gpio_num;
+   config->chksum = zboot_config_checksum(config);
+
+   ets_memset(partitions, 0, sizeof(*partitions));
+   partitions->version = ZBOOT_PARTITION_TABLE_VERSION;
+   partitions->count = legacy->count;
+   for(idx = 0; idx < legacy->count; ++idx)
+   {
+      partitions->entry[idx].type = ZBOOT_PARTITION_APP;
+      partitions->entry[idx].address = legacy->roms[idx];
+   }
+   partition_fill_sizes(partitions, flashsize);
+   return true;
+}
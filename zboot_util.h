@@ -8,14 +8,89 @@
 #define ZBOOT_UTIL_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "esprom.h"
 #include "zboot.h"
 
-void default_config(zboot_config *config, uint32_t flashsize);
+void default_config(zboot_config *config, zboot_partition_table *partitions, uint32_t flashsize);
+bool convert_legacy_config(const zboot_legacy_config *legacy, zboot_config *config,
+   zboot_partition_table *partitions, uint32_t flashsize, uint8_t logSectors);
+
 #define zboot_config_checksum(config) \
       esp_checksum8((uint8_t*)(config), sizeof(zboot_config)-sizeof(uint8_t))
 
+#define zboot_legacy_config_checksum(config) \
+      esp_checksum8((uint8_t*)(config), sizeof(zboot_legacy_config)-sizeof(uint8_t))
+
 #define zboot_rtc_checksum(rtc) \
       esp_checksum8((uint8_t*)(rtc), sizeof(zboot_rtc_data)-sizeof(uint8_t))
 
+// Cache_Read_Enable parameters selecting the 1MB flash window containing an address
+#define zboot_flash_window_odd(addr)  (((addr) >> 20) & 1)
+#define zboot_flash_window_high(addr) (((addr) >> 21) & 1)
+
+// Returns false if the image is known to be linked for a different offset within the
+//  1MB flash window than the one it would execute from. Images built without
+//  relocation information are assumed to be linked for the address they're stored at.
+static inline bool zimage_check_address(const zimage_header *header, uint32_t address)
+{
+   if(header->flags & ZIMAGE_FLAG_IRAM_ONLY)
+      return true;
+   if(header->flags & ZIMAGE_FLAG_LINK_OFFSET)
+      return (address % ZBOOT_FLASH_WINDOW_SIZE) == header->link_offset;
+   return true;
+}
+
+// Returns true if 'length' bytes read from a partition table record describe a usable table:
+//  entries sorted by type, sector aligned, and no more application slots than MAX_ROMS
+static inline bool zboot_partition_table_valid(const zboot_partition_table *table, uint32_t length)
+{
+   uint8_t apps = 0;
+   uint16_t idx;
+
+   if(table->version != ZBOOT_PARTITION_TABLE_VERSION || table->count > MAX_PARTITIONS
+   || length != zboot_partition_table_length(table->count))
+      return false;
+
+   for(idx = 0; idx < table->count; ++idx)
+   {
+      const zboot_partition *entry = &table->entry[idx];
+      if(entry->type >= ZBOOT_PARTITION_TYPES
+      || (idx > 0 && entry->type < table->entry[idx - 1].type)
+      || (entry->address % SECTOR_SIZE) != 0 || (entry->size % SECTOR_SIZE) != 0)
+         return false;
+      if(entry->type == ZBOOT_PARTITION_APP && ++apps > MAX_ROMS)
+         return false;
+   }
+   return true;
+}
+
+// Each image state transition clears a bit of the header's state word, so it can be made
+//  without erasing. Any other value is from an image built without state tracking.
+#define zimage_state_known(state) \
+   ((state) == ZIMAGE_STATE_WRITTEN || (state) == ZIMAGE_STATE_VERIFIED \
+    || (state) == ZIMAGE_STATE_CONFIRMED || (state) == ZIMAGE_STATE_INVALID)
+
+#define zimage_state_transition_valid(from, to) \
+   (zimage_state_known(from) && zimage_state_known(to) && ((to) & ~(from)) == 0)
+
+// CRC-32 as used by zlib and gzip, a nibble at a time. Start with 0, and pass the previous
+//  result to continue.
+static inline uint32_t zboot_crc32(uint32_t crc, const void *data, uint32_t length)
+{
+   static const uint32_t table[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+      0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+   const uint8_t *bytes = (const uint8_t *) data;
+
+   crc = ~crc;
+   while(length-- > 0)
+   {
+      crc ^= *bytes++;
+      crc = (crc >> 4) ^ table[crc & 15];
+      crc = (crc >> 4) ^ table[crc & 15];
+   }
+   return ~crc;
+}
+
 #endif /* ZBOOT_UTIL_H */